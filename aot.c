@@ -0,0 +1,988 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Ahead-of-time compiler.
+ *
+ * jcm-lisp -C out.c module.lsp translates a file of toplevel forms to
+ * C that calls the runtime directly, and jcm-lisp -M out.c ... writes
+ * the table of modules `make aot` links in.  At startup each module's
+ * init function runs its toplevel forms in order.
+ *
+ * A toplevel (define name (lambda ...)) becomes a C function bound to
+ * NAME as a primitive.  Calls from one such procedure to another in
+ * the same module go straight to the C function, so redefining one
+ * later doesn't change what the others call.  Likewise the builtins
+ * + - * eq car cdr cons are open-coded unless the module itself
+ * redefines them.  Fixnum arithmetic stays unboxed while its operands
+ * are known to be fixnums, which literals and the results of other
+ * arithmetic are; anything else is checked as it is unboxed.
+ *
+ * Quoted constants are built once, when the module is loaded, and
+ * like the symbols and globals the code refers to are cached per
+ * thread: each interpreter loads its modules on the thread that runs
+ * it, and a thread runs only one with compiled modules.  pmap's
+ * workers start with a copy of their owner's caches.  Forms
+ * the compiler doesn't handle, such as closures, are kept as data and
+ * handed to eval() at load time instead.
+ *
+ * Generated code keeps its temporaries on the value stack, where the
+ * collector sees them, and owns its argv.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "aot.h"
+#include "scan.h"
+#include "reader.h"
+
+#include <stdarg.h>
+
+#define MAX_AOT_SYMBOLS 1024
+#define MAX_AOT_PROCS 256
+
+struct KnownProc {
+  Object *name;
+  int nparams;
+};
+
+struct Compiler {
+  FILE *fns;          /* function definitions */
+  FILE *consts;       /* constants, built first at load */
+  FILE *init;         /* toplevel forms, run in order at load */
+  FILE *body;         /* body of the function being compiled */
+  int indent;
+
+  Object *syms[MAX_AOT_SYMBOLS];
+  int nsyms;
+  int nconsts;
+  int nthunks;
+  int uses_globals;
+
+  struct KnownProc procs[MAX_AOT_PROCS];
+  int nprocs;
+
+  /* Symbols the module defines or sets, with how often. */
+  Object *assigned[MAX_AOT_SYMBOLS];
+  int assigned_count[MAX_AOT_SYMBOLS];
+  int nassigned;
+
+  /* The function being compiled. */
+  Object *params;
+  struct KnownProc *self;
+  int temps;
+  int loops;
+};
+
+/* A compiled expression: C code for an Object *, or for an unboxed
+ * int when the value is known to be a fixnum.  Any statements it
+ * needed have already been emitted. */
+struct Val {
+  int fixnum;
+  char *code;
+};
+
+static char *format(char *fmt, ...) {
+  char *buff = NULL;
+  va_list ap;
+
+  va_start(ap, fmt);
+  if (vasprintf(&buff, fmt, ap) < 0)
+    error("Out of memory");
+  va_end(ap);
+
+  return buff;
+}
+
+static void emit(struct Compiler *c, char *fmt, ...) {
+  va_list ap;
+
+  fprintf(c->body, "%*s", 2 * c->indent, "");
+  va_start(ap, fmt);
+  vfprintf(c->body, fmt, ap);
+  va_end(ap);
+}
+
+/* NAME made into part of a C identifier.  Anything but a letter
+ * or digit is spelled out in hex, so distinct names stay distinct. */
+static char *mangle(char *name) {
+  char *buff = malloc(3 * strlen(name) + 1);
+  char *p = buff;
+
+  assert(buff != NULL);
+
+  for (; *name != '\0'; name++) {
+    if (isalnum((unsigned char)*name))
+      *p++ = *name;
+    else
+      p += sprintf(p, "_%02x", (unsigned char)*name);
+  }
+  *p = '\0';
+
+  return buff;
+}
+
+/* STR as a C string literal. */
+static char *c_string(char *str) {
+  char *buff = malloc(4 * strlen(str) + 3);
+  char *p = buff;
+
+  assert(buff != NULL);
+
+  *p++ = '"';
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\')
+      p += sprintf(p, "\\%c", *str);
+    else if (isprint((unsigned char)*str))
+      *p++ = *str;
+    else
+      p += sprintf(p, "\\%03o", (unsigned char)*str);
+  }
+  *p++ = '"';
+  *p = '\0';
+
+  return buff;
+}
+
+/* Name of a module: the file name without directory or extension. */
+static char *module_name(char *file) {
+  char *base = strrchr(file, '/');
+  char *name = strdup(base != NULL ? base + 1 : file);
+  char *dot = strrchr(name, '.');
+
+  if (dot != NULL)
+    *dot = '\0';
+
+  char *mangled = mangle(name);
+  free(name);
+  return mangled;
+}
+
+static int symbol_index(struct Compiler *c, Object *symbol) {
+  for (int i = 0; i < c->nsyms; i++) {
+    if (c->syms[i] == symbol)
+      return i;
+  }
+
+  if (c->nsyms == MAX_AOT_SYMBOLS)
+    error("Too many symbols in module");
+
+  c->syms[c->nsyms] = symbol;
+  return c->nsyms++;
+}
+
+/* C expression for the quoted datum OBJ, built at load. */
+static char *constant(struct Compiler *c, Object *obj) {
+  if (obj == s_nil)
+    return strdup("s_nil");
+
+  if (is_symbol(obj))
+    return format("S[%d]", symbol_index(c, obj));
+
+  if (is_fixnum(obj)) {
+    fprintf(c->consts, "  K[%d] = make_fixnum(%d);\n", c->nconsts, obj->num.value);
+  } else if (is_string(obj)) {
+    char *text = c_string(obj->str.text);
+    fprintf(c->consts, "  K[%d] = make_string(%s);\n", c->nconsts, text);
+    free(text);
+  } else if (is_cell(obj)) {
+    char *head = constant(c, car(obj));
+    char *tail = constant(c, cdr(obj));
+    fprintf(c->consts, "  K[%d] = cons(%s, %s);\n", c->nconsts, head, tail);
+    free(head);
+    free(tail);
+  } else {
+    error("Cannot compile constant");
+  }
+
+  return format("K[%d]", c->nconsts++);
+}
+
+static int param_index(Object *params, Object *symbol) {
+  int found = -1;
+
+  // A repeated param means the last one, as in lexical_index().
+  for (int i = 0; is_cell(params); params = cdr(params), i++) {
+    if (car(params) == symbol)
+      found = i;
+  }
+
+  return found;
+}
+
+static int times_assigned(struct Compiler *c, Object *symbol) {
+  for (int i = 0; i < c->nassigned; i++) {
+    if (c->assigned[i] == symbol)
+      return c->assigned_count[i];
+  }
+
+  return 0;
+}
+
+static void note_assignments(struct Compiler *c, Object *obj) {
+  if (!is_cell(obj) || car(obj) == s_quote)
+    return;
+
+  if ((car(obj) == s_define || car(obj) == s_setq ||
+       car(obj) == s_defmacro) &&
+      is_symbol(cadr(obj))) {
+    Object *symbol = cadr(obj);
+    int i;
+
+    for (i = 0; i < c->nassigned && c->assigned[i] != symbol; i++)
+      ;
+
+    if (i == c->nassigned) {
+      if (c->nassigned == MAX_AOT_SYMBOLS)
+        error("Too many symbols in module");
+      c->assigned[c->nassigned] = symbol;
+      c->assigned_count[c->nassigned++] = 0;
+    }
+
+    c->assigned_count[i]++;
+  }
+
+  for (; is_cell(obj); obj = cdr(obj))
+    note_assignments(c, car(obj));
+}
+
+/* Expand the macro calls in OBJ, in place where OBJ is a list,
+ * returning the expansion.  Only the bodies of toplevel lambdas
+ * are expanded, since only those are compiled; the interpreter
+ * expands the rest when the module is loaded. */
+static Object *expand_macros(Object *obj, Object *params, int toplevel) {
+  if (!is_cell(obj) || car(obj) == s_quote)
+    return obj;
+
+  Object *head = car(obj);
+  Object *forms = obj;
+
+  if (is_symbol(head) && param_index(params, head) < 0) {
+    Object *macro = global_macro(head);
+
+    if (macro != NULL) {
+      Object *expansion = macroexpand(macro, obj);
+
+      if (!is_cell(expansion))
+        return expansion;
+
+      setcar(obj, car(expansion));
+      setcdr(obj, cdr(expansion));
+      return expand_macros(obj, params, toplevel);
+    }
+  }
+
+  if (head == s_lambda) {
+    if (!toplevel)
+      return obj;
+
+    params = cadr(obj);
+    forms = cddr(obj);
+    toplevel = 0;
+  }
+
+  for (; is_cell(forms); forms = cdr(forms))
+    setcar(forms, expand_macros(car(forms), params, toplevel));
+
+  return obj;
+}
+
+/* Can OBJ, in a procedure taking PARAMS, be compiled? */
+static int compilable(Object *obj, Object *params) {
+  if (!is_cell(obj))
+    return 1;
+
+  Object *head = car(obj);
+
+  if (head == s_quote)
+    return 1;
+
+  // No closures: compiled params live in argv, not in an env.  (time)
+  // is left to the interpreter.
+  if (head == s_lambda || head == s_defmacro || head == s_time)
+    return 0;
+
+  if (head == s_define || head == s_setq) {
+    if (!is_symbol(cadr(obj)) || param_index(params, cadr(obj)) >= 0)
+      return 0;
+  }
+
+  for (; is_cell(obj); obj = cdr(obj)) {
+    if (!compilable(car(obj), params))
+      return 0;
+  }
+
+  return obj == s_nil;
+}
+
+/* Is OBJ (define name (lambda params body...)), compilable as a C function? */
+static int is_proc_definition(struct Compiler *c, Object *obj) {
+  Object *lambda = car(cddr(obj));
+
+  return (car(obj) == s_define &&
+          is_symbol(cadr(obj)) &&
+          times_assigned(c, cadr(obj)) == 1 &&
+          car(lambda) == s_lambda &&
+          proper_params(cadr(lambda)) &&
+          compilable(cddr(lambda), cadr(lambda)));
+}
+
+static struct KnownProc *known_proc(struct Compiler *c, Object *symbol) {
+  for (int i = 0; i < c->nprocs; i++) {
+    if (c->procs[i].name == symbol)
+      return &c->procs[i];
+  }
+
+  return NULL;
+}
+
+/* Is SYMBOL the builtin NAME, and can it be open-coded? */
+static int is_builtin(struct Compiler *c, Object *symbol, char *name) {
+  return (strcmp(symbol->symbol.name, name) == 0 &&
+          param_index(c->params, symbol) < 0 &&
+          times_assigned(c, symbol) == 0);
+}
+
+static int new_temps(struct Compiler *c, int count) {
+  int first = c->temps;
+
+  c->temps += count;
+  return first;
+}
+
+static struct Val object_val(char *code) {
+  struct Val val = {0, code};
+  return val;
+}
+
+static struct Val fixnum_val(char *code) {
+  struct Val val = {1, code};
+  return val;
+}
+
+static struct Val compile_expr(struct Compiler *c, Object *obj);
+
+/* VAL as an Object *, boxing it if need be. */
+static char *boxed(struct Compiler *c, struct Val val) {
+  if (!val.fixnum)
+    return val.code;
+
+  int t = new_temps(c, 1);
+  emit(c, "v[%d] = make_fixnum(%s);\n", t, val.code);
+  free(val.code);
+  return format("v[%d]", t);
+}
+
+/* VAL as an int, checking it is a fixnum if that isn't known. */
+static char *unboxed(struct Val val) {
+  if (val.fixnum)
+    return val.code;
+
+  char *code = format("AOT_FIXNUM(%s)", val.code);
+  free(val.code);
+  return code;
+}
+
+/* Compile OBJ and store it in DEST.  A literal fixnum is
+ * boxed once, at load, rather than each time it is used. */
+static void compile_into(struct Compiler *c, char *dest, Object *obj) {
+  struct Val val;
+
+  if (is_fixnum(obj))
+    val = object_val(constant(c, obj));
+  else
+    val = compile_expr(c, obj);
+
+  if (val.fixnum)
+    emit(c, "%s = make_fixnum(%s);\n", dest, val.code);
+  else
+    emit(c, "%s = %s;\n", dest, val.code);
+
+  free(val.code);
+}
+
+static char *compile_object(struct Compiler *c, Object *obj) {
+  if (is_fixnum(obj))
+    return constant(c, obj);
+
+  return boxed(c, compile_expr(c, obj));
+}
+
+/* Compile ARGS into COUNT consecutive temps, returning the first. */
+static int compile_args(struct Compiler *c, Object *args, int count) {
+  int base = new_temps(c, count);
+
+  for (int i = 0; i < count; i++, args = cdr(args)) {
+    char *dest = format("v[%d]", base + i);
+    compile_into(c, dest, car(args));
+    free(dest);
+  }
+
+  return base;
+}
+
+/* (eq a b) as a C condition: fixnums with the same value. */
+static char *compile_eq(struct Compiler *c, Object *args) {
+  struct Val a = compile_expr(c, car(args));
+  struct Val b = compile_expr(c, cadr(args));
+  char *test = NULL;
+
+  if (a.fixnum && b.fixnum)
+    test = format("(%s == %s)", a.code, b.code);
+  else if (a.fixnum)
+    test = format("(is_fixnum(%s) && %s->num.value == %s)", b.code, b.code, a.code);
+  else if (b.fixnum)
+    test = format("(is_fixnum(%s) && %s->num.value == %s)", a.code, a.code, b.code);
+  else
+    test = format("(is_fixnum(%s) && is_fixnum(%s) && %s->num.value == %s->num.value)",
+                  a.code, b.code, a.code, b.code);
+
+  free(a.code);
+  free(b.code);
+  return test;
+}
+
+/* OBJ as a C condition, true unless OBJ is nil. */
+static char *compile_test(struct Compiler *c, Object *obj) {
+  if (is_cell(obj) && is_symbol(car(obj)) &&
+      is_builtin(c, car(obj), "eq") && list_length(cdr(obj)) == 2)
+    return compile_eq(c, cdr(obj));
+
+  struct Val val = compile_expr(c, obj);
+
+  // A fixnum is never nil.
+  if (val.fixnum) {
+    free(val.code);
+    return strdup("(1)");
+  }
+
+  char *test = format("(%s != s_nil)", val.code);
+  free(val.code);
+  return test;
+}
+
+static struct Val compile_arith(struct Compiler *c, char op, Object *args, int argc) {
+  if (argc == 0)
+    return fixnum_val(strdup(op == '*' ? "1" : "0"));
+
+  char *code = unboxed(compile_expr(c, car(args)));
+
+  if (op == '-' && argc == 1) {
+    char *negated = format("(-%s)", code);
+    free(code);
+    return fixnum_val(negated);
+  }
+
+  for (args = cdr(args); is_cell(args); args = cdr(args)) {
+    char *arg = unboxed(compile_expr(c, car(args)));
+    char *both = format("(%s %c %s)", code, op, arg);
+    free(code);
+    free(arg);
+    code = both;
+  }
+
+  return fixnum_val(code);
+}
+
+static struct Val compile_call(struct Compiler *c, Object *obj) {
+  Object *head = car(obj);
+  Object *args = cdr(obj);
+  int argc = list_length(args);
+  int t;
+
+  if (is_symbol(head) && param_index(c->params, head) < 0) {
+    struct KnownProc *proc = known_proc(c, head);
+
+    if (is_builtin(c, head, "+"))
+      return compile_arith(c, '+', args, argc);
+    if (is_builtin(c, head, "-") && argc >= 1)
+      return compile_arith(c, '-', args, argc);
+    if (is_builtin(c, head, "*"))
+      return compile_arith(c, '*', args, argc);
+
+    if (is_builtin(c, head, "eq") && argc == 2) {
+      char *test = compile_eq(c, args);
+      struct Val val = object_val(format("(%s ? s_t : s_nil)", test));
+      free(test);
+      return val;
+    }
+
+    if ((is_builtin(c, head, "car") || is_builtin(c, head, "cdr")) && argc == 1) {
+      // Neither allocates, and the result is reachable from the arg.
+      char *arg = compile_object(c, car(args));
+      struct Val val = object_val(format("%s(%s)", head->symbol.name, arg));
+      free(arg);
+      return val;
+    }
+
+    if (is_builtin(c, head, "cons") && argc == 2) {
+      int base = compile_args(c, args, 2);
+      t = new_temps(c, 1);
+      emit(c, "v[%d] = cons(v[%d], v[%d]);\n", t, base, base + 1);
+      return object_val(format("v[%d]", t));
+    }
+
+    if (proc != NULL && proc->nparams == argc) {
+      char *name = mangle(head->symbol.name);
+      int base = compile_args(c, args, argc);
+      t = new_temps(c, 1);
+      emit(c, "v[%d] = f_%s(%d, &v[%d]);\n", t, name, argc, base);
+      free(name);
+      return object_val(format("v[%d]", t));
+    }
+  }
+
+  // The operator goes just below its args.
+  int base = new_temps(c, 1);
+  char *dest = format("v[%d]", base);
+  compile_into(c, dest, head);
+  free(dest);
+  compile_args(c, args, argc);
+
+  t = new_temps(c, 1);
+  emit(c, "v[%d] = call_value(v[%d], %d, &v[%d]);\n", t, base, argc, base + 1);
+  return object_val(format("v[%d]", t));
+}
+
+static struct Val compile_if(struct Compiler *c, Object *obj) {
+  int t = new_temps(c, 1);
+  char *test = compile_test(c, cadr(obj));
+
+  char *dest = format("v[%d]", t);
+
+  emit(c, "if %s {\n", test);
+  c->indent++;
+  compile_into(c, dest, car(cddr(obj)));
+  c->indent--;
+  emit(c, "} else {\n");
+  c->indent++;
+  compile_into(c, dest, cadr(cddr(obj)));
+  c->indent--;
+  emit(c, "}\n");
+
+  free(test);
+  return object_val(dest);
+}
+
+/* Compile OBJ, emitting what it needs done first. */
+static struct Val compile_expr(struct Compiler *c, Object *obj) {
+  if (is_fixnum(obj))
+    return fixnum_val(format("%d", obj->num.value));
+
+  if (obj == s_nil)
+    return object_val(strdup("s_nil"));
+
+  if (is_symbol(obj)) {
+    int i = param_index(c->params, obj);
+
+    if (i >= 0)
+      return object_val(format("argv[%d]", i));
+
+    int t = new_temps(c, 1);
+    emit(c, "v[%d] = cdr(AOT_GLOBAL(%d));\n", t, symbol_index(c, obj));
+    c->uses_globals = 1;
+    return object_val(format("v[%d]", t));
+  }
+
+  if (!is_cell(obj))
+    return object_val(constant(c, obj));
+
+  Object *head = car(obj);
+
+  if (head == s_quote)
+    return object_val(constant(c, cadr(obj)));
+
+  if (head == s_if)
+    return compile_if(c, obj);
+
+  if (head == s_define || head == s_setq) {
+    int i = symbol_index(c, cadr(obj));
+    int t = new_temps(c, 1);
+    char *dest = format("v[%d]", t);
+
+    compile_into(c, dest, car(cddr(obj)));
+    if (head == s_define) {
+      emit(c, "aot_define(S[%d], v[%d]);\n", i, t);
+    } else {
+      emit(c, "setcdr(AOT_GLOBAL(%d), v[%d]);\n", i, t);
+      c->uses_globals = 1;
+    }
+
+    return object_val(dest);
+  }
+
+  return compile_call(c, obj);
+}
+
+/* Compile OBJ as the value the function returns. */
+static void compile_tail(struct Compiler *c, Object *obj) {
+  if (is_cell(obj) && car(obj) == s_if) {
+    char *test = compile_test(c, cadr(obj));
+
+    emit(c, "if %s {\n", test);
+    c->indent++;
+    compile_tail(c, car(cddr(obj)));
+    c->indent--;
+    emit(c, "} else {\n");
+    c->indent++;
+    compile_tail(c, cadr(cddr(obj)));
+    c->indent--;
+    emit(c, "}\n");
+
+    free(test);
+    return;
+  }
+
+  // A call to itself reuses argv and loops.
+  if (is_cell(obj) && c->self != NULL &&
+      car(obj) == c->self->name &&
+      param_index(c->params, car(obj)) < 0 &&
+      list_length(cdr(obj)) == c->self->nparams) {
+    int base = compile_args(c, cdr(obj), c->self->nparams);
+
+    for (int i = 0; i < c->self->nparams; i++)
+      emit(c, "argv[%d] = v[%d];\n", i, base + i);
+    emit(c, "goto top;\n");
+
+    c->loops = 1;
+    return;
+  }
+
+  compile_into(c, "result", obj);
+  emit(c, "goto done;\n");
+}
+
+/* Write C function NAME running BODY, a list of forms, with PARAMS bound. */
+static void compile_function(struct Compiler *c, char *name, Object *params,
+                             Object *body, struct KnownProc *self) {
+  char *text = NULL;
+  size_t size = 0;
+
+  c->body = open_memstream(&text, &size);
+  c->indent = 1;
+  c->params = params;
+  c->self = self;
+  c->temps = 0;
+  c->loops = 0;
+
+  if (body == s_nil)
+    compile_tail(c, s_nil);
+
+  for (; is_cell(body); body = cdr(body)) {
+    if (cdr(body) == s_nil) {
+      compile_tail(c, car(body));
+    } else {
+      struct Val val = compile_expr(c, car(body));
+      free(val.code);
+    }
+  }
+
+  fclose(c->body);
+
+  fprintf(c->fns, "static Object *%s(int argc, Object **argv) {\n", name);
+  fprintf(c->fns, "  Object **v = aot_enter(%d);\n", c->temps);
+  fprintf(c->fns, "  Object *result = s_nil;\n\n");
+  if (c->loops)
+    fprintf(c->fns, " top:\n");
+  fputs(text, c->fns);
+  fprintf(c->fns, "\n done:\n");
+  fprintf(c->fns, "  aot_leave(v);\n");
+  fprintf(c->fns, "  return result;\n");
+  fprintf(c->fns, "}\n\n");
+
+  free(text);
+}
+
+/* Read every form in IN, in order. */
+static Object *read_forms(Reader *in) {
+  Object *forms = s_nil;
+  Object *form = NULL;
+  Object *reversed = s_nil;
+
+  pin_variable((void **)&forms);
+  pin_variable((void **)&form);
+
+  while ((form = read_lisp(in)) != NULL) {
+    if (form != s_nil)
+      forms = cons(form, forms);
+  }
+
+  // Put them back in order, in place.
+  while (forms != s_nil) {
+    Object *next = cdr(forms);
+    setcdr(forms, reversed);
+    reversed = forms;
+    forms = next;
+  }
+
+  unpin_variable((void **)&form);
+  unpin_variable((void **)&forms);
+
+  return reversed;
+}
+
+int aot_compile_file(char *out_name, char *in_name) {
+  Reader *in = open_reader(in_name);
+
+  if (in == NULL) {
+    printf("File open failed: %s %d\n", in_name, errno);
+    return 0;
+  }
+
+  struct Compiler *c = calloc(1, sizeof(struct Compiler));
+  char *fns = NULL, *consts = NULL, *init = NULL;
+  size_t fns_size = 0, consts_size = 0, init_size = 0;
+  Object *forms = NULL;
+  Object *thunk = NULL;
+
+  assert(c != NULL);
+  pin_variable((void **)&forms);
+  pin_variable((void **)&thunk);
+
+  forms = read_forms(in);
+  close_reader(in);
+
+  c->fns = open_memstream(&fns, &fns_size);
+  c->consts = open_memstream(&consts, &consts_size);
+  c->init = open_memstream(&init, &init_size);
+
+  // Macros are defined here as well as at load, so the forms
+  // after them are compiled from their expansions.
+  for (Object *cell = forms; cell != s_nil; cell = cdr(cell)) {
+    if (car(car(cell)) == s_defmacro)
+      eval(car(cell), interp->top_env);
+    else
+      setcar(cell, expand_macros(car(cell), s_nil, 1));
+  }
+
+  for (Object *cell = forms; cell != s_nil; cell = cdr(cell))
+    note_assignments(c, car(cell));
+
+  // Every procedure is known before any is compiled, so they can call
+  // each other directly whatever order they are defined in.
+  for (Object *cell = forms; cell != s_nil; cell = cdr(cell)) {
+    Object *form = car(cell);
+
+    if (!is_proc_definition(c, form))
+      continue;
+
+    if (c->nprocs == MAX_AOT_PROCS)
+      error("Too many procedures in module");
+
+    c->procs[c->nprocs].name = cadr(form);
+    c->procs[c->nprocs].nparams = list_length(cadr(car(cddr(form))));
+    c->nprocs++;
+  }
+
+  for (Object *cell = forms; cell != s_nil; cell = cdr(cell)) {
+    Object *form = car(cell);
+
+    if (is_proc_definition(c, form)) {
+      Object *symbol = cadr(form);
+      Object *lambda = car(cddr(form));
+      struct KnownProc *proc = known_proc(c, symbol);
+      char *mangled = mangle(symbol->symbol.name);
+      char *fname = format("f_%s", mangled);
+      char *lisp_name = c_string(symbol->symbol.name);
+
+      compile_function(c, fname, cadr(lambda), cddr(lambda), proc);
+      fprintf(c->init, "  aot_define(S[%d], make_primitive_argv(%s, %s, %d, %d));\n",
+              symbol_index(c, symbol), lisp_name, fname,
+              proc->nparams, proc->nparams);
+
+      free(lisp_name);
+      free(fname);
+      free(mangled);
+    } else if (compilable(form, s_nil)) {
+      char *tname = format("t_%d", c->nthunks++);
+
+      thunk = cons(form, s_nil);
+      compile_function(c, tname, s_nil, thunk, NULL);
+      fprintf(c->init, "  %s(0, NULL);\n", tname);
+
+      free(tname);
+    } else {
+      char *datum = constant(c, form);
+      fprintf(c->init, "  eval(%s, interp->top_env);\n", datum);
+      free(datum);
+    }
+  }
+
+  fclose(c->fns);
+  fclose(c->consts);
+  fclose(c->init);
+
+  FILE *out = fopen(out_name, "w");
+
+  if (out == NULL) {
+    printf("File open failed: %s %d\n", out_name, errno);
+    unpin_variable((void **)&thunk);
+    unpin_variable((void **)&forms);
+    return 0;
+  }
+
+  char *module = module_name(in_name);
+
+  fprintf(out, "/* Generated by jcm-lisp -C from %s.  Do not edit. */\n\n", in_name);
+  fprintf(out, "#include \"jcm-lisp.h\"\n");
+  fprintf(out, "#include \"gc.h\"\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+
+  fprintf(out, "static __thread struct {\n");
+  fprintf(out, "  char nonempty;\n");
+  if (c->nsyms > 0)
+    fprintf(out, "  Object *S[%d];\n", c->nsyms);
+  if (c->uses_globals)
+    fprintf(out, "  Object *G[%d];\n", c->nsyms);
+  if (c->nconsts > 0)
+    fprintf(out, "  Object *K[%d];\n", c->nconsts);
+  fprintf(out, "} cache;\n\n");
+  fprintf(out, "#define S (cache.S)\n");
+  fprintf(out, "#define G (cache.G)\n");
+  fprintf(out, "#define K (cache.K)\n\n");
+
+  fprintf(out, "void *aot_cache_%s() {\n", module);
+  fprintf(out, "  void *copy = malloc(sizeof(cache));\n\n");
+  fprintf(out, "  assert(copy != NULL);\n");
+  fprintf(out, "  return memcpy(copy, &cache, sizeof(cache));\n");
+  fprintf(out, "}\n\n");
+  fprintf(out, "void aot_adopt_%s(void *from) {\n", module);
+  fprintf(out, "  memcpy(&cache, from, sizeof(cache));\n");
+  fprintf(out, "}\n\n");
+
+  for (int i = 0; i < c->nprocs; i++) {
+    char *mangled = mangle(c->procs[i].name->symbol.name);
+    fprintf(out, "static Object *f_%s(int argc, Object **argv);\n", mangled);
+    free(mangled);
+  }
+  fprintf(out, "\n");
+
+  fputs(fns, out);
+
+  fprintf(out, "void aot_init_%s() {\n", module);
+  if (c->nconsts > 0) {
+    fprintf(out, "  for (int i = 0; i < %d; i++)\n", c->nconsts);
+    fprintf(out, "    pin_variable((void **)&K[i]);\n\n");
+  }
+  for (int i = 0; i < c->nsyms; i++) {
+    char *name = c_string(c->syms[i]->symbol.name);
+    fprintf(out, "  S[%d] = intern_symbol(%s);\n", i, name);
+    free(name);
+  }
+  fputs(consts, out);
+  fputs(init, out);
+  fprintf(out, "}\n");
+
+  fclose(out);
+
+  unpin_variable((void **)&thunk);
+  unpin_variable((void **)&forms);
+  free(module);
+  free(fns);
+  free(consts);
+  free(init);
+  free(c);
+
+  return 1;
+}
+
+int aot_write_modules(char *out_name, int count, char **files) {
+  FILE *out = fopen(out_name, "w");
+
+  if (out == NULL) {
+    printf("File open failed: %s %d\n", out_name, errno);
+    return 0;
+  }
+
+  fprintf(out, "/* Generated by jcm-lisp -M.  Do not edit. */\n\n");
+  fprintf(out, "#include \"jcm-lisp.h\"\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+
+  for (int i = 0; i < count; i++) {
+    char *module = module_name(files[i]);
+    fprintf(out, "void aot_init_%s();\n", module);
+    fprintf(out, "void *aot_cache_%s();\n", module);
+    fprintf(out, "void aot_adopt_%s(void *from);\n", module);
+    free(module);
+  }
+
+  fprintf(out, "\nstruct Module preloaded_modules[] = {\n");
+  for (int i = 0; i < count; i++) {
+    char *module = module_name(files[i]);
+    fprintf(out, "  {\"%s\", aot_init_%s, aot_cache_%s, aot_adopt_%s},\n",
+            module, module, module, module);
+    free(module);
+  }
+  fprintf(out, "  {NULL, NULL, NULL, NULL}\n");
+  fprintf(out, "};\n");
+
+  fclose(out);
+  return 1;
+}
+
+/* Reserve TEMPS slots on the value stack for a compiled procedure. */
+Object **aot_enter(int temps) {
+  if (interp->eval_depth >= MAX_EVAL_DEPTH)
+    error("Maximum recursion depth exceeded");
+
+  if (interp->value_sp + temps > VALUE_STACK_SIZE)
+    error("Value stack overflow");
+
+  Object **v = &interp->value_stack[interp->value_sp];
+
+  memset(v, 0, temps * sizeof(Object *));
+  interp->value_sp += temps;
+  interp->procs[interp->eval_depth] = NULL;
+  interp->eval_depth++;
+
+  return v;
+}
+
+void aot_leave(Object **temps) {
+  interp->value_sp = temps - interp->value_stack;
+  interp->eval_depth--;
+}
+
+/* Toplevel bindings are never removed, so a pair once found is kept. */
+Object *aot_lookup(Object **cache, Object *symbol) {
+  Object *pair = assoc(symbol, interp->top_env);
+
+  if (pair == NULL) {
+    char *buff = NULL;
+    asprintf(&buff, "Undefined symbol '%s'", symbol->symbol.name);
+    error(buff);
+  }
+
+  *cache = pair;
+  return pair;
+}
+
+Object *aot_define(Object *symbol, Object *val) {
+  Object *pair = assoc(symbol, interp->top_env);
+
+  pin_variable((void **)&val);
+
+  if (pair == NULL)
+    extend_top(symbol, val);
+  else
+    setcdr(pair, val);
+
+  unpin_variable((void **)&val);
+
+  return val;
+}
+
+int aot_not_fixnum(Object *obj) {
+  printf("Not a fixnum: ");
+  print(obj);
+  printf("\n");
+
+  error("Not a fixnum");
+  return 0;
+}
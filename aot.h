@@ -0,0 +1,41 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* A Lisp module compiled to C, linked in by `make aot`. */
+struct Module {
+  char *name;
+  void (*init)();
+  void *(*cache)();           /* a copy of what this thread has cached */
+  void (*adopt)(void *from);  /* start this thread with such a copy */
+};
+
+/* Written by jcm-lisp -M, ending with a NULL name. */
+extern struct Module preloaded_modules[];
+
+/* Copies of this thread's module caches, NULL-terminated, for
+ * adopt_modules() to hand to another thread running on this heap. */
+void **module_caches();
+void adopt_modules(void **caches);
+
+int aot_compile_file(char *out_name, char *in_name);
+int aot_write_modules(char *out_name, int count, char **files);
+
+/* Used by generated code. */
+Object **aot_enter(int temps);
+void aot_leave(Object **temps);
+Object *aot_lookup(Object **cache, Object *symbol);
+Object *aot_define(Object *symbol, Object *val);
+int aot_not_fixnum(Object *obj);
+
+/* The (symbol . value) pair of global I of a module, found once. */
+#define AOT_GLOBAL(i) (G[i] != NULL ? G[i] : aot_lookup(&G[i], S[i]))
+
+/* The value of a fixnum, checked.  OBJ is a variable, never a call. */
+#define AOT_FIXNUM(obj) \
+  ((obj)->type == FIXNUM ? (obj)->num.value : aot_not_fixnum(obj))
@@ -0,0 +1,533 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Embedding API.
+ *
+ * A jl_state is an Interp.  Each entry point makes it this thread's
+ * interpreter for the call, with an error handler that turns error()
+ * into a failed return and puts the stacks back as they were, so a
+ * C primitive can call back in.
+ *
+ * Handles index a table of objects that the collector marks, with
+ * released handles kept for reuse.  C primitives are primitives with
+ * no function of their own, but the index of the C function to call,
+ * which call_primitive hands to call_foreign, off the path of the
+ * builtins.
+ *
+ * Crossing into the interpreter costs an entry and a handle or two
+ * per value, so jl_call_batch makes many calls per crossing, and
+ * jl_call_fixnums passes fixnums by value without handles at all.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "scan.h"
+#include "reader.h"
+#include "printer.h"
+#include "api.h"
+#include "libjcmlisp.h"
+
+#include <limits.h>
+
+struct Foreign {
+  jl_primitive *fn;
+  void *data;
+};
+
+struct Api {
+  Object **slots;        /* by handle less one; NULL if released */
+  jl_handle *released;
+  int nreleased;
+  int used;
+  int cap;
+  struct Foreign *foreign;
+  int nforeign;
+  char *message;         /* from jl_set_error */
+};
+
+/* What an entry point puts back as it returns. */
+struct Entry {
+  Interp *outer;
+  jmp_buf *handler;
+  int value_sp;
+  int pins;
+  int eval_depth;
+};
+
+static void enter(jl_state *jl, struct Entry *e, jmp_buf *handler) {
+  Interp *in = (Interp *)jl;
+
+  e->outer = interp;
+  e->handler = in->error_handler;
+  e->value_sp = in->value_sp;
+  e->pins = in->pv_count;
+  e->eval_depth = in->eval_depth;
+
+  interp = in;
+  in->error_handler = handler;
+  in->error_message = NULL;
+}
+
+static void leave(struct Entry *e) {
+  interp->value_sp = e->value_sp;
+  restore_pins(e->pins);
+  interp->eval_depth = e->eval_depth;
+  interp->error_handler = e->handler;
+  interp = e->outer;
+}
+
+static jl_handle new_handle(Object *obj) {
+  struct Api *api = interp->api;
+  jl_handle h;
+
+  if (api->nreleased > 0) {
+    h = api->released[--api->nreleased];
+  } else {
+    if (api->used == api->cap) {
+      api->cap = api->cap > 0 ? api->cap * 2 : API_HANDLES;
+      api->slots = realloc(api->slots, api->cap * sizeof(Object *));
+      api->released = realloc(api->released, api->cap * sizeof(jl_handle));
+      assert(api->slots != NULL && api->released != NULL);
+    }
+    h = ++api->used;
+  }
+
+  api->slots[h - 1] = obj;
+  return h;
+}
+
+/* H's object, or NULL if it isn't a handle. */
+static Object *peek(Interp *in, jl_handle h) {
+  if (h == JL_NONE || h > (jl_handle)in->api->used)
+    return NULL;
+
+  return in->api->slots[h - 1];
+}
+
+static Object *deref(jl_handle h) {
+  Object *obj = peek(interp, h);
+
+  if (obj == NULL)
+    error("Bad handle");
+
+  return obj;
+}
+
+static void release(Interp *in, jl_handle h) {
+  if (peek(in, h) == NULL)
+    return;
+
+  in->api->slots[h - 1] = NULL;
+  in->api->released[in->api->nreleased++] = h;
+}
+
+Object *call_foreign(Object *proc, int argc, Object **argv) {
+  struct Api *api = interp->api;
+  jl_handle local[API_LOCAL_ARGS];
+  jl_handle *handles = local;
+  struct Foreign *f;
+  jl_handle result;
+  Object *obj;
+
+  if (api == NULL || interp->owner != interp)
+    error("C primitives can't run inside pmap");
+
+  f = &api->foreign[proc->primitive.foreign - 1];
+
+  if (argc > API_LOCAL_ARGS) {
+    handles = malloc(argc * sizeof(jl_handle));
+    assert(handles != NULL);
+  }
+
+  for (int i = 0; i < argc; i++)
+    handles[i] = new_handle(argv[i]);
+
+  result = f->fn((jl_state *)interp, argc, handles, f->data);
+  obj = peek(interp, result);
+
+  // Nothing allocates from here until OBJ is returned.
+  for (int i = 0; i < argc; i++) {
+    if (handles[i] == result)
+      result = JL_NONE;
+    release(interp, handles[i]);
+  }
+  release(interp, result);
+
+  if (handles != local)
+    free(handles);
+
+  if (obj == NULL) {
+    char *msg = api->message;
+
+    api->message = NULL;
+    if (msg == NULL)
+      asprintf(&msg, "C primitive '%s' failed", proc->primitive.name);
+    error(msg);
+  }
+
+  return obj;
+}
+
+void mark_handles(Interp *in) {
+  if (in->api == NULL)
+    return;
+
+  for (int i = 0; i < in->api->used; i++)
+    mark(in->api->slots[i]);
+}
+
+void free_api(Interp *in) {
+  if (in->api == NULL)
+    return;
+
+  free(in->api->slots);
+  free(in->api->released);
+  free(in->api->foreign);
+  free(in->api->message);
+  free(in->api);
+  in->api = NULL;
+}
+
+jl_state *jl_new(void) {
+  Interp *outer = interp;
+  Interp *in = new_Interp();
+
+  in->quiet = 1;
+  in->api = calloc(1, sizeof(struct Api));
+  assert(in->api != NULL);
+
+  interp = outer;
+  return (jl_state *)in;
+}
+
+void jl_free(jl_state *jl) {
+  free_Interp((Interp *)jl);
+}
+
+const char *jl_error(jl_state *jl) {
+  return ((Interp *)jl)->error_message;
+}
+
+void jl_set_error(jl_state *jl, const char *msg) {
+  struct Api *api = ((Interp *)jl)->api;
+
+  free(api->message);
+  api->message = strdup(msg);
+}
+
+jl_handle jl_eval_string(jl_state *jl, const char *source) {
+  Reader *volatile r = NULL;
+  volatile jl_handle result = JL_NONE;
+  struct Entry e;
+  jmp_buf handler;
+
+  enter(jl, &e, &handler);
+
+  if (setjmp(handler) == 0) {
+    Object *form = NULL;
+    Object *value = s_nil;
+
+    pin_variable((void **)&form);
+    pin_variable((void **)&value);
+
+    r = buffer_reader(strdup(source), strlen(source));
+    while ((form = read_form(r)) != NULL)
+      value = eval(form, interp->top_env);
+
+    result = new_handle(value);
+  }
+
+  if (r != NULL)
+    close_reader(r);
+  leave(&e);
+  return result;
+}
+
+jl_handle jl_global(jl_state *jl, const char *name) {
+  volatile jl_handle result = JL_NONE;
+  struct Entry e;
+  jmp_buf handler;
+
+  enter(jl, &e, &handler);
+
+  if (setjmp(handler) == 0) {
+    Object *pair = assoc(intern_symbol((char *)name), interp->top_env);
+
+    if (pair == NULL) {
+      char *buff = NULL;
+      asprintf(&buff, "Undefined symbol '%s'", name);
+      error(buff);
+    }
+
+    result = new_handle(cdr(pair));
+  }
+
+  leave(&e);
+  return result;
+}
+
+jl_handle jl_call(jl_state *jl, jl_handle fn, int argc, const jl_handle *argv) {
+  jl_handle result = JL_NONE;
+
+  jl_call_batch(jl, fn, 1, argc, argv, &result);
+  return result;
+}
+
+int jl_call_batch(jl_state *jl, jl_handle fn, int ncalls, int argc,
+                  const jl_handle *args, jl_handle *results) {
+  volatile int done = 0;
+  struct Entry e;
+  jmp_buf handler;
+
+  enter(jl, &e, &handler);
+
+  if (setjmp(handler) == 0) {
+    Object *f = deref(fn);
+    int base = interp->value_sp;
+
+    for (int i = 0; i < ncalls; i++) {
+      for (int j = 0; j < argc; j++)
+        push_value(deref(args[i * argc + j]));
+
+      Object *value = call_value(f, argc, &interp->value_stack[base]);
+      interp->value_sp = base;
+
+      results[i] = new_handle(value);
+      done = i + 1;
+    }
+  }
+
+  leave(&e);
+  return done;
+}
+
+int jl_call_fixnums(jl_state *jl, jl_handle fn, int ncalls, int argc,
+                    const int *args, int *results) {
+  volatile int done = 0;
+  struct Entry e;
+  jmp_buf handler;
+
+  enter(jl, &e, &handler);
+
+  if (setjmp(handler) == 0) {
+    Object *f = deref(fn);
+    int base = interp->value_sp;
+
+    for (int i = 0; i < ncalls; i++) {
+      for (int j = 0; j < argc; j++)
+        push_value(make_fixnum(args[i * argc + j]));
+
+      Object *value = call_value(f, argc, &interp->value_stack[base]);
+      interp->value_sp = base;
+
+      if (!is_fixnum(value))
+        error("Result is not a fixnum");
+      results[i] = value->num.value;
+      done = i + 1;
+    }
+  }
+
+  leave(&e);
+  return done;
+}
+
+int jl_define_primitive(jl_state *jl, const char *name, jl_primitive *fn,
+                        int min_args, int max_args, void *data) {
+  volatile int ok = 0;
+  struct Entry e;
+  jmp_buf handler;
+
+  enter(jl, &e, &handler);
+
+  if (setjmp(handler) == 0) {
+    struct Api *api = interp->api;
+    Object *symbol = intern_symbol((char *)name);
+    Object *prim = NULL;
+    Object *pair;
+
+    if (min_args < 0 || min_args > SHRT_MAX || max_args < -1 || max_args > SHRT_MAX ||
+        (max_args >= 0 && max_args < min_args))
+      error("Bad arity for a C primitive");
+
+    api->foreign = realloc(api->foreign, (api->nforeign + 1) * sizeof(struct Foreign));
+    assert(api->foreign != NULL);
+    api->foreign[api->nforeign].fn = fn;
+    api->foreign[api->nforeign].data = data;
+    api->nforeign++;
+
+    pin_variable((void **)&prim);
+    prim = make_primitive_argv(symbol->symbol.name, NULL, min_args, max_args);
+    prim->primitive.foreign = api->nforeign;
+
+    pair = assoc(symbol, interp->top_env);
+    if (pair != NULL)
+      setcdr(pair, prim);
+    else
+      extend_top(symbol, prim);
+    ok = 1;
+  }
+
+  leave(&e);
+  return ok;
+}
+
+/* Hold what FN makes of ARG, or fail. */
+static jl_handle make(jl_state *jl, Object *(*fn)(void *), void *arg) {
+  volatile jl_handle result = JL_NONE;
+  struct Entry e;
+  jmp_buf handler;
+
+  enter(jl, &e, &handler);
+
+  if (setjmp(handler) == 0)
+    result = new_handle(fn(arg));
+
+  leave(&e);
+  return result;
+}
+
+static Object *nil_of(void *arg) {
+  return s_nil;
+}
+
+static Object *fixnum_of(void *arg) {
+  return make_fixnum(*(int *)arg);
+}
+
+static Object *string_of(void *arg) {
+  return make_string(arg);
+}
+
+static Object *symbol_of(void *arg) {
+  return intern_symbol(arg);
+}
+
+static Object *cons_of(void *arg) {
+  jl_handle *pair = arg;
+
+  return cons(deref(pair[0]), deref(pair[1]));
+}
+
+static Object *car_of(void *arg) {
+  return car(deref(*(jl_handle *)arg));
+}
+
+static Object *cdr_of(void *arg) {
+  return cdr(deref(*(jl_handle *)arg));
+}
+
+static Object *same(void *arg) {
+  return deref(*(jl_handle *)arg);
+}
+
+jl_handle jl_nil(jl_state *jl) {
+  return make(jl, nil_of, NULL);
+}
+
+jl_handle jl_fixnum(jl_state *jl, int value) {
+  return make(jl, fixnum_of, &value);
+}
+
+jl_handle jl_string(jl_state *jl, const char *text) {
+  return make(jl, string_of, (char *)text);
+}
+
+jl_handle jl_symbol(jl_state *jl, const char *name) {
+  return make(jl, symbol_of, (char *)name);
+}
+
+jl_handle jl_cons(jl_state *jl, jl_handle car, jl_handle cdr) {
+  jl_handle pair[2] = { car, cdr };
+
+  return make(jl, cons_of, pair);
+}
+
+jl_handle jl_car(jl_state *jl, jl_handle cell) {
+  return make(jl, car_of, &cell);
+}
+
+jl_handle jl_cdr(jl_state *jl, jl_handle cell) {
+  return make(jl, cdr_of, &cell);
+}
+
+jl_handle jl_dup(jl_state *jl, jl_handle h) {
+  return make(jl, same, &h);
+}
+
+void jl_release(jl_state *jl, jl_handle h) {
+  release((Interp *)jl, h);
+}
+
+int jl_is_nil(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+  Interp *outer = interp;
+  int is_nil;
+
+  interp = (Interp *)jl;
+  is_nil = obj != NULL && obj == s_nil;
+  interp = outer;
+  return is_nil;
+}
+
+int jl_is_fixnum(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+
+  return obj != NULL && obj->type == FIXNUM;
+}
+
+int jl_is_string(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+
+  return obj != NULL && obj->type == STRING;
+}
+
+int jl_is_cell(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+
+  return obj != NULL && obj->type == CELL;
+}
+
+int jl_fixnum_value(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+
+  return obj != NULL && obj->type == FIXNUM ? obj->num.value : 0;
+}
+
+const char *jl_string_value(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+
+  return obj != NULL && obj->type == STRING ? obj->str.text : NULL;
+}
+
+char *jl_print(jl_state *jl, jl_handle h) {
+  Object *obj = peek((Interp *)jl, h);
+  Interp *outer = interp;
+  OutPort *p;
+  char *text = NULL;
+  size_t len = 0;
+
+  if (obj == NULL)
+    return NULL;
+
+  p = calloc(1, sizeof(OutPort));
+  assert(p != NULL);
+  p->out = open_memstream(&text, &len);
+  assert(p->out != NULL);
+
+  // Printing doesn't allocate, but its tables are the Interp's.
+  interp = (Interp *)jl;
+  write_object(p, obj, 0);
+  port_flush(p);
+  interp = outer;
+
+  fclose(p->out);
+  free(p);
+  return text;
+}
@@ -0,0 +1,19 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Handles a jl_state starts with room for. */
+#define API_HANDLES 64
+
+/* Args a C primitive gets handles for without allocating. */
+#define API_LOCAL_ARGS 8
+
+/* What the runtime needs of the embedding API (libjcmlisp.h). */
+Object *call_foreign(Object *proc, int argc, Object **argv);
+void mark_handles(Interp *in);
+void free_api(Interp *in);
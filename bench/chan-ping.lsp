@@ -0,0 +1,8 @@
+(define ping (make-channel "ping" 1 (quote spsc)))
+(define pong (make-channel "pong" 1 (quote spsc)))
+(define rally
+  (lambda (n)
+    (send ping n)
+    (receive pong)
+    (if (eq n 0) nil (rally (- n 1)))))
+(rally 20000)
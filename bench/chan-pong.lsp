@@ -0,0 +1,6 @@
+(define ping (make-channel "ping" 1 (quote spsc)))
+(define pong (make-channel "pong" 1 (quote spsc)))
+(define rally
+  (lambda ()
+    (if (eq (send pong (receive ping)) 0) nil (rally))))
+(rally)
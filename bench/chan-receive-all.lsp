@@ -0,0 +1,8 @@
+(define in (make-channel "batches"))
+(define last
+  (lambda (list)
+    (if (cdr list) (last (cdr list)) (car list))))
+(define receive-to-0
+  (lambda ()
+    (if (eq (last (receive-all in 64)) 0) nil (receive-to-0))))
+(receive-to-0)
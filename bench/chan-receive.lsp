@@ -0,0 +1,5 @@
+(define in (make-channel "numbers"))
+(define receive-to-0
+  (lambda ()
+    (if (eq (receive in) 0) nil (receive-to-0))))
+(receive-to-0)
@@ -0,0 +1,11 @@
+(define out (make-channel "batches"))
+(define batch (list 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16
+                    17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32
+                    33 34 35 36 37 38 39 40 41 42 43 44 45 46 47 48
+                    49 50 51 52 53 54 55 56 57 58 59 60 61 62 63 64))
+(define send-batches
+  (lambda (n)
+    (send-all out batch)
+    (if (eq n 1) nil (send-batches (- n 1)))))
+(send-batches 1563)
+(send out 0)
@@ -0,0 +1,6 @@
+(define out (make-channel "numbers"))
+(define send-from
+  (lambda (n)
+    (send out n)
+    (if (eq n 0) nil (send-from (- n 1)))))
+(send-from 100000)
@@ -0,0 +1,34 @@
+(define serve
+    (lambda (in out)
+      (reply in out (read-line in))))
+(define reply
+    (lambda (in out line)
+      (if (equal line eof)
+          (close-port out)
+          (echo in out line))))
+(define echo
+    (lambda (in out line)
+      (write-line out line)
+      (serve in out)))
+(define ask
+    (lambda (out in n)
+      (if (eq n 0)
+          (close-port out)
+          (ask-again out in n))))
+(define ask-again
+    (lambda (out in n)
+      (write-line out "ping")
+      (read-line in)
+      (ask out in (- n 1))))
+(define start
+    (lambda (pairs rounds)
+      (if (eq pairs 0)
+          pairs
+          (start-pair (make-pipe) (make-pipe) pairs rounds))))
+(define start-pair
+    (lambda (requests replies pairs rounds)
+      (spawn (lambda () (serve (car requests) (cdr replies))))
+      (spawn (lambda () (ask (cdr requests) (car replies) rounds)))
+      (start (- pairs 1) rounds)))
+(start 200 200)
+(run-tasks)
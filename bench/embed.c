@@ -0,0 +1,119 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * What crossing from C into the interpreter costs: the same calls of
+ * a small Lisp function made one jl_call at a time, in batches with
+ * jl_call_batch, and with fixnums by value with jl_call_fixnums.  A
+ * C primitive is called back from Lisp the same number of times.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libjcmlisp.h"
+
+#define CALLS 200000
+#define BATCH 1000
+
+static double now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static jl_handle c_add(jl_state *jl, int argc, const jl_handle *argv, void *data) {
+  if (!jl_is_fixnum(jl, argv[0]) || !jl_is_fixnum(jl, argv[1])) {
+    jl_set_error(jl, "c-add takes fixnums");
+    return JL_NONE;
+  }
+
+  return jl_fixnum(jl, jl_fixnum_value(jl, argv[0]) + jl_fixnum_value(jl, argv[1]));
+}
+
+static void check(jl_state *jl, int ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "%s failed: %s\n", what, jl_error(jl) ? jl_error(jl) : "?");
+    exit(1);
+  }
+}
+
+static void report(const char *what, double start, long sum) {
+  double ms = now_ms() - start;
+
+  printf("%-22s %8.1f ms %8.1f ns/call  (sum %ld)\n",
+         what, ms, ms * 1e6 / CALLS, sum);
+}
+
+int main(int argc, char *argv[]) {
+  jl_state *jl = jl_new();
+  jl_handle add, h, args[2 * BATCH], results[BATCH];
+  int fargs[2 * BATCH], fresults[BATCH];
+  long sum;
+  double start;
+
+  check(jl, jl_eval_string(jl, "(define add (lambda (a b) (+ a b)))") != JL_NONE, "define");
+  check(jl, jl_define_primitive(jl, "c-add", c_add, 2, 2, NULL), "jl_define_primitive");
+  add = jl_global(jl, "add");
+  check(jl, add != JL_NONE, "jl_global");
+
+  // Errors come back as failures, and leave the state usable.
+  check(jl, jl_eval_string(jl, "(no-such-fn 1)") == JL_NONE, "an error");
+  check(jl, jl_eval_string(jl, "(c-add 1 (quote x))") == JL_NONE, "a C primitive's error");
+  printf("errors: %s\n", jl_error(jl));
+
+  sum = 0;
+  start = now_ms();
+  for (int i = 0; i < CALLS; i++) {
+    args[0] = jl_fixnum(jl, i);
+    args[1] = jl_fixnum(jl, 1);
+    h = jl_call(jl, add, 2, args);
+    check(jl, h != JL_NONE, "jl_call");
+    sum += jl_fixnum_value(jl, h);
+    jl_release(jl, h);
+    jl_release(jl, args[0]);
+    jl_release(jl, args[1]);
+  }
+  report("jl_call", start, sum);
+
+  sum = 0;
+  start = now_ms();
+  for (int i = 0; i < CALLS; i += BATCH) {
+    for (int j = 0; j < BATCH; j++) {
+      args[2 * j] = jl_fixnum(jl, i + j);
+      args[2 * j + 1] = jl_fixnum(jl, 1);
+    }
+    check(jl, jl_call_batch(jl, add, BATCH, 2, args, results) == BATCH, "jl_call_batch");
+    for (int j = 0; j < BATCH; j++) {
+      sum += jl_fixnum_value(jl, results[j]);
+      jl_release(jl, results[j]);
+      jl_release(jl, args[2 * j]);
+      jl_release(jl, args[2 * j + 1]);
+    }
+  }
+  report("jl_call_batch", start, sum);
+
+  sum = 0;
+  start = now_ms();
+  for (int i = 0; i < CALLS; i += BATCH) {
+    for (int j = 0; j < BATCH; j++) {
+      fargs[2 * j] = i + j;
+      fargs[2 * j + 1] = 1;
+    }
+    check(jl, jl_call_fixnums(jl, add, BATCH, 2, fargs, fresults) == BATCH, "jl_call_fixnums");
+    for (int j = 0; j < BATCH; j++)
+      sum += fresults[j];
+  }
+  report("jl_call_fixnums", start, sum);
+
+  start = now_ms();
+  h = jl_eval_string(jl,
+                     "(define loop (lambda (i n s)"
+                     "  (if (eq i n) s (loop (+ i 1) n (+ s (- (c-add i 1) i))))))"
+                     "(loop 0 200000 0)");
+  check(jl, h != JL_NONE, "calling back into C");
+  report("Lisp calling c-add", start, jl_fixnum_value(jl, h));
+
+  jl_free(jl);
+  return 0;
+}
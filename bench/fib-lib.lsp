@@ -0,0 +1,2 @@
+; fib from lib/arith.lsp: run it first, or under a `make aot` build.
+(fib 25)
@@ -0,0 +1,8 @@
+(define pfib
+    (lambda (n)
+      (if (eq n 0)
+          0
+          (if (eq n 1)
+              1
+              (+ (pfib (- n 1)) (pfib (- n 2)))))))
+(pmap pfib (list 24 24 24 24 24 24 24 24))
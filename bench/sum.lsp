@@ -0,0 +1,9 @@
+(define sum
+    (lambda (n acc)
+      (if (eq n 0)
+          acc
+          (sum (- n 1) (+ acc n)))))
+(sum 50000 0)
+(sum 50000 0)
+(sum 50000 0)
+(sum 50000 0)
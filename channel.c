@@ -0,0 +1,390 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Channels.
+ *
+ * Interpreters on different threads share no objects, so they talk
+ * through channels: (make-channel name) in each finds the same one.
+ * A channel is a bounded ring of messages with any number of senders
+ * and one receiver at a time, or, if made with 'spsc, one sender at a
+ * time too, which saves senders an atomic exchange.
+ *
+ * Nothing on a channel is in any heap.  Fixnums, nil and t travel as
+ * they are; anything else is packed as a fasl datum and unpacked into
+ * the receiver's heap.  Senders claim slots by advancing the tail and
+ * mark each slot ready once it is filled; the receiver takes ready
+ * slots in order and gives them back by advancing the head.  send-all
+ * and receive-all move as many messages as fit for one update of
+ * each.  A thread that finds the channel full, or empty, spins a
+ * little and then yields; a task lets the other tasks run meanwhile.
+ *
+ * Channels last as long as the process.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "fasl.h"
+#include "pmap.h"
+#include "channel.h"
+#include "task.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+/* Waits spent spinning before yielding the CPU. */
+#define SPINS 64
+
+enum {
+  MSG_FIXNUM,
+  MSG_NIL,
+  MSG_T,
+  MSG_PACKED
+};
+
+struct Message {
+  int kind;
+  int fixnum;
+  char *data;           /* packed datum */
+  size_t len;
+};
+
+struct Slot {
+  uint64_t ready;       /* position of the message in it, plus one */
+  struct Message msg;
+};
+
+struct Channel {
+  char *name;
+  uint64_t capacity;    /* a power of two */
+  int single_sender;
+  struct Slot *slots;
+  Channel *next;
+
+  /* Senders' and receiver's ends on lines of their own. */
+  uint64_t tail __attribute__((aligned(CACHE_LINE)));
+  int sending;
+  uint64_t head __attribute__((aligned(CACHE_LINE)));
+  int receiving;
+};
+
+static Channel *channels;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Channel *find_channel(char *name, uint64_t capacity, int single_sender) {
+  Channel *ch;
+
+  pthread_mutex_lock(&channels_lock);
+
+  for (ch = channels; ch != NULL; ch = ch->next) {
+    if (strcmp(ch->name, name) == 0)
+      break;
+  }
+
+  if (ch == NULL) {
+    ch = aligned_alloc(CACHE_LINE, sizeof(Channel));
+    assert(ch != NULL);
+    memset(ch, 0, sizeof(Channel));
+
+    ch->name = strdup(name);
+    ch->capacity = 1;
+    while (ch->capacity < capacity)
+      ch->capacity *= 2;
+    ch->single_sender = single_sender;
+    ch->slots = calloc(ch->capacity, sizeof(struct Slot));
+    assert(ch->name != NULL && ch->slots != NULL);
+
+    ch->next = channels;
+    channels = ch;
+  }
+
+  pthread_mutex_unlock(&channels_lock);
+  return ch;
+}
+
+static void wait_a_little(int *waits) {
+  // What it waits for may be another task of this interpreter.
+  int yielded = task_yield();
+
+  if (++*waits < SPINS) {
+#if defined(__x86_64__)
+    if (!yielded)
+      __builtin_ia32_pause();
+#endif
+    return;
+  }
+
+  // Don't hold up a collection while waiting under pmap.
+  if (interp->parallel)
+    safepoint();
+  sched_yield();
+}
+
+static void claim(int *end, char *msg) {
+  if (__atomic_exchange_n(end, 1, __ATOMIC_ACQUIRE))
+    error(msg);
+}
+
+static void unclaim(int *end) {
+  __atomic_store_n(end, 0, __ATOMIC_RELEASE);
+}
+
+/* Put COUNT messages on the channel, as many at a time as there
+ * is room for. */
+static void put(Channel *ch, struct Message *msgs, int count) {
+  int waits = 0;
+
+  if (ch->single_sender)
+    claim(&ch->sending, "Channel already has a sender");
+
+  while (count > 0) {
+    uint64_t tail = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+    uint64_t room = ch->capacity - (tail - head);
+    uint64_t n = room < (uint64_t)count ? room : (uint64_t)count;
+
+    if (n == 0) {
+      wait_a_little(&waits);
+      continue;
+    }
+
+    if (ch->single_sender)
+      __atomic_store_n(&ch->tail, tail + n, __ATOMIC_RELAXED);
+    else if (!__atomic_compare_exchange_n(&ch->tail, &tail, tail + n, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      continue;
+
+    for (uint64_t i = 0; i < n; i++) {
+      struct Slot *slot = &ch->slots[(tail + i) & (ch->capacity - 1)];
+
+      slot->msg = msgs[i];
+      __atomic_store_n(&slot->ready, tail + i + 1, __ATOMIC_RELEASE);
+    }
+
+    msgs += n;
+    count -= n;
+    waits = 0;
+  }
+
+  if (ch->single_sender)
+    unclaim(&ch->sending);
+}
+
+/* Take up to MAX messages that are ready, waiting for one if WAIT
+ * is set, and return how many. */
+static int take(Channel *ch, struct Message *msgs, int max, int wait) {
+  int waits = 0;
+  int n = 0;
+
+  claim(&ch->receiving, "Channel already has a receiver");
+
+  // Only the receiver moves the head.
+  uint64_t head = ch->head;
+
+  for (;;) {
+    while (n < max) {
+      struct Slot *slot = &ch->slots[(head + n) & (ch->capacity - 1)];
+
+      if (__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE) != head + n + 1)
+        break;
+      msgs[n++] = slot->msg;
+    }
+
+    if (n > 0 || !wait)
+      break;
+    wait_a_little(&waits);
+  }
+
+  if (n > 0)
+    __atomic_store_n(&ch->head, head + n, __ATOMIC_RELEASE);
+
+  unclaim(&ch->receiving);
+  return n;
+}
+
+/* Fail unless OBJ is made only of what a fasl can hold. */
+static void check_sendable(Object *obj) {
+  for (; is_cell(obj); obj = cdr(obj))
+    check_sendable(car(obj));
+
+  if (!is_fixnum(obj) && !is_string(obj) && !is_symbol(obj)) {
+    char *buff = NULL;
+    asprintf(&buff, "Can't send a %s", get_type(obj));
+    error(buff);
+  }
+}
+
+static void pack(Object *obj, struct Message *msg) {
+  memset(msg, 0, sizeof(*msg));
+
+  if (is_fixnum(obj)) {
+    msg->kind = MSG_FIXNUM;
+    msg->fixnum = obj->num.value;
+  } else if (obj == s_nil) {
+    msg->kind = MSG_NIL;
+  } else if (obj == s_t) {
+    msg->kind = MSG_T;
+  } else {
+    msg->kind = MSG_PACKED;
+    msg->data = fasl_pack(obj, &msg->len);
+  }
+}
+
+static Object *unpack(struct Message *msg) {
+  Object *obj;
+
+  switch (msg->kind) {
+    case MSG_FIXNUM:
+      return make_fixnum(msg->fixnum);
+    case MSG_NIL:
+      return s_nil;
+    case MSG_T:
+      return s_t;
+  }
+
+  obj = fasl_unpack(msg->data, msg->len);
+  free(msg->data);
+  return obj;
+}
+
+static Channel *channel_arg(Object *obj) {
+  if (!is_channel(obj))
+    error("Not a channel");
+
+  return obj->chan.channel;
+}
+
+/* (make-channel name [capacity ['spsc]]): the channel called NAME,
+ * made if no interpreter has made it yet. */
+Object *prim_make_channel(int argc, Object **argv) {
+  int capacity = CHANNEL_CAPACITY;
+  int single_sender = 0;
+
+  if (!is_string(argv[0]))
+    error("make-channel needs a name");
+
+  if (argc > 1) {
+    if (!is_fixnum(argv[1]) || argv[1]->num.value <= 0)
+      error("make-channel needs a positive capacity");
+    capacity = argv[1]->num.value;
+  }
+
+  if (argc > 2) {
+    if (argv[2] == intern_symbol("spsc"))
+      single_sender = 1;
+    else if (argv[2] != intern_symbol("mpsc"))
+      error("make-channel wants spsc or mpsc");
+  }
+
+  return make_channel(find_channel(argv[0]->str.text, capacity, single_sender));
+}
+
+Object *prim_send(int argc, Object **argv) {
+  Channel *ch = channel_arg(argv[0]);
+  struct Message msg;
+
+  check_sendable(argv[1]);
+  pack(argv[1], &msg);
+  put(ch, &msg, 1);
+
+  return argv[1];
+}
+
+/* (send-all channel list): send each element, in order. */
+Object *prim_send_all(int argc, Object **argv) {
+  Channel *ch = channel_arg(argv[0]);
+  struct Message *msgs;
+  int count = 0;
+
+  for (Object *list = argv[1]; is_cell(list); list = cdr(list)) {
+    check_sendable(car(list));
+    count++;
+  }
+
+  msgs = malloc((count + 1) * sizeof(struct Message));
+  assert(msgs != NULL);
+
+  count = 0;
+  for (Object *list = argv[1]; is_cell(list); list = cdr(list))
+    pack(car(list), &msgs[count++]);
+
+  put(ch, msgs, count);
+  free(msgs);
+
+  return make_fixnum(count);
+}
+
+Object *prim_receive(int argc, Object **argv) {
+  struct Message msg;
+
+  take(channel_arg(argv[0]), &msg, 1, 1);
+  return unpack(&msg);
+}
+
+/* The next message, or eof if there is none yet. */
+Object *prim_try_receive(int argc, Object **argv) {
+  struct Message msg;
+
+  if (take(channel_arg(argv[0]), &msg, 1, 0) == 0)
+    return s_eof;
+  return unpack(&msg);
+}
+
+/* (receive-all channel max): a list of up to MAX messages, waiting
+ * for the first. */
+Object *prim_receive_all(int argc, Object **argv) {
+  Channel *ch = channel_arg(argv[0]);
+  struct Message *msgs;
+  Object *list = s_nil;
+  Object *obj = NULL;
+  int max, count;
+
+  if (!is_fixnum(argv[1]) || argv[1]->num.value <= 0)
+    error("receive-all needs a positive count");
+
+  max = argv[1]->num.value;
+  if ((uint64_t)max > ch->capacity)
+    max = ch->capacity;
+
+  msgs = malloc(max * sizeof(struct Message));
+  assert(msgs != NULL);
+  count = take(ch, msgs, max, 1);
+
+  pin_variable((void **)&list);
+  pin_variable((void **)&obj);
+
+  for (int i = count - 1; i >= 0; i--) {
+    obj = unpack(&msgs[i]);
+    list = cons(obj, list);
+  }
+
+  unpin_variable((void **)&obj);
+  unpin_variable((void **)&list);
+  free(msgs);
+
+  return list;
+}
+
+void report_channels(FILE *out, double seconds) {
+  pthread_mutex_lock(&channels_lock);
+
+  fprintf(out, "channel          messages      msgs/s   us/msg\n");
+  for (Channel *ch = channels; ch != NULL; ch = ch->next) {
+    uint64_t sent = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+
+    fprintf(out, "%-12s %12llu %11.0f %8.3f\n", ch->name,
+            (unsigned long long)sent, sent / seconds,
+            sent > 0 ? seconds * 1e6 / sent : 0.0);
+  }
+
+  pthread_mutex_unlock(&channels_lock);
+}
@@ -0,0 +1,21 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Messages a channel holds unless make-channel says otherwise. */
+#define CHANNEL_CAPACITY 1024
+
+Object *prim_make_channel(int argc, Object **argv);
+Object *prim_send(int argc, Object **argv);
+Object *prim_send_all(int argc, Object **argv);
+Object *prim_receive(int argc, Object **argv);
+Object *prim_try_receive(int argc, Object **argv);
+Object *prim_receive_all(int argc, Object **argv);
+
+/* How many messages went through each channel in SECONDS. */
+void report_channels(FILE *out, double seconds);
@@ -0,0 +1,626 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * FASL files.
+ *
+ * A .fasl holds the forms read from a .lsp, so loading it again
+ * needs no parsing: the file is mapped and decoded front to back.
+ *
+ *   header   magic, then the size, mtime and hash of the source
+ *   symbols  count, then each name as length and bytes
+ *   forms    count, then each form
+ *
+ * A form is a tag byte followed by its contents: a zigzag varint for
+ * a fixnum, length and bytes for a string, a symbol table index for a
+ * symbol, and for a list the number of elements, each element, and
+ * the tail.  All counts and lengths are varints.
+ *
+ * A fasl is up to date if the source has the size it records and
+ * either the same mtime or, failing that, the same contents.
+ *
+ * Channels carry data between heaps the same way: a packed datum is
+ * a symbol table and one form, with no header.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "fasl.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FASL_MAGIC "JCMFASL1"
+#define FASL_MAGIC_SIZE 8
+
+enum {
+  TAG_NIL,
+  TAG_FIXNUM,
+  TAG_STRING,
+  TAG_SYMBOL,
+  TAG_LIST
+};
+
+/* What a fasl records about its source. */
+struct Source {
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t hash;
+};
+
+struct Fasl {
+  unsigned char *map;
+  size_t size;
+  size_t pos;
+  uint64_t forms;       /* left to read */
+  uint64_t nsymbols;
+  size_t *names;        /* where each symbol's name is, until interned */
+  Object **symbols;
+};
+
+struct FaslWriter {
+  unsigned char *buf;   /* encoded forms */
+  size_t len, cap;
+  uint64_t forms;
+  Object **symbols;     /* table of symbols seen, by index */
+  uint64_t nsymbols;
+  int *slots;           /* open-addressed: index + 1, or 0 */
+  size_t nslots;
+};
+
+char *fasl_path(char *path) {
+  size_t len = strlen(path);
+  char *fasl = malloc(len + 6);
+
+  assert(fasl != NULL);
+
+  if (len > 4 && strcmp(path + len - 4, ".lsp") == 0)
+    len -= 4;
+
+  memcpy(fasl, path, len);
+  strcpy(fasl + len, ".fasl");
+  return fasl;
+}
+
+static uint64_t fnv1a(unsigned char *p, size_t n) {
+  uint64_t h = 14695981039346656037ull;
+
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ p[i]) * 1099511628211ull;
+
+  return h;
+}
+
+/* The hash of the contents of the file at PATH, or 0 on failure. */
+static uint64_t hash_file(char *path, size_t size) {
+  int fd = open(path, O_RDONLY);
+  uint64_t h = 0;
+
+  if (fd < 0)
+    return 0;
+
+  if (size == 0) {
+    h = fnv1a(NULL, 0);
+  } else {
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      h = fnv1a(map, size);
+      munmap(map, size);
+    }
+  }
+
+  close(fd);
+  return h;
+}
+
+static int stat_source(char *path, struct Source *src) {
+  struct stat st;
+
+  if (stat(path, &st) != 0)
+    return 0;
+
+  src->size = st.st_size;
+  src->mtime_sec = st.st_mtim.tv_sec;
+  src->mtime_nsec = st.st_mtim.tv_nsec;
+  src->hash = 0;
+  return 1;
+}
+
+/* Reading */
+
+static void corrupt(void) {
+  error("Corrupt fasl");
+}
+
+/* The varint at the cursor into *N, or 0 if it runs off the end. */
+static int varint(Fasl *f, uint64_t *n) {
+  *n = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (f->pos >= f->size)
+      return 0;
+
+    unsigned char b = f->map[f->pos++];
+    *n |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 1;
+  }
+
+  return 0;
+}
+
+static uint64_t get_varint(Fasl *f) {
+  uint64_t n;
+
+  if (!varint(f, &n))
+    corrupt();
+  return n;
+}
+
+/* LEN bytes at the cursor, stepped past. */
+static char *get_bytes(Fasl *f, uint64_t len) {
+  char *p = (char *)f->map + f->pos;
+
+  if (len > f->size - f->pos)
+    corrupt();
+
+  f->pos += len;
+  return p;
+}
+
+static Object *decode(Fasl *f) {
+  if (f->pos >= f->size)
+    corrupt();
+
+  switch (f->map[f->pos++]) {
+    case TAG_NIL:
+      return s_nil;
+    case TAG_FIXNUM: {
+      uint64_t z = get_varint(f);
+      return make_fixnum((int)((z >> 1) ^ -(z & 1)));
+    }
+    case TAG_STRING: {
+      uint64_t len = get_varint(f);
+      return make_string_n(get_bytes(f, len), len);
+    }
+    case TAG_SYMBOL: {
+      uint64_t i = get_varint(f);
+
+      if (i >= f->nsymbols)
+        corrupt();
+      return f->symbols[i];
+    }
+    case TAG_LIST: {
+      Object *list = NULL;
+      Object *item = NULL;
+      Object *tail;
+      uint64_t n = get_varint(f);
+
+      pin_variable((void **)&list);
+      pin_variable((void **)&item);
+
+      // The head cell is a placeholder to append to.
+      list = tail = cons(s_nil, s_nil);
+
+      while (n-- > 0) {
+        item = decode(f);
+        setcdr(tail, cons(item, s_nil));
+        tail = cdr(tail);
+      }
+      setcdr(tail, decode(f));
+
+      unpin_variable((void **)&item);
+      unpin_variable((void **)&list);
+      return cdr(list);
+    }
+  }
+
+  corrupt();
+  return NULL;
+}
+
+/* Step past the symbol table at the cursor, noting where each name
+ * is; 0 if it is damaged. */
+static int check_symbols(Fasl *f) {
+  uint64_t len;
+
+  if (!varint(f, &f->nsymbols) || f->nsymbols > f->size)
+    return 0;
+
+  f->names = malloc((f->nsymbols + 1) * sizeof(size_t));
+  assert(f->names != NULL);
+
+  for (uint64_t i = 0; i < f->nsymbols; i++) {
+    f->names[i] = f->pos;
+    if (!varint(f, &len) || len > f->size - f->pos)
+      return 0;
+    f->pos += len;
+  }
+
+  return 1;
+}
+
+/* Intern the names check_symbols found.  Interned symbols are kept by
+ * the symbol list, so nothing is interned before the whole file has
+ * been checked. */
+static void intern_symbols(Fasl *f) {
+  size_t pos = f->pos;
+
+  f->symbols = malloc((f->nsymbols + 1) * sizeof(Object *));
+  assert(f->symbols != NULL);
+
+  for (uint64_t i = 0; i < f->nsymbols; i++) {
+    f->pos = f->names[i];
+    uint64_t len = get_varint(f);
+    f->symbols[i] = intern_symbol_n(get_bytes(f, len), len);
+  }
+
+  f->pos = pos;
+}
+
+/* Step past the form at the cursor without making it; 0 if it is
+ * damaged. */
+static int skip_form(Fasl *f) {
+  uint64_t n;
+
+  if (f->pos >= f->size)
+    return 0;
+
+  switch (f->map[f->pos++]) {
+    case TAG_NIL:
+      return 1;
+    case TAG_FIXNUM:
+      return varint(f, &n);
+    case TAG_STRING:
+      if (!varint(f, &n) || n > f->size - f->pos)
+        return 0;
+      f->pos += n;
+      return 1;
+    case TAG_SYMBOL:
+      return varint(f, &n) && n < f->nsymbols;
+    case TAG_LIST:
+      if (!varint(f, &n))
+        return 0;
+      // The elements, then the tail.
+      for (uint64_t i = 0; i <= n; i++) {
+        if (!skip_form(f))
+          return 0;
+      }
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Whether the symbols and forms are all there, so that loading can't
+ * fail part way through. */
+static int check_fasl(Fasl *f) {
+  size_t start;
+
+  if (!check_symbols(f) || !varint(f, &f->forms))
+    return 0;
+
+  start = f->pos;
+  for (uint64_t i = 0; i < f->forms; i++) {
+    if (!skip_form(f))
+      return 0;
+  }
+
+  intern_symbols(f);
+  f->pos = start;
+  return 1;
+}
+
+static void free_fasl(Fasl *f) {
+  munmap(f->map, f->size);
+  free(f->names);
+  free(f->symbols);
+  free(f);
+}
+
+Fasl *open_fasl(char *path, char *source) {
+  struct stat st;
+  struct Source src, recorded;
+  Fasl *f;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < FASL_MAGIC_SIZE + (off_t)sizeof(struct Source)) {
+    close(fd);
+    return NULL;
+  }
+
+  f = calloc(1, sizeof(Fasl));
+  assert(f != NULL);
+  f->size = st.st_size;
+  f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (f->map == MAP_FAILED) {
+    free(f);
+    return NULL;
+  }
+
+  if (memcmp(f->map, FASL_MAGIC, FASL_MAGIC_SIZE) != 0) {
+    free_fasl(f);
+    return NULL;
+  }
+
+  memcpy(&recorded, f->map + FASL_MAGIC_SIZE, sizeof(recorded));
+  f->pos = FASL_MAGIC_SIZE + sizeof(recorded);
+
+  if (source != NULL) {
+    if (!stat_source(source, &src) || src.size != recorded.size ||
+        ((src.mtime_sec != recorded.mtime_sec ||
+          src.mtime_nsec != recorded.mtime_nsec) &&
+         hash_file(source, src.size) != recorded.hash)) {
+      free_fasl(f);
+      return NULL;
+    }
+  }
+
+  madvise(f->map, f->size, MADV_SEQUENTIAL);
+
+  // A damaged fasl is as good as none: the source is read instead.
+  if (!check_fasl(f)) {
+    free_fasl(f);
+    return NULL;
+  }
+
+  return f;
+}
+
+/* The next form, or NULL after the last. */
+Object *fasl_read(Fasl *f) {
+  if (f->forms == 0)
+    return NULL;
+
+  f->forms--;
+  return decode(f);
+}
+
+void close_fasl(Fasl *f) {
+  free_fasl(f);
+}
+
+/* Writing */
+
+FaslWriter *fasl_writer(void) {
+  FaslWriter *w = calloc(1, sizeof(FaslWriter));
+
+  assert(w != NULL);
+  w->cap = 4096;
+  w->buf = malloc(w->cap);
+  w->nslots = 256;
+  w->slots = calloc(w->nslots, sizeof(int));
+  w->symbols = malloc(w->nslots / 2 * sizeof(Object *));
+  assert(w->buf != NULL && w->slots != NULL && w->symbols != NULL);
+  return w;
+}
+
+void free_fasl_writer(FaslWriter *w) {
+  free(w->buf);
+  free(w->slots);
+  free(w->symbols);
+  free(w);
+}
+
+static void put_byte(FaslWriter *w, unsigned char b) {
+  if (w->len == w->cap) {
+    w->cap *= 2;
+    w->buf = realloc(w->buf, w->cap);
+    assert(w->buf != NULL);
+  }
+
+  w->buf[w->len++] = b;
+}
+
+static void put_varint(FaslWriter *w, uint64_t n) {
+  while (n >= 0x80) {
+    put_byte(w, (n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  put_byte(w, n);
+}
+
+static void put_bytes(FaslWriter *w, char *p, size_t n) {
+  put_varint(w, n);
+  for (size_t i = 0; i < n; i++)
+    put_byte(w, p[i]);
+}
+
+static size_t slot_of(FaslWriter *w, Object *sym) {
+  size_t i = ((uintptr_t)sym >> 4) * 2654435761u % w->nslots;
+
+  while (w->slots[i] != 0 && w->symbols[w->slots[i] - 1] != sym)
+    i = (i + 1) % w->nslots;
+
+  return i;
+}
+
+/* SYM's index in the symbol table, adding it if it is new. */
+static uint64_t symbol_index(FaslWriter *w, Object *sym) {
+  size_t i = slot_of(w, sym);
+
+  if (w->slots[i] != 0)
+    return w->slots[i] - 1;
+
+  // Keep the table at most half full.
+  if (w->nsymbols + 1 > w->nslots / 2) {
+    w->nslots *= 2;
+    free(w->slots);
+    w->slots = calloc(w->nslots, sizeof(int));
+    w->symbols = realloc(w->symbols, w->nslots / 2 * sizeof(Object *));
+    assert(w->slots != NULL && w->symbols != NULL);
+
+    for (uint64_t j = 0; j < w->nsymbols; j++)
+      w->slots[slot_of(w, w->symbols[j])] = j + 1;
+    i = slot_of(w, sym);
+  }
+
+  w->symbols[w->nsymbols] = sym;
+  w->slots[i] = ++w->nsymbols;
+  return w->nsymbols - 1;
+}
+
+static void encode(FaslWriter *w, Object *obj) {
+  if (obj == s_nil) {
+    put_byte(w, TAG_NIL);
+  } else if (is_fixnum(obj)) {
+    int64_t n = obj->num.value;
+
+    put_byte(w, TAG_FIXNUM);
+    put_varint(w, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+  } else if (is_string(obj)) {
+    put_byte(w, TAG_STRING);
+    put_bytes(w, obj->str.text, strlen(obj->str.text));
+  } else if (is_symbol(obj)) {
+    put_byte(w, TAG_SYMBOL);
+    put_varint(w, symbol_index(w, obj));
+  } else if (is_cell(obj)) {
+    Object *tail = obj;
+    uint64_t n = 0;
+
+    for (; is_cell(tail); tail = cdr(tail))
+      n++;
+
+    put_byte(w, TAG_LIST);
+    put_varint(w, n);
+    for (; is_cell(obj); obj = cdr(obj))
+      encode(w, car(obj));
+    encode(w, tail);
+  } else {
+    // The reader makes nothing else.
+    put_byte(w, TAG_NIL);
+  }
+}
+
+void fasl_write(FaslWriter *w, Object *form) {
+  encode(w, form);
+  w->forms++;
+}
+
+/* W's symbol table, as check_symbols() reads it. */
+static void put_symbols(FaslWriter *head, FaslWriter *w) {
+  put_varint(head, w->nsymbols);
+  for (uint64_t i = 0; i < w->nsymbols; i++) {
+    char *name = w->symbols[i]->symbol.name;
+    put_bytes(head, name, strlen(name));
+  }
+}
+
+static int write_all(int fd, void *p, size_t n) {
+  while (n > 0) {
+    ssize_t done = write(fd, p, n);
+
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done <= 0)
+      return 0;
+
+    p = (char *)p + done;
+    n -= done;
+  }
+
+  return 1;
+}
+
+/* Write the forms to PATH, keyed on the source at SOURCE.
+ * Returns 0 if it couldn't, which only costs the next load time. */
+int fasl_save(FaslWriter *w, char *path, char *source) {
+  struct Source src;
+  FaslWriter *head;
+  char *tmp;
+  int fd, ok;
+
+  if (!stat_source(source, &src))
+    return 0;
+  src.hash = hash_file(source, src.size);
+
+  // The symbol table goes before the forms, which are done first.
+  head = fasl_writer();
+  for (int i = 0; i < FASL_MAGIC_SIZE; i++)
+    put_byte(head, FASL_MAGIC[i]);
+  for (size_t i = 0; i < sizeof(src); i++)
+    put_byte(head, ((unsigned char *)&src)[i]);
+
+  put_symbols(head, w);
+  put_varint(head, w->forms);
+
+  // A name of its own, in case another interpreter is saving it too.
+  tmp = malloc(strlen(path) + 8);
+  assert(tmp != NULL);
+  sprintf(tmp, "%s.XXXXXX", path);
+
+  fd = mkstemp(tmp);
+  ok = fd >= 0 &&
+       fchmod(fd, 0644) == 0 &&
+       write_all(fd, head->buf, head->len) &&
+       write_all(fd, w->buf, w->len);
+
+  if (fd >= 0)
+    ok = (close(fd) == 0) && ok;
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  if (!ok)
+    unlink(tmp);
+
+  free(tmp);
+  free_fasl_writer(head);
+  return ok;
+}
+
+/* Packed data */
+
+char *fasl_pack(Object *obj, size_t *len) {
+  FaslWriter *w = fasl_writer();
+  FaslWriter *packed = fasl_writer();
+  char *buf;
+
+  encode(w, obj);
+
+  put_symbols(packed, w);
+  for (size_t i = 0; i < w->len; i++)
+    put_byte(packed, w->buf[i]);
+
+  buf = (char *)packed->buf;
+  *len = packed->len;
+  packed->buf = NULL;
+
+  free_fasl_writer(packed);
+  free_fasl_writer(w);
+  return buf;
+}
+
+Object *fasl_unpack(char *buf, size_t len) {
+  Fasl f;
+  Object *obj;
+
+  memset(&f, 0, sizeof(f));
+  f.map = (unsigned char *)buf;
+  f.size = len;
+
+  if (!check_symbols(&f)) {
+    free(f.names);
+    corrupt();
+  }
+  intern_symbols(&f);
+  obj = decode(&f);
+
+  free(f.names);
+  free(f.symbols);
+  return obj;
+}
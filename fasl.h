@@ -0,0 +1,31 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+typedef struct Fasl Fasl;
+typedef struct FaslWriter FaslWriter;
+
+/* The fasl PATH caches, in a buffer the caller frees. */
+char *fasl_path(char *path);
+
+/* The forms in the fasl at PATH, if it is undamaged and up to date
+ * with the source at SOURCE, or NULL. */
+Fasl *open_fasl(char *path, char *source);
+Object *fasl_read(Fasl *f);
+void close_fasl(Fasl *f);
+
+/* Forms to save as they are read, before eval rewrites them. */
+FaslWriter *fasl_writer(void);
+void fasl_write(FaslWriter *w, Object *form);
+int fasl_save(FaslWriter *w, char *path, char *source);
+void free_fasl_writer(FaslWriter *w);
+
+/* OBJ, which may hold only what the reader makes, packed into a
+ * buffer of *LEN bytes the caller frees; and unpacked into this heap. */
+char *fasl_pack(Object *obj, size_t *len);
+Object *fasl_unpack(char *buf, size_t len);
@@ -9,297 +9,254 @@
 
 #include "jcm-lisp.h"
 #include "gc.h"
+#include "hashcons.h"
+#include "scan.h"
+#include "reader.h"
+#include "printer.h"
+#include "trace.h"
+#include "pmap.h"
+#include "task.h"
+#include "api.h"
+#include "profile.h"
+
+#include <time.h>
 
 #ifdef GC_PIN
-int pv_count = 0;
+/* Pinned variables form a stack, since they are nearly always
+ * unpinned in the reverse order they were pinned.  A fixed array
+ * keeps pinning from allocating. */
 
 void print_pins() {
-  printf("\nPinned variables:\n");
-  struct PinnedVariable *pv;
-  for (pv = pv_head; pv != NULL; pv = pv->next) {
-    printf("Pinned variable: %p %p\n", pv, pv->var);
-  }
-  printf("Done.\n");
+  trace_printf("Pinned variables:\n");
+  for (int i = interp->pv_count - 1; i >= 0; i--)
+    trace_printf("Pinned variable: %d %p\n", i, interp->pins[i]);
+  trace_flush();
 }
 
 void pin_variable(void **var) {
-#ifdef GC_PIN_DEBUG
-  printf("Pin\n");
-  printf("> var %p\n", var);
-#endif //GC_PIN_DEBUG
-
-  struct PinnedVariable *pv = NULL;
-  pv = calloc(1, sizeof(struct PinnedVariable));
-  assert(pv != NULL);
-
-  pv->var = var;
-  pv->next = pv_head;
-
-#ifdef GC_PIN_DEBUG_X
-  printf("Pinned variable         = %p\n", pv);
-  //printf("Pinned variable         = ");
-  //print((struct Object *)pv->var);
-  printf("Pinned variables before = %p\n", pv_head);
-#endif //GC_PIN_DEBUG_X
-
-  pv_head = pv;
-  pv_count++;
-
-#ifdef GC_PIN_DEBUG_X
-  printf("Pinned variables after  = %p\n", pv_head);
-  printf("Pinned variable count %d\n", pv_count);
-#endif //GC_PIN_DEBUG_X
+  if (interp->pv_count == MAX_PINS)
+    error("Too many pinned variables");
+
+  interp->pins[interp->pv_count++] = var;
+
+  TRACE(TRACE_PIN, TRACE_VERBOSE, "pin %p, %d pinned\n", var, interp->pv_count);
 }
 #else
 void pin_variable(void **var) { // void
-  //printf("PIN\n");
 }
 #endif // GC_PIN
 
 #ifdef GC_PIN
 void unpin_variable(void **var) {
-#ifdef GC_PIN_DEBUG
-  printf("< var %p\n", var);
-#endif //GC_PIN_DEBUG
-
-  struct PinnedVariable *curr = NULL;
-  struct PinnedVariable *prev = NULL;
-
-  for (curr = pv_head; curr != NULL; prev = curr, curr = curr->next) {
-
-    if (curr->var == var) {
-
-#ifdef GC_PIN_DEBUG
-      printf("Containing: ");
-      print(curr->var);
-      //print(*var);
-#endif
+  for (int i = interp->pv_count - 1; i >= 0; i--) {
 
-      if (prev)
-        prev->next = curr->next;
-      else
-        pv_head = curr->next;
+    if (interp->pins[i] == var) {
+      if (tracing(TRACE_PIN, TRACE_VERBOSE)) {
+        trace_printf("unpin %p, %d pinned: ", var, interp->pv_count - 1);
+        trace_object(*(Object **)var);
+        trace_printf("\n");
+      }
 
-      free(curr);
-      pv_count--;
+      // Out of order unpins are rare; close the gap.
+      for (; i < interp->pv_count - 1; i++)
+        interp->pins[i] = interp->pins[i + 1];
 
-#ifdef GC_PIN_DEBUG
-      printf("\nUnpin\n");
-      printf("Pinned variable count %d\n", pv_count);
-#endif
+      interp->pv_count--;
       return;
     }
   }
-  printf("\nPinned variable not found.\n");
-  //assert(0);
+
+  TRACE(TRACE_PIN, TRACE_INFO, "unpin %p: not pinned\n", var);
+}
+
+/* Snapshot the pin stack so a non-local exit can drop
+ * the pins of the stack frames it unwinds. */
+int save_pins() {
+  return interp->pv_count;
+}
+
+void restore_pins(int saved) {
+  if (saved < interp->pv_count)
+    interp->pv_count = saved;
 }
 #else
 void unpin_variable(void **var) { // void
-  //printf("UNPIN %p\n", var);
-  //print(var);
-  //printf("\n");
+}
+
+int save_pins() {
+  return 0;
+}
+
+void restore_pins(int saved) { // void
 }
 #endif // GC_PIN
 
 #ifdef GC_ENABLED
-void mark(Object *obj) {
-  if (obj == NULL) {
-#ifdef GC_DEBUG
-    printf("\nNothing to mark: NULL");
-#endif // GC_DEBUG
+/* Mark the objects an analyzed node tree refers to. */
+void mark_node(Node *node) {
+  if (node == NULL)
     return;
-  }
-#ifdef GC_DEBUG_XX
-  Object *temp = obj; printf("\nMarking %p\n", temp);
-#endif // GC_DEBUG_XX
-  if (obj->mark > 0) {
-#ifdef GC_DEBUG_XX
-    printf("\nNothing to mark: already marked\n");
-#endif // GC_DEBUG_XX
+
+  mark(node->form);
+  mark(node->value);
+  mark(node->pair);
+
+  mark_node(node->op);
+  mark_node(node->then);
+  mark_node(node->other);
+  for (int i = 0; i < node->argc; i++)
+    mark_node(node->args[i]);
+}
+
+/* Under an allocation profile, the root marking has got to. */
+static __thread char *retainer;
+
+void mark(Object *obj) {
+  if (obj == NULL || obj->mark > 0)
     return;
-  }
 
-#ifdef GC_DEBUG
-  //printf("\nBefore mark: %p %d", obj, obj->mark);
-#endif // GC_DEBUG
+  obj->mark = interp->current_mark;
 
-  obj->mark = current_mark;
+  if (__builtin_expect(retainer != NULL, 0))
+    alloc_profile_marked(obj, retainer);
 
-#ifdef GC_DEBUG
-  //printf("\nAfter mark: %p %d", obj, obj->mark);
-#endif // GC_DEBUG
+  if (tracing(TRACE_GC, TRACE_VERBOSE)) {
+    trace_printf("mark %d %s ", obj->id, get_type(obj));
+    trace_object(obj);
+    trace_printf("\n");
+  }
 
   switch (obj->type) {
     case FIXNUM:
     case STRING:
     case SYMBOL:
     case PRIMITIVE:
-#ifdef GC_DEBUG_XX
-      printf("\nMark %d %s ", obj->id, get_type(obj));
-      print(obj);
-#endif // GC_DEBUG_XX
+    case PORT:
+    case CHANNEL:
       break;
     case CELL:
-#ifdef GC_DEBUG_XX
-      printf("\nMark cell car %p -> %p", obj, obj->cell.car);
-#endif // GC_DEBUG_XX
       mark(obj->cell.car);
-#ifdef GC_DEBUG_XX
-      printf("\nMark cell car %p <-", obj);
-#endif // GC_DEBUG
-#ifdef GC_DEBUG_XX
-      printf("\nMark cell cdr %p -> %p", obj, obj->cell.cdr);
-#endif // GC_DEBUG_XX
       mark(obj->cell.cdr);
-#ifdef GC_DEBUG_XX
-      printf("\nMark cell cdr %p <-", obj);
-#endif // GC_DEBUG_XX
       break;
     case PROC:
-#ifdef GC_DEBUG_XX
-      printf("\nMark proc ->");
-#endif // GC_DEBUG_XX
-#ifdef GC_DEBUG_XX
-      printf("\nMark proc vars");
-#endif // GC_DEBUG_XX
-      mark(obj->proc.vars);
-#ifdef GC_DEBUG_XX
-      printf("\nMark proc body");
-#endif // GC_DEBUG_XX
-      mark(obj->proc.body);
-#ifdef GC_DEBUG_XX
-      printf("\nMark proc env");
-#endif // GC_DEBUG_XX
+      mark(obj->proc.code);
       mark(obj->proc.env);
-#ifdef GC_DEBUG
-      printf("\nMark proc <-");
-#endif // GC_DEBUG_XX
+      break;
+    case CODE:
+      mark_node(obj->code.node);
+      mark(obj->code.expansions);
+      break;
+    case MACRO:
+      mark(obj->macro.proc);
       break;
     default:
-      printf("\nMark unknown object: %d\n", obj->type);
+      TRACE(TRACE_GC, TRACE_INFO, "mark: unknown object type %d\n", obj->type);
       break;
   }
 }
 
 int is_active(void *needle) {
-  for (int i = 0; i <= MAX_ALLOC_SIZE; i++) {
-    if (active_list[i] == needle)
+  for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
+    if (interp->active_list[i] == needle)
       return 1;
   }
 
   return 0;
 }
 
-void sweep() {
-  int counted = 0;
+static void reset_tlab(Interp *in) {
+  in->tlab_next = in->tlab_end = 0;
+}
+
+/* Free the unmarked objects, and return how many that was. */
+int sweep() {
+  struct AllocProfile *allocs = interp->owner->allocs;
   int kept = 0;
   int swept = 0;
   int cells = 0;
 
+  // Every thread starts again from the bottom.
+  interp->owner->next_free = 0;
+  reset_tlab(interp->owner);
+  for_each_worker(reset_tlab);
+
   for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
-    Object *obj = active_list[i];
+    Object *obj = interp->active_list[i];
 
     if (obj == NULL)
       continue;
 
-#ifdef GC_DEBUG
-    //printf("\nObj at                 = %p\n", obj);
-#endif // GC_DEBUG
+    if (allocs != NULL)
+      alloc_profile_swept(i, obj->mark != 0);
 
     if (obj->mark == 0) {
-#ifdef GC_DEBUG
-      printf("\nSWEEP: %p id: %d mark: %d ", obj, obj->id, obj->mark);
-      print(obj);
-#endif // GC_DEBUG
+      // Only the header: what it points to may already be swept.
+      TRACE(TRACE_GC, TRACE_VERBOSE, "sweep %d %s\n", obj->id, get_type(obj));
 
       // Free any additional allocated memory.
       switch (obj->type) {
         case STRING:
           memset(obj->str.text, 0, strlen(obj->str.text));
           free(obj->str.text);
-          //printf("\n");
           break;
         case SYMBOL:
           memset(obj->symbol.name, 0, strlen(obj->symbol.name));
           free(obj->symbol.name);
-          //printf("\n");
           break;
         case CELL:
           cells++;
           break;
+        case CODE:
+          free_node(obj->code.node);
+          obj->code.node = NULL;
+          break;
+        case PORT:
+          // Dropped without being closed.
+          if (obj->port.reader != NULL)
+            close_reader(obj->port.reader);
+          obj->port.reader = NULL;
+          if (obj->port.out >= 0)
+            close(obj->port.out);
+          obj->port.out = -1;
+          break;
         default:
-          //printf("\n");
           break;
       }
 
-      free_list[i] = obj;
-      active_list[i] = NULL;
+      interp->free_list[i] = obj;
+      interp->active_list[i] = NULL;
       swept++;
 
     } else {
-#ifdef GC_DEBUG_XX
-      printf("\nDo NOT sweep: %p id: %d mark: %d ", obj, obj->id, obj->mark);
-
-      print(obj);
-      switch (obj->type) {
-        case FIXNUM:
-          printf("\n");
-          break;
-        case STRING:
-          break;
-        case SYMBOL:
-          printf("\n");
-          break;
-        case PROC:
-          printf("\n");
-          break;
-        case PRIMITIVE:
-          printf("\n");
-          break;
-        default:
-          break;
-      }
-      if (!is_active(obj)) {
-        error("NOT found in active list!");
-      }
-#endif // GC_DEBUG_XX
       obj->mark = 0;
       kept++;
     }
-
-    counted++;
   }
-#ifdef GC_DEBUG
-  printf("\nDone sweep.  kept: %d swept: %d counted: %d\n\n", kept, swept, counted);
-  printf("%d are cells\n", cells);
-#endif // GC_DEBUG
+
+  TRACE(TRACE_GC, TRACE_DEBUG, "sweep: kept %d, swept %d, %d of them cells\n",
+        kept, swept, cells);
+  return swept;
 }
 
 int check_active() {
   int counted = 0;
 
   for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
-    if (active_list[i] != NULL)
+    if (interp->active_list[i] != NULL)
       counted++;
   }
 
-#ifdef GC_DEBUG
-  printf("Done check_active: %d counted\n", counted);
-#endif // GC_DEBUG
   return counted;
 }
 
 int check_free() {
   int counted = 0;
 
-  for (int i = 1; i <= MAX_ALLOC_SIZE; i++) {
-    if (free_list[i] != NULL)
+  for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
+    if (interp->free_list[i] != NULL)
       counted++;
   }
 
-#ifdef GC_DEBUG
-  printf("Done check_free: %d counted\n", counted);
-#endif // GC_DEBUG
   return counted;
 }
 
@@ -307,79 +264,193 @@ void check_mem() {
   int active = check_active();
   int free = check_free();
   int total = active + free;
-  printf("\nDone check_mem: %d total\n", total);
+
+  TRACE(TRACE_GC, TRACE_DEBUG, "check_mem: %d active, %d free\n", active, free);
+
   if (total != MAX_ALLOC_SIZE) {
-    printf("Missing %d objects", MAX_ALLOC_SIZE - total);
+    TRACE(TRACE_GC, TRACE_INFO, "check_mem: %d objects missing\n",
+          MAX_ALLOC_SIZE - total);
     error("check_mem fail!");
   }
 }
 
-void mark_pins(struct PinnedVariable *pvs) {
-  struct PinnedVariable *pv = NULL;
-  pv = pvs;
+void mark_pins(Interp *in) {
+  for (int i = 0; i < in->pv_count; i++) {
+    // The pin holds the address of the variable, not the object.
+    Object *obj = *(Object **)in->pins[i];
+
+    if (tracing(TRACE_PIN, TRACE_DEBUG)) {
+      trace_printf("mark pin %d at %p: ", i, in->pins[i]);
+      if (obj == NULL)
+        trace_printf("NULL");
+      else if (tracing(TRACE_PIN, TRACE_VERBOSE))
+        trace_object(obj);
+      else
+        trace_printf("%s %d", get_type(obj), obj->id);
+      trace_printf("\n");
+    }
 
-  for (pv = pvs; pv != NULL; pv = pv->next) {
-    printf("pv: %p\n", pv);
-    printf("pv Object: %p\n", pv->var);
+    mark(obj);
+  }
+}
 
-    Object *obj = (Object *)pv->var;
-    if (obj == NULL) {
-      printf("\nNULL Object\n");
-    } else {
-      print(obj);
-      mark(obj);
-      print((Object *)pv->var);
-      printf("\nMarked pv\n");
+/* Values being passed to a call sit on the value stack. */
+void mark_value_stack(Interp *in) {
+  for (int i = 0; i < in->value_sp; i++)
+    mark(in->value_stack[i]);
+}
+
+/* What one thread's stacks hold. */
+void mark_stacks(Interp *in) {
+#ifdef GC_PIN
+  TRACE(TRACE_GC, TRACE_DEBUG, "gc: mark %d pins\n", in->pv_count);
+  mark_pins(in);
+#endif // GC_PIN
+
+  TRACE(TRACE_GC, TRACE_DEBUG, "gc: mark %d values on the stack\n", in->value_sp);
+  mark_value_stack(in);
+}
+
+/* Credit what is marked next to ROOT, under an allocation profile. */
+static void retain_as(char *root) {
+  if (interp->owner->allocs != NULL)
+    retainer = root;
+}
+
+/* Under an allocation profile, each global's value by its name. */
+static void mark_toplevel() {
+  if (retainer != NULL) {
+    for (Object *cell = cdr(interp->top_env); is_cell(cell); cell = cdr(cell)) {
+      Object *pair = car(cell);
+
+      if (is_cell(pair) && is_symbol(car(pair))) {
+        retainer = car(pair)->symbol.name;
+        mark(cdr(pair));
+      }
     }
+    retainer = "(toplevel)";
   }
+
+  mark(interp->top_env);
 }
 
 void gc() {
+  struct timespec start, end;
+  long ns;
+  int swept = 0;
 
-  printf("\nGC v----------------------------------------v\n");
-  check_mem();
+  // The pause counts the wait for the other threads to stop.
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-#ifdef GC_MARK
-  printf("\n-------- Mark symbols:");
-  mark(symbols);
+  // Under pmap, only once the other threads have stopped, unless one
+  // of them got there first.
+  if (interp->parallel && !stop_world())
+    return;
+
+  check_mem();
 
-  printf("\n-------- Mark top_env:");
-  mark(top_env);
+  if (interp->owner->allocs != NULL)
+    alloc_profile_gc();
 
-#ifdef GC_PIN
-  printf("\n-------- Mark pins:\n");
-  mark_pins(pv_head);
-#endif // GC_PIN
+#ifdef GC_MARK
+  TRACE(TRACE_GC, TRACE_DEBUG, "gc: mark symbols\n");
+  retain_as("(symbols)");
+  mark(interp->owner->symbols);
+
+  TRACE(TRACE_GC, TRACE_DEBUG, "gc: mark top_env\n");
+  mark_toplevel();
+
+  retain_as("(stacks)");
+  mark_stacks(interp->owner);
+  for_each_worker(mark_stacks);
+  retain_as("(tasks)");
+  mark_tasks(interp->owner);
+  retain_as("(handles)");
+  mark_handles(interp->owner);
+  retainer = NULL;
 #endif // GC_MARK
 
 #ifdef GC_SWEEP
-  printf("\n-------- Sweep\n");
-  sweep();
+  TRACE(TRACE_GC, TRACE_DEBUG, "gc: sweep\n");
+  hashcons_sweep();
+  swept = sweep();
   check_mem();
 #endif // GC_SWEEP
 
-  printf("\nPinned variables: %d\n", pv_count);
-  printf("\nGC ^----------------------------------------^\n");
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+  interp->counters.collections++;
+  interp->counters.gc_ns += ns;
+
+  TRACE(TRACE_GC, TRACE_INFO, "gc: freed %d of %d objects, %d pinned, in %ld us\n",
+        swept, MAX_ALLOC_SIZE, interp->pv_count, ns / 1000);
+
+  if (interp->parallel)
+    start_world();
 }
 
-void *find_next_free() {
-  void *obj = NULL;
+/* Take the next run of slots to allocate from: under pmap, a few at
+ * a time, so threads can share the heap; otherwise all that are left. */
+static int refill_tlab() {
+  Interp *owner = interp->owner;
+  int found = 0;
+
+  lock_heap();
+
+  if (owner->next_free < MAX_ALLOC_SIZE) {
+    interp->tlab_next = owner->next_free;
+    interp->tlab_end = MAX_ALLOC_SIZE;
+    if (interp->parallel && owner->next_free + TLAB_SIZE < MAX_ALLOC_SIZE)
+      interp->tlab_end = owner->next_free + TLAB_SIZE;
+    owner->next_free = interp->tlab_end;
+    found = 1;
+  }
 
-  for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
-    obj = free_list[i];
+  unlock_heap();
+  return found;
+}
 
-    if (obj != NULL) {
-      active_list[i] = obj;
-      free_list[i] = NULL;
-      break;
+void *find_next_free() {
+  do {
+    for (int i = interp->tlab_next; i < interp->tlab_end; i++) {
+      void *obj = interp->free_list[i];
+
+      if (obj != NULL) {
+        interp->active_list[i] = obj;
+        interp->free_list[i] = NULL;
+        interp->tlab_next = i + 1;
+        return obj;
+      }
     }
-  }
 
-  return obj;
+    interp->tlab_next = interp->tlab_end;
+  } while (refill_tlab());
+
+  return NULL;
+}
+
+/* Under a server's heap limit, see whether collecting brings the
+ * heap back under it. */
+static void check_heap_limit() {
+  gc();
+
+  interp->heap_used = check_active();
+  if (interp->heap_used > interp->heap_limit)
+    error("Heap limit exceeded");
 }
 
 void *alloc_Object() {
-  void *obj = find_next_free();
+  void *obj;
+
+  // Where pmap's threads stop for a collection.
+  if (__builtin_expect(interp->parallel, 0))
+    safepoint();
+
+  if (__builtin_expect(interp->heap_limit > 0, 0) &&
+      ++interp->heap_used > interp->heap_limit)
+    check_heap_limit();
+
+  obj = find_next_free();
 
   if (obj == NULL) {
     //print_pins();
@@ -388,14 +459,17 @@ void *alloc_Object() {
     obj = find_next_free();
   }
 
-  if (obj == NULL) {
-    printf("Out of memory\n");
-    exit(-1);
+  // Under pmap, the other threads may have taken what was freed into
+  // their runs of slots; each collection hands those back.
+  for (int i = 0; obj == NULL && interp->parallel && i < PARALLEL_GC_TRIES; i++) {
+    gc();
+    obj = find_next_free();
   }
 
-#ifdef GC_DEBUG_X
-  printf("Allocated %d ", obj->id);
-#endif
+  if (obj == NULL)
+    error("Out of memory");
+
+  TRACE(TRACE_GC, TRACE_VERBOSE, "alloc %d\n", ((Object *)obj)->id);
 
   return obj;
 }
@@ -19,39 +19,25 @@
 #include <sys/errno.h>
 
 #define MAX_BUFFER_SIZE 100
-#define MAX_ALLOC_SIZE  1024
+/* Room for the toplevel of the tests plus any preloaded modules,
+ * and for a few hundred tasks blocked on ports at once. */
+#define MAX_ALLOC_SIZE  16384
 
 #define GC_ENABLED
 #define GC_MARK
 #define GC_SWEEP
 #define GC_PIN
 
-//#define GC_DEBUG
-//#define GC_DEBUG_X
-//#define GC_DEBUG_XX
-//#define GC_PIN_DEBUG
-//#define GC_PIN_DEBUG_X
-
-void *free_list[MAX_ALLOC_SIZE];
-void *active_list[MAX_ALLOC_SIZE];
-
-int current_mark;
-
-#ifdef GC_PIN
-struct PinnedVariable {
-  void **var;
-  struct PinnedVariable *next;
-};
-
-struct PinnedVariable *pv_head;
-
-#endif //GC_PIN
-
 void pin_variable(void **var);
 void unpin_variable(void **var);
+int save_pins();
+void restore_pins(int saved);
 
 #ifdef GC_ENABLED
 void *alloc_Object();
 void gc();
+void mark(Object *obj);
+int sweep();
+int check_active();     /* objects in the heap, live or not yet swept */
 void error(char *msg);
 #endif // GC_ENABLED
@@ -0,0 +1,232 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Hash-consing of literals.
+ *
+ * Before a toplevel form is evaluated, the fixnums, strings and quoted
+ * data in it are replaced by a shared copy of any equal literal already
+ * in the table, so the same list quoted twice is stored once.  Nothing
+ * in the language can modify a list, so sharing them can't be seen
+ * except by eq.
+ *
+ * A shared object has its structural hash cached in obj->hash, which
+ * is 0 for everything else.  The table doesn't keep its objects alive:
+ * gc() drops the ones it is about to free.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "hashcons.h"
+
+#include <stdint.h>
+
+int hashcons_enabled = 1;
+
+static unsigned int mix(unsigned int h) {
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+/* The hash of OBJ, whose parts are already shared. */
+static unsigned int hash_of(Object *obj) {
+  unsigned int h;
+
+  switch (obj->type) {
+    case FIXNUM:
+      h = mix(obj->num.value);
+      break;
+    case STRING:
+      h = 2166136261u;
+      for (char *s = obj->str.text; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+      break;
+    case CELL:
+      h = mix(obj->cell.car->hash * 31 + obj->cell.cdr->hash);
+      break;
+    default:
+      // Symbols are unique already.
+      h = mix((unsigned int)(uintptr_t)obj);
+      break;
+  }
+
+  return h != 0 ? h : 1;
+}
+
+/* Do A and B, both with shared parts, have the same contents? */
+static int same(Object *a, Object *b) {
+  if (a->type != b->type || a->hash != b->hash)
+    return 0;
+
+  switch (a->type) {
+    case FIXNUM:
+      return a->num.value == b->num.value;
+    case STRING:
+      return strcmp(a->str.text, b->str.text) == 0;
+    case CELL:
+      return a->cell.car == b->cell.car && a->cell.cdr == b->cell.cdr;
+    default:
+      return 0;
+  }
+}
+
+/* The shared object equal to OBJ, which becomes it if there is none.
+ * Only objects in the table keep their hash. */
+static Object *lookup(Object *obj) {
+  unsigned int i = obj->hash % HASHCONS_SIZE;
+
+  for (; interp->hashcons[i] != NULL; i = (i + 1) % HASHCONS_SIZE) {
+    if (same(interp->hashcons[i], obj)) {
+      obj->hash = 0;
+      return interp->hashcons[i];
+    }
+  }
+
+  interp->hashcons[i] = obj;
+  return obj;
+}
+
+static int is_atom_literal(Object *obj) {
+  return obj->type == FIXNUM || obj->type == STRING;
+}
+
+/* The shared copy of OBJ, or NULL if it holds something that can't be
+ * shared.  Conses nothing: lists are shared by pointing them at shared
+ * parts in place. */
+static Object *share(Object *obj) {
+  if (obj->hash != 0)
+    return obj;
+
+  if (obj->type == SYMBOL) {
+    obj->hash = hash_of(obj);
+    return obj;
+  }
+
+  if (is_atom_literal(obj)) {
+    obj->hash = hash_of(obj);
+    return lookup(obj);
+  }
+
+  if (obj->type != CELL)
+    return NULL;
+
+  // Share the cdrs from the end of the list back, keeping the spine
+  // on the value stack instead of recursing down it.
+  int base = interp->value_sp;
+  Object *tail = obj;
+
+  for (; tail->type == CELL && tail->hash == 0; tail = tail->cell.cdr)
+    push_value(tail);
+
+  Object *rest = share(tail);
+  int i = interp->value_sp;
+
+  while (rest != NULL && i > base) {
+    Object *cell = interp->value_stack[--i];
+    Object *head = share(cell->cell.car);
+
+    if (head == NULL) {
+      rest = NULL;
+      break;
+    }
+
+    setcar(cell, head);
+    setcdr(cell, rest);
+    cell->hash = hash_of(cell);
+    rest = lookup(cell);
+  }
+
+  // Whatever couldn't be shared still gets its parts shared.
+  for (; i > base; i--) {
+    Object *cell = interp->value_stack[i - 1];
+    Object *head = share(cell->cell.car);
+
+    if (head != NULL)
+      setcar(cell, head);
+  }
+
+  interp->value_sp = base;
+  return rest;
+}
+
+/* OBJ, or an equal literal already in the table. */
+Object *hashcons(Object *obj) {
+  Object *shared = share(obj);
+
+  return shared != NULL ? shared : obj;
+}
+
+/* Share the literals in FORM, code as read: quoted data and
+ * self-evaluating atoms.  The code itself isn't shared, since the
+ * analyzer and optimizer rewrite it in place. */
+Object *share_literals(Object *form) {
+  if (is_atom_literal(form))
+    return hashcons(form);
+
+  if (form->type != CELL)
+    return form;
+
+  if (car(form) == s_quote) {
+    if (is_cell(cdr(form)))
+      setcar(cdr(form), hashcons(cadr(form)));
+    return form;
+  }
+
+  for (Object *cell = form; is_cell(cell); cell = cdr(cell))
+    setcar(cell, share_literals(car(cell)));
+
+  return form;
+}
+
+/* Structural equality.  Shared literals are equal only if they are the
+ * same object, and cached hashes tell most others apart at once. */
+int equal(Object *a, Object *b) {
+  while (a != b) {
+    if (a->type != b->type ||
+        (a->hash != 0 && b->hash != 0))
+      return 0;
+
+    switch (a->type) {
+      case FIXNUM:
+        return a->num.value == b->num.value;
+      case STRING:
+        return strcmp(a->str.text, b->str.text) == 0;
+      case CELL:
+        if (!equal(a->cell.car, b->cell.car))
+          return 0;
+        a = a->cell.cdr;
+        b = b->cell.cdr;
+        break;
+      default:
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Called by gc() between marking and sweeping: forget the objects
+ * about to be freed.  The table holds at most the heap, so that many
+ * slots are set aside to keep the rest in while it is rebuilt; gc()
+ * may run on a task's or an embedder's small stack. */
+void hashcons_sweep() {
+  Object **live = interp->hashcons_live;
+  int count = 0;
+
+  for (int i = 0; i < HASHCONS_SIZE; i++) {
+    if (interp->hashcons[i] != NULL && interp->hashcons[i]->mark > 0)
+      live[count++] = interp->hashcons[i];
+    interp->hashcons[i] = NULL;
+  }
+
+  for (int i = 0; i < count; i++)
+    lookup(live[i]);
+}
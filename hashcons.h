@@ -0,0 +1,19 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Cleared by -H to keep every literal as it was read. */
+extern int hashcons_enabled;
+
+/* Never more than half full, since it can't hold more than the heap. */
+#define HASHCONS_SIZE (2 * MAX_ALLOC_SIZE)
+
+Object *hashcons(Object *obj);
+Object *share_literals(Object *form);
+int equal(Object *a, Object *b);
+void hashcons_sweep();
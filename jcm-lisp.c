@@ -9,9 +9,39 @@
 
 #include "jcm-lisp.h"
 #include "gc.h"
+#include "jit.h"
+#include "aot.h"
+#include "opt.h"
+#include "hashcons.h"
+#include "scan.h"
+#include "reader.h"
+#include "fasl.h"
+#include "printer.h"
+#include "trace.h"
+#include "pmap.h"
+#include "channel.h"
+#include "task.h"
+#include "server.h"
+#include "api.h"
+#include "profile.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+/* The interpreter this thread is running. */
+__thread Interp *interp;
 
 void error(char *msg) {
-  printf("\nError %s\n", msg);
+  if (!interp->quiet)
+    printf("\nError %s\n", msg);
+  interp->error_message = msg;
+
+  if (interp->error_handler != NULL)
+    longjmp(*interp->error_handler, 1);
+
   exit(0);
 }
 
@@ -30,6 +60,14 @@ char *get_type(Object *obj) {
     return "PRIM";
   else if (obj->type == PROC)
     return "PROC";
+  else if (obj->type == CODE)
+    return "CODE";
+  else if (obj->type == MACRO)
+    return "MACRO";
+  else if (obj->type == PORT)
+    return "PORT";
+  else if (obj->type == CHANNEL)
+    return "CHANNEL";
   else
     return "UNKNOWN";
 }
@@ -58,6 +96,18 @@ int is_proc(Object *obj) {
   return (obj && obj->type == PROC);
 }
 
+int is_port(Object *obj) {
+  return (obj && obj->type == PORT);
+}
+
+int is_channel(Object *obj) {
+  return (obj && obj->type == CHANNEL);
+}
+
+int is_macro(Object *obj) {
+  return (obj && obj->type == MACRO);
+}
+
 Object *car(Object *obj) {
   if (is_cell(obj))
     return obj->cell.car;
@@ -88,19 +138,22 @@ void setcdr(Object *obj, Object *val) {
   obj->cell.cdr = val;
 }
 
-Object *new_Object() {
+Object *new_Object(obj_type type) {
 #ifdef GC_ENABLED
   Object *obj = alloc_Object();
 #else
   Object *obj = calloc(1, sizeof(Object));
 #endif // GC_ENABLED
 
-  obj->type = UNKNOWN;
+  interp->counters.allocated[type]++;
+
+  obj->type = type;
   obj->mark = 0;
+  obj->hash = 0;
+
+  if (__builtin_expect(--interp->alloc_countdown <= 0, 0))
+    sample_allocation(obj);
 
-#ifdef GC_PIN_DEBUG
-  printf("Allocated object %p\n", obj);
-#endif
   return obj;
 }
 
@@ -108,8 +161,7 @@ Object *make_cell() {
   Object *obj = NULL;
 
   pin_variable((void **)&obj);
-  obj = new_Object();
-  obj->type = CELL;
+  obj = new_Object(CELL);
   obj->cell.car = s_nil;
   obj->cell.cdr = s_nil;
   unpin_variable((void **)&obj);
@@ -117,12 +169,16 @@ Object *make_cell() {
 }
 
 Object *make_string(char *str) {
+  return make_string_n(str, strlen(str));
+}
+
+/* A string of the LEN bytes at TEXT. */
+Object *make_string_n(char *text, size_t len) {
   Object *obj = NULL;
 
   pin_variable((void **)&obj);
-  obj = new_Object();
-  obj->type = STRING;
-  obj->str.text = strdup(str);
+  obj = new_Object(STRING);
+  obj->str.text = strndup(text, len);
   unpin_variable((void **)&obj);
   return obj;
 }
@@ -131,8 +187,7 @@ Object *make_fixnum(int n) {
   Object *obj = NULL;
 
   pin_variable((void **)&obj);
-  obj = new_Object();
-  obj->type = FIXNUM;
+  obj = new_Object(FIXNUM);
   obj->num.value = n;
   unpin_variable((void **)&obj);
   return obj;
@@ -142,38 +197,100 @@ Object *make_symbol(char *name) {
   Object *obj = NULL;
 
   pin_variable((void **)&obj);
-  obj = new_Object();
-  obj->type = SYMBOL;
+  obj = new_Object(SYMBOL);
   obj->symbol.name = strdup(name);
   unpin_variable((void **)&obj);
   return obj;
 }
 
+Object *make_port(Reader *reader) {
+  Object *obj = NULL;
+
+  pin_variable((void **)&obj);
+  obj = new_Object(PORT);
+  obj->port.reader = reader;
+  obj->port.out = -1;
+  unpin_variable((void **)&obj);
+  return obj;
+}
+
+Object *make_channel(Channel *channel) {
+  Object *obj = NULL;
+
+  pin_variable((void **)&obj);
+  obj = new_Object(CHANNEL);
+  obj->chan.channel = channel;
+  unpin_variable((void **)&obj);
+  return obj;
+}
+
 Object *make_primitive(primitive_fn *fn) {
   Object *obj = NULL;
 
   pin_variable((void **)&obj);
-  obj = new_Object();
-  obj->type = PRIMITIVE;
+  obj = new_Object(PRIMITIVE);
   obj->primitive.fn = fn;
+  obj->primitive.argv_fn = NULL;
+  obj->primitive.name = NULL;
+  obj->primitive.min_args = 0;
+  obj->primitive.max_args = -1;
+  obj->primitive.foreign = 0;
+  unpin_variable((void **)&obj);
+  return obj;
+}
+
+Object *make_primitive_argv(char *name, primitive_argv_fn *fn,
+                            int min_args, int max_args) {
+  Object *obj = NULL;
+
+  pin_variable((void **)&obj);
+  obj = new_Object(PRIMITIVE);
+  obj->primitive.fn = NULL;
+  obj->primitive.argv_fn = fn;
+  obj->primitive.name = name;
+  obj->primitive.min_args = min_args;
+  obj->primitive.max_args = max_args;
+  obj->primitive.foreign = 0;
   unpin_variable((void **)&obj);
   return obj;
 }
 
-Object *make_proc(Object *vars, Object *body, Object *env) {
+Object *make_proc(Node *lambda, Object *code, Object *env) {
   Object *obj = NULL;
 
   pin_variable((void **)&obj);
-  obj = new_Object();
-  obj->type = PROC;
-  obj->proc.vars = vars;
-  obj->proc.body = body;
+  obj = new_Object(PROC);
+  obj->proc.lambda = lambda;
+  obj->proc.code = code;
   obj->proc.env = env;
   unpin_variable((void **)&obj);
   //printf("Made proc.\n");
   return obj;
 }
 
+Object *make_code(Node *node) {
+  Object *obj = NULL;
+
+  pin_variable((void **)&obj);
+  obj = new_Object(CODE);
+  obj->code.node = node;
+  obj->code.expansions = s_nil;
+  unpin_variable((void **)&obj);
+  return obj;
+}
+
+Object *make_macro(Object *proc) {
+  Object *obj = NULL;
+
+  pin_variable((void **)&proc);
+  pin_variable((void **)&obj);
+  obj = new_Object(MACRO);
+  obj->macro.proc = proc;
+  unpin_variable((void **)&obj);
+  unpin_variable((void **)&proc);
+  return obj;
+}
+
 Object *cons(Object *car, Object *cdr) {
   Object *obj = NULL;
 
@@ -185,29 +302,19 @@ Object *cons(Object *car, Object *cdr) {
   return obj;
 }
 
-Object *lookup_symbol(char *name) {
-  Object *cell = symbols;
+Object *lookup_symbol(char *name, size_t len) {
+  Object *cell = __atomic_load_n(&interp->owner->symbols, __ATOMIC_ACQUIRE);
   Object *sym;
 
-#ifdef GC_DEBUG_XX
-  printf("Symbol for lookup %s\n", name);
-#endif
+  TRACE(TRACE_READER, TRACE_VERBOSE, "lookup symbol %.*s\n", (int)len, name);
 
   while (cell != s_nil) {
     sym = car(cell);
 
-#ifdef GC_DEBUG_XX
-    printf("Symbol for lookup comparison? %d %s\n", is_symbol(sym), sym->symbol.name);
-#endif
-
     if (is_symbol(sym) &&
-        strcmp(sym->symbol.name, name) == 0) {
-#ifdef GC_DEBUG_XX
-      printf("Symbol lookup succeeded\n");
-      printf("Symbol address %p\n", sym);
-#endif
+        strncmp(sym->symbol.name, name, len) == 0 &&
+        sym->symbol.name[len] == '\0')
       return sym;
-    }
 
     //printf("Still looking....\n");
     cell = cdr(cell);
@@ -222,14 +329,38 @@ Object *lookup_symbol(char *name) {
  * and return the new symbol.
  */
 Object *intern_symbol(char *name) {
-  Object *sym = lookup_symbol(name);
+  return intern_symbol_n(name, strlen(name));
+}
+
+/* Intern the symbol named by the LEN bytes at NAME. */
+Object *intern_symbol_n(char *name, size_t len) {
+  Object *sym = lookup_symbol(name, len);
 
   if (sym == NULL) {
+    char *copy = strndup(name, len);
+    Object *cell = NULL;
+    Object *found;
+    pin_variable((void **)&sym);
+    pin_variable((void **)&cell);
     //printf("Make symbol %s\n", name);
-    sym = make_symbol(name);
+    sym = make_symbol(copy);
+    free(copy);
     //printf("Made symbol %p\n", sym);
-    symbols = cons(sym, symbols);
+    cell = cons(sym, s_nil);
+
+    // Under pmap, another thread may have interned it meanwhile.
+    lock_heap();
+    found = lookup_symbol(name, len);
+    if (found == NULL) {
+      setcdr(cell, interp->owner->symbols);
+      __atomic_store_n(&interp->owner->symbols, cell, __ATOMIC_RELEASE);
+    } else {
+      sym = found;
+    }
+    unlock_heap();
     //printf("Interned symbol %p\n", sym);
+    unpin_variable((void **)&cell);
+    unpin_variable((void **)&sym);
   }
 
   return sym;
@@ -248,43 +379,36 @@ Object *assoc(Object *symbol, Object *env) {
   return NULL;
 }
 
-Object *primitive_add(Object *args) {
+Object *primitive_add(int argc, Object **argv) {
   int total = 0;
 
-  while (args != s_nil) {
-    total += car(args)->num.value;
-    args = cdr(args);
-  }
+  for (int i = 0; i < argc; i++)
+    total += argv[i]->num.value;
 
   return make_fixnum(total);
 }
 
-Object *primitive_sub(Object *args) {
-  long result = car(args)->num.value;
+Object *primitive_sub(int argc, Object **argv) {
+  long result = argv[0]->num.value;
 
-  args = cdr(args);
-  while (args != s_nil) {
-    result -= car(args)->num.value;
-    args = cdr(args);
-  }
+  for (int i = 1; i < argc; i++)
+    result -= argv[i]->num.value;
 
   return make_fixnum(result);
 }
 
-Object *primitive_mul(Object *args) {
+Object *primitive_mul(int argc, Object **argv) {
   long total = 1;
 
-  while (args != s_nil) {
-    total *= car(args)->num.value;
-    args = cdr(args);
-  }
+  for (int i = 0; i < argc; i++)
+    total *= argv[i]->num.value;
 
   return make_fixnum(total);
 }
 
-Object *primitive_div(Object *args) {
-  long dividend = car(args)->num.value;
-  long divisor = cadr(args)->num.value;
+Object *primitive_div(int argc, Object **argv) {
+  long dividend = argv[0]->num.value;
+  long divisor = argv[1]->num.value;
   long quotient = 0;
 
   if (divisor != 0)
@@ -293,166 +417,6 @@ Object *primitive_div(Object *args) {
   return make_fixnum(quotient);
 }
 
-int is_whitespace(char c) {
-  if (isspace(c))
-    return 1;
-  else
-    return 0;
-}
-
-int is_symbol_char(char c) {
-  return (isalnum(c) ||
-          strchr("+-*/", c));
-}
-
-void skip_whitespace(FILE *in) {
-  char c;
-  int done = 0;
-
-  while (!done) {
-    c = getc(in);
-    if (c == '\n' || c == '\r')
-      done = 1;
-
-    if (!is_whitespace(c)) {
-      ungetc(c, in);
-      done = 1;
-    }
-  }
-}
-
-void skip_comment(FILE *in) {
-  char c;
-  int done = 0;
-
-  while (!done) {
-    c = getc(in);
-    if (c == '\n' || c == '\r')
-      done = 1;
-  }
-}
-
-Object *read_string(FILE *in) {
-  char buffer[MAX_BUFFER_SIZE];
-  int i = 0;
-  char c;
-
-  while ((c = getc(in)) != '"' &&
-         i < MAX_BUFFER_SIZE - 1) {
-    buffer[i++] = c;
-  }
-
-  buffer[i] = '\0';
-  return make_string(buffer);
-}
-
-Object *read_symbol(FILE *in) {
-  char buffer[MAX_BUFFER_SIZE];
-  int i = 0;
-  char c;
-
-  while (!is_whitespace(c = getc(in)) &&
-         is_symbol_char(c) &&
-         i < MAX_BUFFER_SIZE - 1) {
-    buffer[i++] = c;
-  }
-
-  buffer[i] = '\0';
-  ungetc(c, in);
-
-  Object *obj = intern_symbol(buffer);
-
-  return obj;
-}
-
-Object *read_number(FILE *in) {
-  int number = 0;
-  char c;
-
-  while (isdigit(c = getc(in))) {
-    number *= 10;
-    number += (int)c - 48;
-  }
-
-  ungetc(c, in);
-
-  return make_fixnum(number);
-}
-
-// XXX Review these: strchr, strdup, strcmp
-// XXX Use these: strspn, atoi
-Object *read_lisp(FILE *in) {
-  skip_whitespace(in);
-  char c = getc(in);
-
-  if (c == EOF) {
-#ifdef REPL
-    exit(0);
-#else
-    printf("EOL\n");
-    return NULL;
-#endif
-  }
-
-  Object *obj = s_nil;
-  pin_variable((void **)&obj);
-
-  if (c == '\'') {
-    obj = cons(s_quote, cons(read_lisp(in), s_nil));
-  } else if (c == '(') {
-    obj = read_list(in);
-  } else if (c == '"') {
-    obj = read_string(in);
-  } else if (isdigit(c)) {
-    ungetc(c, in);
-    obj = read_number(in);
-  } else if (isalpha(c) ||
-             strchr("+-/*", c)) {
-    ungetc(c, in);
-    obj = read_symbol(in);
-  } else if (c == ')') {
-    ungetc(c, in);
-  } else if (c == ';') {
-    skip_comment(in);
-  }
-
-  unpin_variable((void **)&obj);
-
-  return obj;
-}
-
-Object *read_list(FILE *in) {
-  Object *car = NULL;
-  Object *cdr = NULL;
-  pin_variable((void **)&car);
-
-  car = cdr = make_cell();
-  car->cell.car = read_lisp(in);
-
-  char c;
-
-  while ((c = getc(in)) != ')') {
-    if (c == '.') {
-      // Discard the char after '.'
-      // but we should check for whitespace.
-      getc(in);
-
-      // The rest goes into the cdr.
-      car->cell.cdr = read_lisp(in);
-    } else if (!is_whitespace(c)) {
-      ungetc(c, in);
-
-      cdr->cell.cdr = make_cell();
-      cdr = cdr->cell.cdr;
-      cdr->cell.car = read_lisp(in);
-    }
-  }
-
-  unpin_variable((void **)&car);
-
-  return car;
-}
-
 /*
  * Returns a list with a new cons cell
  * containing VAR and VAL at the head
@@ -479,9 +443,9 @@ void print_env(Object *env) {
   Object *head = car(env);
 
   if (head != s_nil) {
-    printf("Env entry: ");
-    print(head);
-    printf(" at %p\n", head);
+    trace_printf("Env entry: ");
+    trace_object(head);
+    trace_printf(" at %p\n", head);
   }
 
   Object *tail = cdr(env);
@@ -497,335 +461,1197 @@ void print_env(Object *env) {
 }
 
 Object *extend_top(Object *var, Object *val) {
-  Object *current_top = cdr(top_env);
-  Object *updated_top = extend(current_top, var, val);
+  Object *updated_top = NULL;
+  pin_variable((void **)&updated_top);
 
-  setcdr(top_env, updated_top);
+  updated_top = extend(s_nil, var, val);
 
+  // Spliced in whole, so pmap's threads can't lose each other's.
+  lock_heap();
+  setcdr(updated_top, cdr(interp->top_env));
+  __atomic_store_n(&interp->top_env->cell.cdr, updated_top, __ATOMIC_RELEASE);
+  unlock_heap();
+
+  unpin_variable((void **)&updated_top);
   return val;
 }
 
 Object *eval(Object *obj, Object *env);
 
-/* Return list of evaluated args. */
-Object *eval_args(Object *args, Object *env) {
-  if (args != s_nil)
-    return cons(eval(car(args), env), eval_args(cdr(args), env));
+/* Returned by a node handler whose form is in tail position. */
+Object tail_call_marker;
 
-  return s_nil;
+/* Iterate vars and vals, adding each pair to this env. */
+Object *multiple_extend_env(Object *env, Object *vars, Object *vals) {
+  pin_variable((void **)&env);
+
+  while (is_cell(vars)) {
+    env = extend(env, car(vars), car(vals));
+    vars = cdr(vars);
+    vals = cdr(vals);
+  }
+
+  unpin_variable((void **)&env);
+
+  return env;
 }
 
-Object *progn(Object *forms, Object *env) {
-  printf("progn\n");
-  //print_env(env);
+/* Bind each of VARS to the matching one of the ARGC values at ARGV. */
+Object *bind_args(Object *env, Object *vars, int argc, Object **argv) {
+  pin_variable((void **)&env);
 
-  if (forms == s_nil)
-    return s_nil;
+  for (int i = 0; is_cell(vars); vars = cdr(vars), i++)
+    env = extend(env, car(vars), i < argc ? argv[i] : s_nil);
 
-  for (;;) {
-    if (cdr(forms) == s_nil)
-    {
-      //printf("Eval 1 in progn: ");
-      print(car(forms));
-      printf("\n");
-      Object *temp = eval(car(forms), env);
-      //printf("\n------------------> End of progn:\n");
-      //print_env(env);
-      return temp;
+  unpin_variable((void **)&env);
+
+  return env;
+}
+
+void push_value(Object *obj) {
+  if (interp->value_sp == VALUE_STACK_SIZE)
+    error("Value stack overflow");
+
+  interp->value_stack[interp->value_sp++] = obj;
+}
+
+/* Call primitive PROC with the ARGC args at ARGV, which the caller
+ * keeps on the value stack.  Arity is checked here, once, rather
+ * than by each primitive. */
+Object *call_primitive(Object *proc, int argc, Object **argv) {
+  struct Primitive *prim = &proc->primitive;
+
+  if (argc < prim->min_args ||
+      (prim->max_args >= 0 && argc > prim->max_args)) {
+    char *buff = NULL;
+    asprintf(&buff, "Wrong number of arguments to '%s': %d",
+             prim->name ? prim->name : "primitive", argc);
+    error(buff);
+  }
+
+  if (prim->argv_fn != NULL)
+    return (*prim->argv_fn)(argc, argv);
+
+  if (prim->foreign > 0)
+    return call_foreign(proc, argc, argv);
+
+  // Older primitives take a list.
+  Object *args = s_nil;
+  pin_variable((void **)&args);
+  for (int i = argc - 1; i >= 0; i--)
+    args = cons(argv[i], args);
+  unpin_variable((void **)&args);
+
+  return (*prim->fn)(args);
+}
+
+void bad_apply(Object *obj) {
+  // If this is neither a primitive function nor a proc,
+  // we are in a bad state.
+  if (tracing(TRACE_EVAL, TRACE_INFO)) {
+    trace_printf("bad apply of %s: ", get_type(obj));
+    trace_object(obj);
+    trace_printf("\n");
+  }
+
+  error("Bad apply");
+}
+
+/* Return the (symbol . value) pair INDEX entries into ENV. */
+Object *local_pair(Object *env, int index) {
+  while (index-- > 0)
+    env = cdr(env);
+
+  return car(env);
+}
+
+Object *global_pair(Node *node) {
+  if (node->pair == NULL)
+    node->pair = assoc(node->value, interp->top_env);
 
-      //return eval(car(forms), env);
+  return node->pair;
+}
+
+/* Run all but the last form of a procedure body, and hand the
+ * last one back to execute() to run in tail position.  A body run
+ * often enough is compiled to native code, which replaces this
+ * handler for every closure of the lambda. */
+Object *exec_body(Node *node, Frame *frame) {
+  if (node->count < JIT_THRESHOLD &&
+      __atomic_add_fetch(&node->count, 1, __ATOMIC_RELAXED) == JIT_THRESHOLD &&
+      jit_compile(node))
+    return node->fn(node, frame);
+
+  Object *forms = node->form;
+  int last = node->argc - 1;
+
+  for (int i = 0; i < last; i++) {
+    if (tracing(TRACE_EVAL, TRACE_DEBUG)) {
+      trace_printf("body: ");
+      trace_object(car(forms));
+      trace_printf("\n");
     }
 
-    //printf("Eval 2 in progn: ");
-    eval(car(forms), env);
-    print(car(forms));
-    printf("\nRecurse in progn: ");
-    print(cdr(forms));
-    printf("\n");
+    execute(node->args[i], frame->env);
     forms = cdr(forms);
   }
-  return s_nil;
-}
 
-/* Iterate vars and vals, adding each pair to this env. */
-Object *multiple_extend_env(Object *env, Object *vars, Object *vals) {
-  if (vars == s_nil)
-    return env;
-  else
-    return multiple_extend_env(extend(env, car(vars), car(vals)),
-                               cdr(vars), cdr(vals));
+  if (tracing(TRACE_EVAL, TRACE_DEBUG)) {
+    trace_printf("body, in tail position: ");
+    trace_object(car(forms));
+    trace_printf("\n");
+  }
+
+  frame->node = node->args[last];
+  return TAIL_CALL;
 }
 
 Object *apply(Object *obj, Object *args, Object *env) {
   //printf("Apply\n");
   //print_env(env);
 
+  interp->counters.calls++;
+
   if (is_primitive(obj)) {
-    return (*obj->primitive.fn)(args);
+    if (obj->primitive.fn != NULL)
+      return (*obj->primitive.fn)(args);
+
+    int base = interp->value_sp;
+    for (; is_cell(args); args = cdr(args))
+      push_value(car(args));
+
+    Object *result = call_primitive(obj, interp->value_sp - base, &interp->value_stack[base]);
+    interp->value_sp = base;
+    return result;
   }
 
   if (is_proc(obj)) {
-    return progn(obj->proc.body, multiple_extend_env(obj->proc.env, obj->proc.vars, args));
+    Object *result = NULL;
+    pin_variable((void **)&env);
+    env = multiple_extend_env(obj->proc.env, obj->proc.lambda->value, args);
+    result = execute_proc(obj, env);
+    unpin_variable((void **)&env);
+    return result;
   }
 
-  // If this is neither a primitive function nor a proc,
-  // we are in a bad state.
-  printf("Bad apply: Dumping %s:\n", get_type(obj));
-  print(obj);
-  printf("\n");
-
-  printf("Proc vars:\n");
-  printf("Proc vars pointer: %p\n", obj->proc.vars);
-  printf("Proc vars type: %d\n", obj->proc.vars->type);
-  print(obj->proc.vars);
-  printf("Proc body:\n");
-  print(obj->proc.body);
-  printf("Proc env:\n");
-  print(obj->proc.env);
+  bad_apply(obj);
 
-  error("Bad apply");
+  return s_nil;
+}
+
+/* Call FN on the ARGC args at ARGV, which the caller keeps on the
+ * value stack.  This is how C code outside the evaluator calls Lisp. */
+Object *call_value(Object *fn, int argc, Object **argv) {
+  interp->counters.calls++;
+
+  if (is_primitive(fn))
+    return call_primitive(fn, argc, argv);
+
+  if (is_proc(fn)) {
+    Object *env = bind_args(fn->proc.env, fn->proc.lambda->value, argc, argv);
+    return execute_proc(fn, env);
+  }
+
+  bad_apply(fn);
 
   return s_nil;
 }
 
-Object *eval_symbol(Object *symbol, Object *env) {
-  Object *pair = assoc(symbol, env);
+Object *exec_constant(Node *node, Frame *frame) {
+  return node->value;
+}
+
+Object *exec_local(Node *node, Frame *frame) {
+  return cdr(local_pair(frame->env, node->index));
+}
+
+Object *exec_global(Node *node, Frame *frame) {
+  Object *pair = global_pair(node);
 
   if (pair == NULL) {
     char *buff = NULL;
-    asprintf(&buff, "Undefined symbol '%s'", symbol->symbol.name);
+    asprintf(&buff, "Undefined symbol '%s'", node->value->symbol.name);
     error(buff);
   }
 
   return cdr(pair);
 }
 
-Object *subr_define(Object *obj, Object *env) {
-  Object *cell = obj; // car(cell) should be symbol named 'define'
+Object *exec_set_local(Node *node, Frame *frame) {
+  Object *pair = local_pair(frame->env, node->index);
+  Object *newval = execute(node->op, frame->env);
 
-  cell = cdr(cell);
-  Object *cell_symbol = car(cell);
+  setcdr(pair, newval);
 
-  cell = cdr(cell);
-  Object *cell_value = car(cell);
+  return newval;
+}
+
+Object *exec_set_global(Node *node, Frame *frame) {
+  Object *pair = global_pair(node);
+
+  if (pair == NULL)
+    error("SETQ failed to find symbol in env.");
+
+  Object *newval = execute(node->op, frame->env);
+
+  setcdr(pair, newval);
 
-  Object *val = eval(cell_value, env);
+  return newval;
+}
 
+/* Bind the symbol of NODE at toplevel to VAL, which the caller keeps. */
+void bind_global(Node *node, Object *val) {
   // Check for existing binding?
-  Object *pair = assoc(cell_symbol, env);
+  Object *pair = global_pair(node);
 
   if (pair == NULL) {
-    printf("Creating new binding: ");
-    print(cell_symbol);
-    printf("\n");
-    Object *var = cell_symbol;
+    TRACE(TRACE_EVAL, TRACE_INFO, "new global %s\n", node->value->symbol.name);
 
-    return extend_top(var, val);
+    extend_top(node->value, val);
   } else {
     setcdr(pair, val);
-
-    return val;
   }
 }
 
-Object *subr_setq(Object *obj, Object *env) {
-  //printf("SETQ\n");
-  Object *cell = obj; // car(cell) should be symbol named 'setq'
-  //print(cell);
+Object *exec_define(Node *node, Frame *frame) {
+  Object *val = NULL;
+  pin_variable((void **)&val);
+  val = execute(node->op, frame->env);
 
-  cell = cdr(cell);
-  Object *cell_symbol = car(cell);
-  //print(cell_symbol);
+  bind_global(node, val);
 
-  cell = cdr(cell);
-  Object *cell_value = car(cell);
-  //print(cell_value);
+  unpin_variable((void **)&val);
 
-  Object *pair = assoc(cell_symbol, env);
+  return val;
+}
 
-  if (pair == NULL)
-    error("SETQ failed to find symbol in env.");
+Object *exec_defmacro(Node *node, Frame *frame) {
+  Object *val = NULL;
+  pin_variable((void **)&val);
+  val = execute(node->op, frame->env);
+  val = make_macro(val);
 
-  Object *newval = eval(cell_value, env);
+  bind_global(node, val);
 
-  setcdr(pair, newval);
+  unpin_variable((void **)&val);
 
-  return newval;
+  return val;
 }
 
-Object *subr_if(Object *obj, Object *env) {
-  Object *cell = obj;
+/* The macro SYMBOL is bound to at toplevel, if it is. */
+Object *global_macro(Object *symbol) {
+  Object *pair = assoc(symbol, interp->top_env);
 
-  cell = cdr(cell);
-  Object *cell_condition = car(cell);
+  if (pair != NULL && is_macro(cdr(pair)))
+    return cdr(pair);
 
-  cell = cdr(cell);
-  Object *cell_true_branch = car(cell);
+  return NULL;
+}
 
-  cell = cdr(cell);
-  Object *cell_false_branch = car(cell);
+/* Run MACRO on the unevaluated args of FORM. */
+Object *macroexpand(Object *macro, Object *form) {
+  int base = interp->value_sp;
+  Object *result = NULL;
 
-  if (eval(cell_condition, env) != s_nil)
-    return eval(cell_true_branch, env);
-  else
-    return eval(cell_false_branch, env);
-}
+  push_value(macro);
+  for (Object *args = cdr(form); is_cell(args); args = cdr(args))
+    push_value(car(args));
 
-Object *subr_lambda(Object *obj, Object *env) {
-  Object *vars = cadr(obj);
-  Object *body = cddr(obj);
+  result = call_value(macro->macro.proc, interp->value_sp - base - 1,
+                      &interp->value_stack[base + 1]);
+  interp->value_sp = base;
 
-  //printf("Create lambda with env:\n");
-  //print_env(env);
-  //printf("\n");
-  return make_proc(vars, body, env);
+  return result;
 }
 
-Object *eval_list(Object *obj, Object *env) {
-  if (obj == s_nil)
-    return obj;
+Object *exec_if(Node *node, Frame *frame) {
+  if (execute(node->op, frame->env) != s_nil)
+    frame->node = node->then;
+  else
+    frame->node = node->other;
 
-  /* builtins */
-  if (car(obj) == s_define) {
-    return subr_define(obj, env);
-  } else if (car(obj) == s_setq) {
-    return subr_setq(obj, env);
-  } else if (car(obj) == s_if) {
-    return subr_if(obj, env);
-  } else if (car(obj) == s_quote) {
-    return cadr(obj);
-  } else if (car(obj) == s_lambda) {
-    return subr_lambda(obj, env);
+  return TAIL_CALL;
+}
+
+/* Do the bindings in GUARDS, ((symbol . value) . expected) entries,
+ * still hold what the optimizer saw? */
+int guard_holds(Object *guards) {
+  for (; guards != s_nil; guards = cdr(guards)) {
+    if (cdr(car(car(guards))) != cdr(car(guards)))
+      return 0;
   }
 
-  /* This list is not a builtin, so treat it as a function call. */
-  Object *proc = eval(car(obj), env);
-  Object *args = eval_args(cdr(obj), env);
+  return 1;
+}
 
-  //printf("Fall-through assuming proc (apply).\n");
-  //printf("Fall-through assuming proc with env %p:\n", env);
-  //print_env(env);
-  //printf("\n");
-  return apply(proc, args, env);
+Object *exec_guard(Node *node, Frame *frame) {
+  if (guard_holds(node->value))
+    frame->node = node->then;
+  else
+    frame->node = node->other;
+
+  return TAIL_CALL;
 }
 
-Object *eval(Object *obj, Object *env) {
-  if (obj == NULL)
-    return obj;
+/* A closure keeps only the bindings it captures, NODE->args, in a list
+ * of its own.  The (symbol . value) pairs are shared with the frame,
+ * so a setq through either is seen by both. */
+Object *exec_lambda(Node *node, Frame *frame) {
+  Object *env = s_nil;
+  Object *proc = NULL;
+  pin_variable((void **)&env);
 
-  // printf("Eval:\n");
-  // print(obj);
-  // printf(" with env %p:\n", env);
-  // print_env(env);
-  // printf("env done.\n");
+  for (int i = node->argc - 1; i >= 0; i--)
+    env = cons(local_pair(frame->env, node->args[i]->index), env);
 
-  Object *result = s_nil;
+  proc = make_proc(node, node->owner, env);
 
-  switch (obj->type) {
-    case STRING:
-    case FIXNUM:
-    case PRIMITIVE:
-    case PROC:
-      result = obj;
-      break;
-    case SYMBOL:
-      result = eval_symbol(obj, env);
-      break;
-    case CELL:
-      result = eval_list(obj, env);
-      break;
-    default:
-      printf("\nEval Unknown Object: %d\n", obj->type);
-      break;
-  }
+  unpin_variable((void **)&env);
 
-  return result;
+  return proc;
 }
 
-void print_string(Object *obj) {
-  /* char *str = obj->str.text; */
-  /* int len = strlen(str); */
-  /* int i = 0; */
-
-  putchar('"');
-  /* while (i < len) { */
-  /*   putc(*str++, stdout); */
-  /*   i++; */
-  /* } */
-  printf("%s", obj->str.text);
+/* Constants and variables never make a tail call, so
+ * run them without the bookkeeping of execute(). */
+Object *operand(Node *node, Frame *frame) {
+  if (node->fn == exec_constant ||
+      node->fn == exec_local ||
+      node->fn == exec_global)
+    return node->fn(node, frame);
 
-  putchar('"');
+  return execute(node, frame->env);
 }
 
-void print_fixnum(Object *obj) {
-  printf("%d", obj->num.value);
-}
+/* Finish a call whose operator and args are on the value stack from BASE. */
+Object *dispatch_call(Node *node, Frame *frame, int base) {
+  Object *proc = interp->value_stack[base];
+  Object **argv = &interp->value_stack[base + 1];
+  int argc = interp->value_sp - base - 1;
+  Object *result = NULL;
 
-void print_cell(Object *car) {
-  Object *obj = car;
+  interp->counters.calls++;
+
+  if (is_proc(proc)) {
+    /* Tail call: continue with the body in the new env. */
+    frame->env = bind_args(proc->proc.env, proc->proc.lambda->value,
+                           argc, argv);
+    frame->code = proc->proc.code;
+    frame->node = proc->proc.lambda->then;
+    interp->procs[interp->eval_depth - 1] = proc->proc.lambda->name;
+    interp->value_sp = base;
+    return TAIL_CALL;
+  }
 
-  printf("(");
+  // Its call sites were analyzed as calls, not expanded.
+  if (is_macro(proc))
+    error("Macro called before it was defined");
 
-  while (obj != s_nil && obj != NULL) {
-    if (obj->type == CELL) {
-      print(obj->cell.car);
-    } else {
-      printf(". ");
-      print(obj);
-      break;
-    }
+  if (!is_primitive(proc))
+    bad_apply(proc);
+
+  //printf("Fall-through assuming proc (apply).\n");
+  result = call_primitive(proc, argc, argv);
+  interp->value_sp = base;
+
+  return result;
+}
+
+Object *primitive_eq(int argc, Object **argv);
 
-    obj = obj->cell.cdr;
+/* A call site that has seen the same builtin applied to two fixnums
+ * is rewritten to a handler that does the arithmetic inline.  The
+ * operator and args are on the value stack from BASE. */
+void quicken(Node *node, int base) {
+  Object *proc = interp->value_stack[base];
+  node_fn *fn = NULL;
 
-    if (obj != s_nil && obj != NULL)
-      printf(" ");
+  if (node->op->fn != exec_global ||
+      node->argc != 2 ||
+      !is_primitive(proc) ||
+      !is_fixnum(interp->value_stack[base + 1]) ||
+      !is_fixnum(interp->value_stack[base + 2]))
+    return;
+
+  if (proc->primitive.argv_fn == primitive_add)
+    fn = exec_fixnum_add;
+  else if (proc->primitive.argv_fn == primitive_sub)
+    fn = exec_fixnum_sub;
+  else if (proc->primitive.argv_fn == primitive_mul)
+    fn = exec_fixnum_mul;
+  else if (proc->primitive.argv_fn == primitive_eq)
+    fn = exec_fixnum_eq;
+
+  // pmap's threads may run the node meanwhile.  The handler checks
+  // the operator it is given, so seeing one without the other only
+  // costs a deoptimization.
+  if (fn != NULL) {
+    node->value = proc;
+    __atomic_store_n(&node->fn, fn, __ATOMIC_RELEASE);
   }
+}
 
-  printf(")");
+/* A guard failed: go back to the generic handler and, unless this
+ * site keeps failing, start observing it again. */
+void deoptimize(Node *node) {
+  node->fn = exec_call;
+  node->value = NULL;
+  node->deopts++;
+  node->count = node->deopts < MAX_DEOPTS ? 0 : QUICKEN_THRESHOLD;
 }
 
-void print(Object *obj) {
-  if (obj == NULL) {
-    printf("NULL OBJECT\n");
-    return;
+/* Operator and args are evaluated onto the value stack, so
+ * calling a primitive conses nothing but its result. */
+Object *exec_call(Node *node, Frame *frame) {
+  int base = interp->value_sp;
+
+  push_value(operand(node->op, frame));
+  for (int i = 0; i < node->argc; i++)
+    push_value(operand(node->args[i], frame));
+
+  if (node->count < QUICKEN_THRESHOLD &&
+      __atomic_add_fetch(&node->count, 1, __ATOMIC_RELAXED) == QUICKEN_THRESHOLD)
+    quicken(node, base);
+
+  return dispatch_call(node, frame, base);
+}
+
+/* Quickened (op a b) for a builtin OP on fixnums.  The operator is
+ * still pushed so a failed guard can finish the call generically
+ * without evaluating the args twice. */
+Object *exec_fixnum_op(Node *node, Frame *frame, char op) {
+  if (cdr(node->op->pair) != node->value) {
+    // The operator has been rebound.
+    deoptimize(node);
+    return exec_call(node, frame);
   }
 
-  switch (obj->type) {
-    case FIXNUM:
-      print_fixnum(obj);
-      break;
-    case STRING:
-      print_string(obj);
-      break;
-    case SYMBOL:
-      printf("%s", obj->symbol.name);
-      break;
-    case CELL:
-      print_cell(obj);
+  int base = interp->value_sp;
+  push_value(node->value);
+  push_value(operand(node->args[0], frame));
+  push_value(operand(node->args[1], frame));
+
+  Object *a = interp->value_stack[base + 1];
+  Object *b = interp->value_stack[base + 2];
+  Object *result = NULL;
+
+  if (a->type != FIXNUM || b->type != FIXNUM) {
+    deoptimize(node);
+    return dispatch_call(node, frame, base);
+  }
+
+  switch (op) {
+    case '+':
+      result = make_fixnum(a->num.value + b->num.value);
       break;
-    case PRIMITIVE:
-      printf("<PRIM>");
+    case '-':
+      result = make_fixnum(a->num.value - b->num.value);
       break;
-    case PROC:
-      printf("<PROC>");
+    case '*':
+      result = make_fixnum(a->num.value * b->num.value);
       break;
-    default:
-      printf("\nPrint Unknown Object - type? %d\n", obj->type);
-      //sleep(1);
+    case '=':
+      result = a->num.value == b->num.value ? s_t : s_nil;
       break;
   }
+
+  interp->value_sp = base;
+
+  return result;
+}
+
+/* Compiled code found a quickened call's operands weren't both
+ * fixnums.  Its operator and args are on top of the value stack. */
+Object *exec_fixnum_fallback(Node *node, Frame *frame) {
+  if (node->fn != exec_call)
+    deoptimize(node);
+
+  return dispatch_call(node, frame, interp->value_sp - 3);
+}
+
+Object *exec_fixnum_add(Node *node, Frame *frame) {
+  return exec_fixnum_op(node, frame, '+');
+}
+
+Object *exec_fixnum_sub(Node *node, Frame *frame) {
+  return exec_fixnum_op(node, frame, '-');
+}
+
+Object *exec_fixnum_mul(Node *node, Frame *frame) {
+  return exec_fixnum_op(node, frame, '*');
+}
+
+Object *exec_fixnum_eq(Node *node, Frame *frame) {
+  return exec_fixnum_op(node, frame, '=');
+}
+
+/* Lexical scope seen by the analyzer: the params of each enclosing
+ * lambda, and the node of the lambda, which collects its captures. */
+struct Scope {
+  Object *vars;
+  int size;
+  Node *lambda;
+  struct Scope *next;
+};
+
+Node *new_node(node_fn *fn, Object *form) {
+  Node *node = calloc(1, sizeof(Node));
+  assert(node != NULL);
+
+  node->fn = fn;
+  node->form = form;
+  return node;
+}
+
+void free_node(Node *node) {
+  if (node == NULL)
+    return;
+
+  jit_release(node);
+
+  free_node(node->op);
+  free_node(node->then);
+  free_node(node->other);
+  for (int i = 0; i < node->argc; i++)
+    free_node(node->args[i]);
+  free(node->args);
+  free(node);
+}
+
+int list_length(Object *list) {
+  int n = 0;
+
+  for (; is_cell(list); list = cdr(list))
+    n++;
+
+  return n;
+}
+
+/* Is PARAMS a proper list of variables, no rest args? */
+int proper_params(Object *params) {
+  for (; is_cell(params); params = cdr(params)) {
+    if (!is_symbol(car(params)) || car(params) == s_nil)
+      return 0;
+  }
+
+  return params == s_nil;
+}
+
+int is_lexical(Object *symbol, struct Scope *scope) {
+  for (; scope != NULL; scope = scope->next) {
+    for (Object *vars = scope->vars; is_cell(vars); vars = cdr(vars)) {
+      if (car(vars) == symbol)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Position of SYMBOL's binding in the env a lambda body runs in, or -1
+ * if it is not lexically bound.  bind_args pushes params in order onto
+ * the closure's captures, so the last param is at the head and the
+ * captures follow.  A variable of an enclosing lambda is captured by
+ * every lambda in between. */
+int lexical_index(Object *symbol, struct Scope *scope) {
+  if (scope == NULL)
+    return -1;
+
+  int found = -1;
+  int i = 0;
+
+  for (Object *vars = scope->vars; is_cell(vars); vars = cdr(vars), i++) {
+    if (car(vars) == symbol)
+      found = i;
+  }
+
+  if (found >= 0)
+    return scope->size - 1 - found;
+
+  Node *lambda = scope->lambda;
+
+  for (i = 0; i < lambda->argc; i++) {
+    if (lambda->args[i]->value == symbol)
+      return scope->size + i;
+  }
+
+  int outer = lexical_index(symbol, scope->next);
+
+  if (outer < 0)
+    return -1;
+
+  // Where the closure finds the binding when it is made.
+  Node *capture = new_node(exec_local, symbol);
+  capture->value = symbol;
+  capture->index = outer;
+
+  lambda->args = realloc(lambda->args, (lambda->argc + 1) * sizeof(Node *));
+  assert(lambda->args != NULL);
+  lambda->args[lambda->argc++] = capture;
+
+  return scope->size + i;
+}
+
+Node *analyze(Object *obj, struct Scope *scope, Object *owner);
+
+Node *analyze_variable(Object *symbol, struct Scope *scope) {
+  if (symbol == s_nil) {
+    Node *node = new_node(exec_constant, symbol);
+    node->value = s_nil;
+    return node;
+  }
+
+  int index = lexical_index(symbol, scope);
+  Node *node = new_node(index < 0 ? exec_global : exec_local, symbol);
+  node->value = symbol;
+  node->index = index;
+  return node;
+}
+
+/* Profiles call a lambda what it is bound to.  Uninterned symbols
+ * can be collected, so lambdas bound to them stay anonymous. */
+void name_lambda(Node *node, Object *symbol) {
+  if (node->fn == exec_lambda &&
+      lookup_symbol(symbol->symbol.name, strlen(symbol->symbol.name)) == symbol)
+    node->name = symbol;
+}
+
+Node *analyze_assignment(Object *obj, struct Scope *scope, Object *owner,
+                         node_fn *global_fn) {
+  Object *symbol = cadr(obj);
+  int index = lexical_index(symbol, scope);
+  Node *node = new_node(index < 0 ? global_fn : exec_set_local, obj);
+
+  node->value = symbol;
+  node->index = index;
+  node->op = analyze(car(cddr(obj)), scope, owner);
+  name_lambda(node->op, symbol);
+  return node;
+}
+
+Node *analyze_if(Object *obj, struct Scope *scope, Object *owner) {
+  Node *node = new_node(exec_if, obj);
+  Object *cell = cdr(obj);
+
+  node->op = analyze(car(cell), scope, owner);
+  cell = cdr(cell);
+  node->then = analyze(car(cell), scope, owner);
+  cell = cdr(cell);
+  node->other = analyze(car(cell), scope, owner);
+  return node;
+}
+
+Node *analyze_body(Object *body, struct Scope *scope, Object *owner) {
+  Node *node = new_node(exec_body, body);
+
+  // An empty body still needs a form to return.
+  if (body == s_nil) {
+    node->argc = 1;
+    node->args = calloc(1, sizeof(Node *));
+    node->args[0] = analyze(s_nil, scope, owner);
+    return node;
+  }
+
+  node->argc = list_length(body);
+  node->args = calloc(node->argc, sizeof(Node *));
+  for (int i = 0; i < node->argc; i++, body = cdr(body))
+    node->args[i] = analyze(car(body), scope, owner);
+
+  return node;
+}
+
+Node *analyze_lambda(Object *obj, struct Scope *scope, Object *owner) {
+  Node *node = new_node(exec_lambda, obj);
+  struct Scope inner;
+
+  inner.vars = cadr(obj);
+  inner.size = list_length(inner.vars);
+  inner.lambda = node;
+  inner.next = scope;
+
+  node->value = inner.vars;
+  node->owner = owner;
+  node->name = s_lambda;
+  node->then = analyze_body(cddr(obj), &inner, owner);
+
+  return node;
+}
+
+Node *analyze_call(Object *obj, struct Scope *scope, Object *owner) {
+  Node *node = new_node(exec_call, obj);
+  Object *args = cdr(obj);
+
+  node->op = analyze(car(obj), scope, owner);
+  node->argc = list_length(args);
+  node->args = calloc(node->argc, sizeof(Node *));
+  for (int i = 0; i < node->argc; i++, args = cdr(args))
+    node->args[i] = analyze(car(args), scope, owner);
+
+  return node;
+}
+
+/* A copy of OBJ with cells of its own. */
+Object *copy_tree(Object *obj) {
+  Object *copy = NULL;
+  Object *rest = NULL;
+
+  if (!is_cell(obj))
+    return obj;
+
+  pin_variable((void **)&obj);
+  pin_variable((void **)&rest);
+  pin_variable((void **)&copy);
+
+  rest = copy_tree(cdr(obj));
+  copy = copy_tree(car(obj));
+  copy = cons(copy, rest);
+
+  unpin_variable((void **)&copy);
+  unpin_variable((void **)&rest);
+  unpin_variable((void **)&obj);
+
+  return copy;
+}
+
+/* Expand the call OBJ of MACRO, replacing the call with the expansion
+ * so it is only expanded once, however often the code runs.  An atom
+ * can't replace it in place, so the caller has to keep that.  Code is
+ * rewritten in place as it is analyzed and optimized, so the expansion
+ * is copied in case the macro returned a list it keeps. */
+Object *expand_call(Object *obj, Object *macro) {
+  Object *expansion = copy_tree(macroexpand(macro, obj));
+
+  if (!is_cell(expansion))
+    return expansion;
+
+  setcar(obj, car(expansion));
+  setcdr(obj, cdr(expansion));
+  return obj;
+}
+
+Node *analyze_macro_call(Object *obj, Object *macro, struct Scope *scope,
+                         Object *owner) {
+  Object *expansion = NULL;
+  pin_variable((void **)&expansion);
+
+  expansion = expand_call(obj, macro);
+
+  if (expansion != obj)
+    owner->code.expansions = cons(expansion, owner->code.expansions);
+
+  unpin_variable((void **)&expansion);
+
+  return analyze(expansion, scope, owner);
+}
+
+/* Turn OBJ into a node tree.  OWNER is the CODE object the
+ * tree will belong to, which closures keep alive. */
+Node *analyze(Object *obj, struct Scope *scope, Object *owner) {
+  if (obj->type == SYMBOL)
+    return analyze_variable(obj, scope);
+
+  if (obj->type != CELL) {
+    if (obj->type != STRING &&
+        obj->type != FIXNUM &&
+        obj->type != PRIMITIVE &&
+        obj->type != PROC)
+      TRACE(TRACE_EVAL, TRACE_INFO, "analyze: unknown object type %d\n", obj->type);
+
+    Node *node = new_node(exec_constant, obj);
+    node->value = obj;
+    return node;
+  }
+
+  /* builtins */
+  Object *head = car(obj);
+
+  if (head == s_define) {
+    return analyze_assignment(obj, scope, owner, exec_define);
+  } else if (head == s_setq) {
+    return analyze_assignment(obj, scope, owner, exec_set_global);
+  } else if (head == s_if) {
+    return analyze_if(obj, scope, owner);
+  } else if (head == s_quote) {
+    Node *node = new_node(exec_constant, obj);
+    node->value = cadr(obj);
+    return node;
+  } else if (head == s_lambda) {
+    return analyze_lambda(obj, scope, owner);
+  } else if (head == s_guard) {
+    // (%guard guards fast slow), from the optimizer
+    Node *node = new_node(exec_guard, obj);
+    node->value = cadr(obj);
+    node->then = analyze(car(cddr(obj)), scope, owner);
+    node->other = analyze(cadr(cddr(obj)), scope, owner);
+    return node;
+  } else if (head == s_time) {
+    // (time body...)
+    Node *node = new_node(exec_time, obj);
+    node->then = analyze_body(cdr(obj), scope, owner);
+    return node;
+  } else if (head == s_defmacro) {
+    // (defmacro name params body...) binds name to (lambda params body...)
+    Node *node = new_node(exec_defmacro, obj);
+    node->value = cadr(obj);
+    node->op = analyze_lambda(cdr(obj), scope, owner);
+    name_lambda(node->op, node->value);
+    return node;
+  }
+
+  if (is_symbol(head) && !is_lexical(head, scope)) {
+    Object *macro = global_macro(head);
+
+    if (macro != NULL)
+      return analyze_macro_call(obj, macro, scope, owner);
+  }
+
+  /* This list is not a builtin, so treat it as a function call. */
+  return analyze_call(obj, scope, owner);
+}
+
+/*
+ * Run NODE in ENV.  Handlers for forms in tail position hand back
+ * the next node instead of recursing, so tail calls run in constant
+ * C stack space.
+ */
+static inline __attribute__((always_inline))
+Object *run(Node *node, Object *env, Object *name) {
+  if (interp->eval_depth >= MAX_EVAL_DEPTH)
+    error("Maximum recursion depth exceeded");
+  interp->procs[interp->eval_depth] = name;
+  // The profiler's signal handler reads the slot once it's counted.
+  __atomic_signal_fence(__ATOMIC_RELEASE);
+  interp->eval_depth++;
+  interp->counters.steps++;
+
+  Frame frame;
+  Object *result;
+
+  frame.node = node;
+  frame.env = env;
+  frame.code = NULL;
+  pin_variable((void **)&frame.env);
+  pin_variable((void **)&frame.code);
+
+  do {
+    result = frame.node->fn(frame.node, &frame);
+  } while (result == TAIL_CALL);
+
+  unpin_variable((void **)&frame.code);
+  unpin_variable((void **)&frame.env);
+
+  interp->eval_depth--;
+
+  return result;
+}
+
+Object *execute(Node *node, Object *env) {
+  return run(node, env, NULL);
+}
+
+/* Run the body of PROC, which ENV binds the args of. */
+Object *execute_proc(Object *proc, Object *env) {
+  return run(proc->proc.lambda->then, env, proc->proc.lambda->name);
+}
+
+/* Analyze a toplevel form once, then run it in ENV. */
+Object *eval(Object *obj, Object *env) {
+  if (obj == NULL)
+    return obj;
+
+  Object *code = NULL;
+  Object *result = NULL;
+  pin_variable((void **)&obj);
+  pin_variable((void **)&code);
+
+  // The table is its owner's alone.
+  if (hashcons_enabled && interp->owner == interp)
+    obj = share_literals(obj);
+
+  if (optimize_enabled) {
+    obj = optimize(obj);
+
+    if (optimize_dump) {
+      printf("Optimized: ");
+      print(obj);
+      printf("\n");
+    }
+  }
+
+  code = make_code(NULL);
+  code->code.node = analyze(obj, NULL, code);
+  result = execute(code->code.node, env);
+
+  unpin_variable((void **)&code);
+  unpin_variable((void **)&obj);
+
+  return result;
 }
 
-Object *prim_cons(Object *args) {
-  return cons(car(args), cadr(args));
+void print(Object *obj) {
+  Object *pair = assoc(s_print_circle, interp->top_env);
+
+  write_object(interp->out, obj, pair != NULL && cdr(pair) != s_nil);
+  port_flush(interp->out);
 }
 
-Object *prim_car(Object *args) {
-  return caar(args);
+Object *prim_cons(int argc, Object **argv) {
+  return cons(argv[0], argv[1]);
 }
 
-Object *prim_cdr(Object *args) {
-  return cdar(args);
+Object *prim_car(int argc, Object **argv) {
+  return car(argv[0]);
+}
+
+Object *prim_cdr(int argc, Object **argv) {
+  return cdr(argv[0]);
+}
+
+Object *prim_list(int argc, Object **argv) {
+  Object *list = s_nil;
+  pin_variable((void **)&list);
+
+  for (int i = argc - 1; i >= 0; i--)
+    list = cons(argv[i], list);
+
+  unpin_variable((void **)&list);
+  return list;
+}
+
+Object *prim_equal(int argc, Object **argv) {
+  return equal(argv[0], argv[1]) ? s_t : s_nil;
+}
+
+/* A fresh symbol for macros to bind.  It isn't interned,
+ * so it can't be the same as any symbol that is read. */
+Object *prim_gensym(int argc, Object **argv) {
+  char name[MAX_BUFFER_SIZE];
+
+  snprintf(name, sizeof(name), "G%d", __atomic_add_fetch(&interp->owner->gensym_count, 1, __ATOMIC_RELAXED));
+  return make_symbol(name);
+}
+
+Object *prim_open_input_file(int argc, Object **argv) {
+  Reader *reader;
+
+  if (!is_string(argv[0]))
+    error("open-input-file needs a file name");
+
+  reader = open_reader(argv[0]->str.text);
+  if (reader == NULL)
+    error("Cannot open file");
+
+  return make_port(reader);
+}
+
+Reader *port_reader(Object *port) {
+  if (!is_port(port))
+    error("Not a port");
+
+  if (port->port.reader == NULL)
+    error(port->port.out >= 0 ? "Port is not for reading" : "Port is closed");
+
+  return port->port.reader;
+}
+
+int port_out(Object *port) {
+  if (!is_port(port))
+    error("Not a port");
+
+  if (port->port.out < 0)
+    error(port->port.reader != NULL ? "Port is not for writing" : "Port is closed");
+
+  return port->port.out;
+}
+
+Object *prim_read(int argc, Object **argv) {
+  Object *obj = read_form(port_reader(argv[0]));
+
+  return obj != NULL ? obj : s_eof;
+}
+
+Object *prim_read_line(int argc, Object **argv) {
+  Object *line = read_line(port_reader(argv[0]));
+
+  return line != NULL ? line : s_eof;
+}
+
+Object *prim_read_char(int argc, Object **argv) {
+  char c;
+  int next = read_char(port_reader(argv[0]));
+
+  if (next == EOF)
+    return s_eof;
+
+  c = next;
+  return make_string_n(&c, 1);
+}
+
+Object *prim_close_port(int argc, Object **argv) {
+  if (!is_port(argv[0]))
+    error("Not a port");
+
+  if (argv[0]->port.reader != NULL)
+    close_reader(argv[0]->port.reader);
+  argv[0]->port.reader = NULL;
+
+  if (argv[0]->port.out >= 0)
+    close(argv[0]->port.out);
+  argv[0]->port.out = -1;
+
+  return s_nil;
+}
+
+/* (make-pipe): a pair of ports, the car reading what is written to
+ * the cdr.  Neither blocks the thread: a task waits for the other
+ * end while the rest run. */
+Object *prim_make_pipe(int argc, Object **argv) {
+  Object *in = NULL;
+  Object *out = NULL;
+  Object *pair;
+  int fds[2];
+
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    error("Cannot make a pipe");
+
+  // Writing after the reader has gone is an error, not the end.
+  signal(SIGPIPE, SIG_IGN);
+
+  pin_variable((void **)&in);
+  pin_variable((void **)&out);
+
+  in = make_port(fd_reader(fds[0]));
+  in->port.reader->owns_fd = 1;
+  out = make_port(NULL);
+  out->port.out = fds[1];
+  pair = cons(in, out);
+
+  unpin_variable((void **)&out);
+  unpin_variable((void **)&in);
+  return pair;
+}
+
+static void write_fd(int fd, char *text, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, text, len);
+
+    if (n < 0 && errno == EAGAIN) {
+      task_wait_fd(fd, 1);
+      continue;
+    }
+
+    if (n < 0 && errno != EINTR)
+      error("Write failed");
+
+    if (n > 0) {
+      text += n;
+      len -= n;
+    }
+  }
+}
+
+/* (write-string port string) */
+Object *prim_write_string(int argc, Object **argv) {
+  if (!is_string(argv[1]))
+    error("write-string needs a string");
+
+  write_fd(port_out(argv[0]), argv[1]->str.text, strlen(argv[1]->str.text));
+  return argv[1];
+}
+
+/* (write-line port string): the string and a newline, which is what
+ * read-line reads back. */
+Object *prim_write_line(int argc, Object **argv) {
+  int fd = port_out(argv[0]);
+  size_t len;
+  char *line;
+
+  if (!is_string(argv[1]))
+    error("write-line needs a string");
+
+  // One write, so a line isn't split between tasks' writes.
+  len = strlen(argv[1]->str.text);
+  line = malloc(len + 1);
+  assert(line != NULL);
+  memcpy(line, argv[1]->str.text, len);
+  line[len] = '\n';
+
+  write_fd(fd, line, len + 1);
+  free(line);
+  return argv[1];
+}
+
+/* Evaluate each form in the file at PATH.  The forms come from its
+ * .fasl if that is up to date; otherwise they are read from PATH and
+ * saved to the .fasl for next time. */
+Object *prim_load(int argc, Object **argv) {
+  char *volatile source = NULL;
+  char *volatile fasl_file = NULL;
+  Fasl *volatile fasl = NULL;
+  Reader *volatile reader = NULL;
+  FaslWriter *volatile writer = NULL;
+  Object *form = NULL;
+  jmp_buf *outer = interp->error_handler;
+  jmp_buf handler;
+  int pins = save_pins();
+
+  if (!is_string(argv[0]))
+    error("load needs a file name");
+
+  if (interp->owner != interp)
+    error("load can't run inside pmap");
+
+  interp->error_handler = &handler;
+
+  if (setjmp(handler)) {
+    /* Tidy up, then pass the error on. */
+    restore_pins(pins);
+    if (fasl != NULL)
+      close_fasl(fasl);
+    if (reader != NULL)
+      close_reader(reader);
+    if (writer != NULL)
+      free_fasl_writer(writer);
+    free(fasl_file);
+    free(source);
+
+    interp->error_handler = outer;
+    if (outer != NULL)
+      longjmp(*outer, 1);
+    exit(0);
+  }
+
+  pin_variable((void **)&form);
+  source = strdup(argv[0]->str.text);
+  fasl_file = fasl_path(source);
+  fasl = open_fasl(fasl_file, source);
+
+  if (fasl != NULL) {
+    while ((form = fasl_read(fasl)) != NULL)
+      eval(form, interp->top_env);
+
+    close_fasl(fasl);
+  } else {
+    reader = open_reader(source);
+    if (reader == NULL)
+      error("Cannot open file");
+
+    // Saved before eval, which may rewrite it.
+    writer = fasl_writer();
+    while ((form = read_form(reader)) != NULL) {
+      fasl_write(writer, form);
+      eval(form, interp->top_env);
+    }
+
+    fasl_save(writer, fasl_file, source);
+    free_fasl_writer(writer);
+    close_reader(reader);
+  }
+
+  unpin_variable((void **)&form);
+  free(fasl_file);
+  free(source);
+  interp->error_handler = outer;
+  return s_t;
 }
 
 Object *primitive_eq_num(Object *a, Object *b) {
@@ -839,60 +1665,188 @@ Object *primitive_eq_num(Object *a, Object *b) {
   }
 }
 
-Object *primitive_eq(Object *args) {
-  if (is_fixnum(car(args)) &&
-      is_fixnum(cadr(args)))
-    return primitive_eq_num(car(args), cadr(args));
+Object *primitive_eq(int argc, Object **argv) {
+  if (is_fixnum(argv[0]) &&
+      is_fixnum(argv[1]))
+    return primitive_eq_num(argv[0], argv[1]);
   else
     return s_nil;
 }
 
 /* Set up object allocation space. */
 void init_mem() {
+  interp->pool = calloc(MAX_ALLOC_SIZE, sizeof(Object));
+  interp->free_list = calloc(MAX_ALLOC_SIZE, sizeof(void *));
+  interp->active_list = calloc(MAX_ALLOC_SIZE, sizeof(void *));
+  interp->hashcons = calloc(HASHCONS_SIZE, sizeof(Object *));
+  interp->hashcons_live = calloc(MAX_ALLOC_SIZE, sizeof(Object *));
+  interp->out = calloc(1, sizeof(OutPort));
+  assert(interp->pool != NULL && interp->free_list != NULL &&
+         interp->active_list != NULL && interp->hashcons != NULL &&
+         interp->hashcons_live != NULL && interp->out != NULL);
 
 #ifdef GC_ENABLED
-  current_mark = 1;
+  interp->current_mark = 1;
 #endif
 
-  free_list[0] = NULL;
-
-  for (int i = 1; i <= MAX_ALLOC_SIZE; i++) {
-    Object *obj = calloc(1, sizeof(struct Object));
-    obj->id = i;
+  for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
+    Object *obj = &interp->pool[i];
+    obj->id = i + 1;
     obj->type = UNKNOWN;
-    free_list[i] = obj;
+    interp->free_list[i] = obj;
   }
 
-#ifdef GC_PIN_DEBUG
-  printf("Done init.\n");
-#endif
+  TRACE(TRACE_GC, TRACE_DEBUG, "init: %d objects\n", MAX_ALLOC_SIZE);
 }
 
 void init_symbols() {
   s_nil = make_symbol("nil");
-  symbols = cons(s_nil, s_nil);
+  interp->symbols = cons(s_nil, s_nil);
 
   s_t = intern_symbol("t");
   s_lambda = intern_symbol("lambda");
+  s_defmacro = intern_symbol("defmacro");
+  s_guard = intern_symbol("%guard");
+  s_time = intern_symbol("time");
   s_define = intern_symbol("define");
   s_quote = intern_symbol("quote");
   s_setq = intern_symbol("setq");
   s_if = intern_symbol("if");
+  s_eof = intern_symbol("#<eof>");
+}
+
+/* Bind NAME at toplevel to a primitive taking its args on the value stack. */
+void define_primitive(char *name, primitive_argv_fn *fn, int min_args, int max_args) {
+  Object *symbol = intern_symbol(name);
+
+  extend_top(symbol, make_primitive_argv(symbol->symbol.name, fn, min_args, max_args));
 }
 
 void init_env() {
-  top_env = cons(s_nil, cons(s_nil, s_nil));
+  interp->top_env = cons(s_nil, cons(s_nil, s_nil));
+
+  define_primitive("cons", prim_cons, 2, 2);
+  define_primitive("car", prim_car, 1, 1);
+  define_primitive("cdr", prim_cdr, 1, 1);
+  define_primitive("list", prim_list, 0, -1);
+  define_primitive("gensym", prim_gensym, 0, 0);
+
+  define_primitive("eq", primitive_eq, 2, 2);
+  define_primitive("equal", prim_equal, 2, 2);
+
+  define_primitive("+", primitive_add, 0, -1);
+  define_primitive("-", primitive_sub, 1, -1);
+  define_primitive("*", primitive_mul, 0, -1);
+  define_primitive("/", primitive_div, 2, 2);
+
+  define_primitive("open-input-file", prim_open_input_file, 1, 1);
+  define_primitive("read", prim_read, 1, 1);
+  define_primitive("read-line", prim_read_line, 1, 1);
+  define_primitive("read-char", prim_read_char, 1, 1);
+  define_primitive("close-port", prim_close_port, 1, 1);
+  define_primitive("make-pipe", prim_make_pipe, 0, 0);
+  define_primitive("write-string", prim_write_string, 2, 2);
+  define_primitive("write-line", prim_write_line, 2, 2);
+  define_primitive("load", prim_load, 1, 1);
+
+  define_primitive("pmap", prim_pmap, 2, 2);
+  define_primitive("pfor-each", prim_pfor_each, 2, 2);
+
+  define_primitive("make-channel", prim_make_channel, 1, 3);
+  define_primitive("send", prim_send, 2, 2);
+  define_primitive("send-all", prim_send_all, 2, 2);
+  define_primitive("receive", prim_receive, 1, 1);
+  define_primitive("try-receive", prim_try_receive, 1, 1);
+  define_primitive("receive-all", prim_receive_all, 2, 2);
+
+  define_primitive("spawn", prim_spawn, 1, 1);
+  define_primitive("yield", prim_yield, 0, 0);
+  define_primitive("sleep", prim_sleep, 1, 1);
+  define_primitive("run-tasks", prim_run_tasks, 0, 0);
+
+  define_primitive("profile-start", prim_profile_start, 0, 1);
+  define_primitive("profile-stop", prim_profile_stop, 0, 1);
+  define_primitive("alloc-profile-start", prim_alloc_profile_start, 0, 1);
+  define_primitive("alloc-profile-stop", prim_alloc_profile_stop, 0, 0);
+
+  s_print_circle = intern_symbol("*print-circle*");
+  extend_top(s_print_circle, s_nil);
+  extend_top(intern_symbol("eof"), s_eof);
+}
+
+void **module_caches() {
+#ifdef AOT_MODULES
+  int count = 0;
+
+  while (preloaded_modules[count].name != NULL)
+    count++;
+
+  void **caches = calloc(count + 1, sizeof(void *));
+  assert(caches != NULL);
+
+  for (int i = 0; i < count; i++)
+    caches[i] = preloaded_modules[i].cache();
+
+  return caches;
+#else
+  return NULL;
+#endif
+}
+
+void adopt_modules(void **caches) {
+#ifdef AOT_MODULES
+  for (int i = 0; preloaded_modules[i].name != NULL; i++)
+    preloaded_modules[i].adopt(caches[i]);
+#endif
+}
+
+/* A new interpreter with the builtins and any compiled modules
+ * loaded, made the one this thread runs. */
+Interp *new_Interp() {
+  Interp *in = calloc(1, sizeof(Interp));
+  assert(in != NULL);
 
-  extend_top(intern_symbol("cons"), make_primitive(prim_cons));
-  extend_top(intern_symbol("car"), make_primitive(prim_car));
-  extend_top(intern_symbol("cdr"), make_primitive(prim_cdr));
+  in->owner = in;
+  interp = in;
+  init_mem();
+  init_symbols();
+  init_env();
 
-  extend_top(intern_symbol("eq"), make_primitive(primitive_eq));
+#ifdef AOT_MODULES
+  for (struct Module *module = preloaded_modules; module->name != NULL; module++)
+    module->init();
+#endif
 
-  extend_top(intern_symbol("+"), make_primitive(primitive_add));
-  extend_top(intern_symbol("-"), make_primitive(primitive_sub));
-  extend_top(intern_symbol("*"), make_primitive(primitive_mul));
-  extend_top(intern_symbol("/"), make_primitive(primitive_div));
+  return in;
+}
+
+/* Free IN and everything in its heap. */
+void free_Interp(Interp *in) {
+  Interp *outer = interp;
+
+  interp = in;
+  stop_workers(in);
+  trace_flush();
+  port_flush(in->out);
+
+  // Nothing is marked between collections, so this frees every object.
+  free_alloc_profile(in);
+  sweep();
+
+  free(in->pool);
+  free(in->free_list);
+  free(in->active_list);
+  free(in->hashcons);
+  free(in->hashcons_live);
+  free(in->out);
+  free(in->trace);
+  free(in->print_state);
+  free_tasks(in);
+  free_api(in);
+  free_perf(in);
+  free(in);
+
+  interp = outer != in ? outer : NULL;
 }
 
 void run_code_tests() {
@@ -900,33 +1854,27 @@ void run_code_tests() {
 
   Object *obj1 = NULL;
   pin_variable((void **)&obj1);
-  obj1 = new_Object();
-  obj1->type = NIL;
+  obj1 = new_Object(NIL);
 
   Object *obj2 = NULL;
   pin_variable((void **)&obj2);
-  obj2 = new_Object();
-  obj2->type = FIXNUM;
+  obj2 = new_Object(FIXNUM);
 
   Object *obj3 = NULL;
   pin_variable((void **)&obj3);
-  obj3 = new_Object();
-  obj3->type = CELL;
+  obj3 = new_Object(CELL);
 
   Object *obj4 = NULL;
   pin_variable((void **)&obj4);
-  obj4 = new_Object();
-  obj4->type = NIL;
+  obj4 = new_Object(NIL);
 
   Object *obj5 = NULL;
   pin_variable((void **)&obj5);
-  obj5 = new_Object();
-  obj5->type = FIXNUM;
+  obj5 = new_Object(FIXNUM);
 
   Object *obj6 = NULL;
   pin_variable((void **)&obj6);
-  obj6 = new_Object();
-  obj6->type = CELL;
+  obj6 = new_Object(CELL);
 
   //gc();
 
@@ -948,7 +1896,7 @@ void run_code_tests() {
 void run_test_file(char *fname) {
   printf("\n\n----------------------------------------BEGIN FILE TESTS: %s\n", fname);
 
-  FILE *fp = fopen(fname, "r");
+  Reader *fp = open_reader(fname);
 
   if (fp == NULL) {
     printf("File open failed: %d", errno);
@@ -958,6 +1906,18 @@ void run_test_file(char *fname) {
   Object *result = s_nil;
   pin_variable((void **)&result);
 
+  jmp_buf handler;
+  int pins = save_pins();
+  interp->error_handler = &handler;
+
+  if (setjmp(handler)) {
+    /* An error aborted the current form; carry on with the next. */
+    restore_pins(pins);
+    interp->eval_depth = 0;
+    interp->value_sp = 0;
+    result = s_nil;
+  }
+
   while (result != NULL) {
     printf("\n----\nREAD line from file\n");
     result = read_lisp(fp);
@@ -968,16 +1928,197 @@ void run_test_file(char *fname) {
       printf("Before eval:\n");
       print(result);
       printf("\n");
-      result = eval(result, top_env);
+      result = eval(result, interp->top_env);
       printf("After eval:\n");
       print(result);
       printf("\n");
     }
   }
 
+  interp->error_handler = NULL;
   unpin_variable((void **)&result);
 
-  fclose(fp);
+  close_reader(fp);
+}
+
+/* Read every form in FNAME, a source or .fasl file, without
+ * evaluating any, and say how fast. */
+void time_reader(char *fname) {
+  struct timespec start, end;
+  size_t len = strlen(fname);
+  int is_fasl = len > 5 && strcmp(fname + len - 5, ".fasl") == 0;
+  Fasl *fasl = NULL;
+  Reader *r = NULL;
+  long forms = 0;
+
+  if (is_fasl)
+    fasl = open_fasl(fname, NULL);
+  else
+    r = open_reader(fname);
+
+  if (r == NULL && fasl == NULL) {
+    printf("File open failed: %d", errno);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (is_fasl) {
+    while (fasl_read(fasl) != NULL)
+      forms++;
+  } else {
+    while (read_lisp(r) != NULL)
+      forms++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (is_fasl) {
+    fprintf(stderr, "%s: %ld forms in %.3f s\n", fname, forms, secs);
+    close_fasl(fasl);
+  } else {
+    double mb = (r->offset + r->pos) / 1e6;
+
+    fprintf(stderr, "%s: %ld forms, %.1f MB in %.3f s, %.1f MB/s (%s)\n",
+            fname, forms, mb, secs, mb / secs, scan_isa);
+    close_reader(r);
+  }
+}
+
+/* Threads running isolates get as much stack as the main thread. */
+#define ISOLATE_STACK_SIZE (8 << 20)
+
+struct Isolate {
+  pthread_t thread;
+  char **files;
+  int nfiles;
+};
+
+/* Evaluate each form in FNAME, printing nothing but errors. */
+void run_quietly(char *fname) {
+  Reader *volatile fp = open_reader(fname);
+  Object *form = NULL;
+
+  if (fp == NULL) {
+    printf("File open failed: %d", errno);
+    return;
+  }
+
+  pin_variable((void **)&form);
+
+  jmp_buf handler;
+  int pins = save_pins();
+  interp->error_handler = &handler;
+
+  if (setjmp(handler)) {
+    restore_pins(pins);
+    interp->eval_depth = 0;
+    interp->value_sp = 0;
+  }
+
+  while ((form = read_form(fp)) != NULL)
+    eval(form, interp->top_env);
+
+  interp->error_handler = NULL;
+  unpin_variable((void **)&form);
+
+  close_reader(fp);
+}
+
+void *run_isolate(void *arg) {
+  struct Isolate *iso = arg;
+  Interp *in = new_Interp();
+
+  for (int i = 0; i < iso->nfiles; i++)
+    run_quietly(iso->files[i]);
+
+  free_Interp(in);
+  return NULL;
+}
+
+/* Run FILES in COUNT interpreters at once, each on its own thread,
+ * and return how long that took. */
+double run_isolates(int count, int nfiles, char **files) {
+  struct Isolate *isolates = calloc(count, sizeof(struct Isolate));
+  struct timespec start, end;
+  pthread_attr_t attr;
+
+  assert(isolates != NULL);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, ISOLATE_STACK_SIZE);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < count; i++) {
+    isolates[i].files = files;
+    isolates[i].nfiles = nfiles;
+    if (pthread_create(&isolates[i].thread, &attr, run_isolate, &isolates[i]) != 0)
+      error("Cannot start isolate");
+  }
+
+  for (int i = 0; i < count; i++)
+    pthread_join(isolates[i].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_attr_destroy(&attr);
+  free(isolates);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Run FILES in 1, 2, 4 ... MAX isolates at once, and say how the
+ * throughput scales. */
+void time_isolates(int max, int nfiles, char **files) {
+  double base = 0;
+  int count = 1;
+
+  fprintf(stderr, "isolates  seconds   runs/s  speedup\n");
+
+  for (;;) {
+    double secs = run_isolates(count, nfiles, files);
+    double rate = count / secs;
+
+    if (count == 1)
+      base = rate;
+
+    fprintf(stderr, "%8d %8.3f %8.2f %8.2f\n", count, secs, rate, rate / base);
+
+    if (count == max)
+      break;
+    count = count * 2 < max ? count * 2 : max;
+  }
+}
+
+/* Run each of FILES in an interpreter of its own, all at once, and
+ * say how fast messages went over the channels between them. */
+void time_channels(int nfiles, char **files) {
+  struct Isolate *isolates = calloc(nfiles, sizeof(struct Isolate));
+  struct timespec start, end;
+  pthread_attr_t attr;
+  double secs;
+
+  assert(isolates != NULL);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, ISOLATE_STACK_SIZE);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < nfiles; i++) {
+    isolates[i].files = &files[i];
+    isolates[i].nfiles = 1;
+    if (pthread_create(&isolates[i].thread, &attr, run_isolate, &isolates[i]) != 0)
+      error("Cannot start isolate");
+  }
+
+  for (int i = 0; i < nfiles; i++)
+    pthread_join(isolates[i].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_attr_destroy(&attr);
+  free(isolates);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "%d isolates in %.3f seconds\n", nfiles, secs);
+  report_channels(stderr, secs);
 }
 
 void run_file_tests() {
@@ -988,6 +2129,25 @@ void run_file_tests() {
   run_test_file("./test/test4.lsp");
   run_test_file("./test/test5.lsp");
   run_test_file("./test/test6.lsp");
+  run_test_file("./test/test7.lsp");
+  run_test_file("./test/test8.lsp");
+  run_test_file("./test/test9.lsp");
+  run_test_file("./test/test10.lsp");
+  run_test_file("./test/test11.lsp");
+  run_test_file("./test/test13.lsp");
+  run_test_file("./test/test14.lsp");
+  run_test_file("./test/test15.lsp");
+  run_test_file("./test/test16.lsp");
+  run_test_file("./test/test17.lsp");
+  run_test_file("./test/test18.lsp");
+  run_test_file("./test/test19.lsp");
+  run_test_file("./test/test20.lsp");
+  run_test_file("./test/test21.lsp");
+  run_test_file("./test/test22.lsp");
+  run_test_file("./test/test23.lsp");
+  run_test_file("./test/test24.lsp");
+  run_test_file("./test/test25.lsp");
+  run_test_file("./test/test26.lsp");
   run_test_file("./test/testP.lsp");
   run_test_file("./test/testP1.lsp");
   run_test_file("./test/testP2.lsp");
@@ -1014,29 +2174,232 @@ void run_file_tests() {
 void do_repl() {
   printf("\nWelcome to JCM-LISP. Use ctrl-c to exit.\n");
 
+  Reader *in = fd_reader(STDIN_FILENO);
+
+  jmp_buf handler;
+  int pins = save_pins();
+  interp->error_handler = &handler;
+
+  if (setjmp(handler)) {
+    restore_pins(pins);
+    interp->eval_depth = 0;
+    interp->value_sp = 0;
+  }
+
   while (1) {
     Object *result = s_nil;
 
     printf("> ");
-    result = read_lisp(stdin);
-    result = eval(result, top_env);
+    fflush(stdout);
+    result = read_lisp(in);
+    result = eval(result, interp->top_env);
     print(result);
     printf("\n");
   }
 }
 
+#ifndef JCM_LISP_LIBRARY
 int main(int argc, char* argv[]) {
-  init_mem();
-  init_symbols();
-  init_env();
+  char *trace_spec = getenv("JCM_LISP_TRACE");
+
+  if (trace_spec != NULL && !trace_configure(trace_spec))
+    fprintf(stderr, "%s: ignoring JCM_LISP_TRACE=%s\n", argv[0], trace_spec);
+
+  new_Interp();
+
+  int opt;
+  char *aot_out = NULL;
+  char *modules_out = NULL;
+  int read_only = 0;
+  int isolates = 0;
+  int apart = 0;
+  char *serve_path = NULL;
+  char *load_path = NULL;
+  char *query_path = NULL;
+
+  while ((opt = getopt(argc, argv, "JNHDRST:P:I:C:M:E:G:Q:W:O:L:F:A:")) != -1) {
+    switch (opt) {
+      case 'J':
+        jit_enabled = 0;
+        break;
+      case 'N':
+        optimize_enabled = 0;
+        break;
+      case 'H':
+        hashcons_enabled = 0;
+        break;
+      case 'D':
+        optimize_dump = 1;
+        break;
+      case 'R':
+        read_only = 1;
+        break;
+      case 'S':
+        apart = 1;
+        break;
+      case 'T':
+        if (!trace_configure(optarg)) {
+          fprintf(stderr, "%s: bad trace spec %s; want eval, gc, pin, reader "
+                  "or all, each optionally =level (1-3), comma-separated\n",
+                  argv[0], optarg);
+          return 1;
+        }
+        break;
+      case 'P':
+        pmap_workers = atoi(optarg);
+        if (pmap_workers < 0) {
+          fprintf(stderr, "%s: -P wants a count of threads\n", argv[0]);
+          return 1;
+        }
+        break;
+      case 'I':
+        isolates = atoi(optarg);
+        if (isolates <= 0) {
+          fprintf(stderr, "%s: -I wants a count of isolates\n", argv[0]);
+          return 1;
+        }
+        break;
+      case 'C':
+        aot_out = optarg;
+        break;
+      case 'M':
+        modules_out = optarg;
+        break;
+      case 'E':
+        serve_path = optarg;
+        break;
+      case 'G':
+        load_path = optarg;
+        break;
+      case 'Q':
+        query_path = optarg;
+        break;
+      case 'W':
+        server_workers = atoi(optarg);
+        if (server_workers <= 0) {
+          fprintf(stderr, "%s: -W wants a count of workers\n", argv[0]);
+          return 1;
+        }
+        break;
+      case 'O':
+        server_timeout_ms = atoi(optarg);
+        if (server_timeout_ms <= 0) {
+          fprintf(stderr, "%s: -O wants a timeout in milliseconds\n", argv[0]);
+          return 1;
+        }
+        break;
+      case 'F':
+        profile_path = optarg;
+        break;
+      case 'A':
+        alloc_profile_every = atoi(optarg);
+        if (alloc_profile_every <= 0) {
+          fprintf(stderr, "%s: -A wants how many allocations to sample one of\n", argv[0]);
+          return 1;
+        }
+        break;
+      case 'L':
+        server_heap_limit = atoi(optarg);
+        if (server_heap_limit <= 0) {
+          fprintf(stderr, "%s: -L wants a count of objects\n", argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-J] [-N] [-H] [-D] [-T trace] [-P threads] [-F folded] [-A every] [file ...]\n"
+                "       %s -R file ...\n"
+                "       %s -I max file ...\n"
+                "       %s -S file ...\n"
+                "       %s -C out.c module.lsp\n"
+                "       %s -M out.c module.lsp ...\n"
+                "       %s -E socket [-W workers] [-O timeout-ms] [-L objects] [prelude ...]\n"
+                "       %s -G socket [-W clients] [request ...]\n"
+                "       %s -Q socket request ...\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+  }
+
+  // Compile a module to C, or list modules for `make aot`.
+  if (aot_out != NULL) {
+    if (optind != argc - 1) {
+      fprintf(stderr, "%s: -C takes one module\n", argv[0]);
+      return 1;
+    }
+    return aot_compile_file(aot_out, argv[optind]) ? 0 : 1;
+  }
 
+  if (modules_out != NULL)
+    return aot_write_modules(modules_out, argc - optind, &argv[optind]) ? 0 : 1;
+
+  if (isolates > 0) {
+    if (optind == argc) {
+      fprintf(stderr, "%s: -I needs files to run\n", argv[0]);
+      return 1;
+    }
+    time_isolates(isolates, argc - optind, &argv[optind]);
+    return 0;
+  }
+
+  if (apart) {
+    if (optind == argc) {
+      fprintf(stderr, "%s: -S needs files to run\n", argv[0]);
+      return 1;
+    }
+    time_channels(argc - optind, &argv[optind]);
+    return 0;
+  }
+
+  if (serve_path != NULL)
+    return serve(serve_path, argc - optind, &argv[optind]);
+
+  if (load_path != NULL)
+    return load_server(load_path, server_workers > 0 ? server_workers : 1,
+                       argc - optind, &argv[optind]);
+
+  if (query_path != NULL)
+    return query_server(query_path, argc - optind, &argv[optind]);
+
+  FILE *folded = NULL;
+  if (profile_path != NULL) {
+    folded = fopen(profile_path, "w");
+    if (folded == NULL) {
+      perror(profile_path);
+      return 1;
+    }
+    profile_start(PROFILE_INTERVAL_US);
+  }
+  if (alloc_profile_every > 0)
+    alloc_profile_start(alloc_profile_every);
+
+  // Files named on the command line replace the built-in tests.
+  if (optind < argc) {
+    for (int i = optind; i < argc; i++) {
+      if (read_only)
+        time_reader(argv[i]);
+      else
+        run_test_file(argv[i]);
+    }
+  } else {
 #ifdef CODE_TEST
-  run_code_tests();
+    run_code_tests();
 #endif
 
 #ifdef FILE_TEST
-  run_file_tests();
+    run_file_tests();
 #endif
+  }
+
+  if (folded != NULL) {
+    profile_stop(folded);
+    fclose(folded);
+  }
+
+  // However it was started, an allocation profile reports at exit.
+  alloc_profile_stop(1);
+
+  if (optind < argc)
+    return 0;
 
 #ifdef REPL
   do_repl();
@@ -1044,3 +2407,4 @@ int main(int argc, char* argv[]) {
 
   return 0;
 }
+#endif // JCM_LISP_LIBRARY
@@ -16,12 +16,31 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <assert.h>
+#include <setjmp.h>
 #include <sys/errno.h>
 
 //#define CODE_TEST
 #define FILE_TEST
 //#define REPL
 
+/* Deepest nesting of eval() before we give up
+ * rather than overflow the C stack. */
+#define MAX_EVAL_DEPTH 10000
+
+/* Slots for the operator and args of calls in progress. */
+#define VALUE_STACK_SIZE 65536
+
+/* Variables that may be pinned at once. */
+#define MAX_PINS 65536
+
+/* Calls a site must see before it is specialized, and how
+ * often it may fall back before we stop trying. */
+#define QUICKEN_THRESHOLD 8
+#define MAX_DEOPTS 4
+
+/* Calls of a procedure body before it is compiled to native code. */
+#define JIT_THRESHOLD 100
+
 typedef enum {
   UNKNOWN   = 0,
   NIL       = 1,
@@ -30,11 +49,22 @@ typedef enum {
   SYMBOL    = 4,
   CELL      = 5,
   PRIMITIVE = 6,
-  PROC      = 7
+  PROC      = 7,
+  CODE      = 8,
+  MACRO     = 9,
+  PORT      = 10,
+  CHANNEL   = 11
 } obj_type;
 
 typedef struct Object Object;
 typedef struct Object *primitive_fn(Object *);
+typedef struct Object *primitive_argv_fn(int argc, Object **argv);
+
+typedef struct Node Node;
+typedef struct Frame Frame;
+typedef struct Reader Reader;
+typedef struct Channel Channel;
+typedef struct Scheduler Scheduler;
 
 struct Fixnum {
   int value;
@@ -53,16 +83,48 @@ struct Cell {
   struct Object *cdr;
 };
 
+/* A primitive takes either a list of args (fn), or a count and
+ * a vector of args on the value stack (argv_fn).  MAX_ARGS of -1
+ * means any number. */
 struct Primitive {
   primitive_fn *fn;
+  primitive_argv_fn *argv_fn;
+  char *name;
+  short min_args;
+  short max_args;
+  int foreign;          /* if neither: a C primitive, by number (api.c) */
 };
 
 struct Proc {
-  struct Object *vars;
-  struct Object *body;
+  struct Node *lambda;   /* analyzed lambda: params and body */
+  struct Object *code;   /* CODE object that owns LAMBDA */
   struct Object *env;
 };
 
+struct Code {
+  struct Node *node;
+  struct Object *expansions;   /* macro expansions NODE was analyzed from */
+};
+
+/* A macro is a proc run on the unevaluated args of a call,
+ * whose result is analyzed in place of the call. */
+struct Macro {
+  struct Object *proc;
+};
+
+/* A port reads from READER and writes to fd OUT, which are NULL and
+ * -1 if it doesn't, or once it is closed. */
+struct Port {
+  Reader *reader;
+  int out;
+};
+
+/* Channels belong to the process, not a heap, so any interpreter
+ * may hold one of these for the same channel. */
+struct ChannelRef {
+  Channel *channel;
+};
+
 struct Object {
   union {
     struct Cell cell;
@@ -71,29 +133,230 @@ struct Object {
     struct String str;
     struct Proc proc;
     struct Primitive primitive;
+    struct Code code;
+    struct Macro macro;
+    struct Port port;
+    struct ChannelRef chan;
   };
 
   obj_type type;
   int mark;
   int id;
+  unsigned int hash;   /* structural hash of a shared literal, or 0 */
+};
+
+/*
+ * Analyzed code.
+ *
+ * Each form is analyzed once into a tree of nodes, with the handler
+ * for its kind of form chosen up front.  Running the code is then a
+ * matter of calling node->fn, with no dispatch on the source.
+ *
+ * A handler returns the value of its node, or, for a form in tail
+ * position, stores the next node (and env) in the frame and returns
+ * TAIL_CALL so execute() can carry on without growing the C stack.
+ */
+typedef Object *node_fn(Node *node, Frame *frame);
+
+struct Node {
+  node_fn *fn;
+  Object *form;      /* source form */
+  Object *value;     /* constant, variable symbol or lambda params,
+                        or the operator a quickened call expects */
+  Object *pair;      /* cached (symbol . value) of a global */
+  Object *owner;     /* lambda: CODE object the tree belongs to */
+  Object *name;      /* lambda: what it was defined as, for profiles */
+  int index;         /* local: position of the binding in env */
+  int argc;          /* call: operands; body: forms */
+  int count;         /* call, body: times run before specializing */
+  int deopts;        /* call: times a quickened guard failed */
+  Node *op;          /* call operator, if test, or value to store */
+  Node *then;        /* if branch, or lambda body */
+  Node *other;
+  Node **args;       /* call operands, or body forms */
+  void *native;      /* body: compiled code, if any */
+  size_t native_size;
+};
+
+struct Frame {
+  Node *node;        /* node to execute next */
+  Object *env;
+  Object *code;      /* keeps NODE alive across a tail call */
 };
 
 void print(Object *);
+char *get_type(Object *obj);
+void free_node(Node *node);
+
+/* Node handlers, and what they share with compiled code. */
+extern Object tail_call_marker;
+#define TAIL_CALL (&tail_call_marker)
+
+Object *execute(Node *node, Object *env);
+Object *execute_proc(Object *proc, Object *env);
+Object *exec_constant(Node *node, Frame *frame);
+Object *exec_local(Node *node, Frame *frame);
+Object *exec_global(Node *node, Frame *frame);
+Object *exec_if(Node *node, Frame *frame);
+Object *exec_guard(Node *node, Frame *frame);
+Object *exec_call(Node *node, Frame *frame);
+Object *exec_body(Node *node, Frame *frame);
+Object *exec_fixnum_add(Node *node, Frame *frame);
+Object *exec_fixnum_sub(Node *node, Frame *frame);
+Object *exec_fixnum_mul(Node *node, Frame *frame);
+Object *exec_fixnum_eq(Node *node, Frame *frame);
+Object *exec_fixnum_fallback(Node *node, Frame *frame);
+Object *make_fixnum(int n);
+Object *cons(Object *car, Object *cdr);
+
+/* The rest of the runtime compiled modules call. */
+int is_fixnum(Object *obj);
+int is_string(Object *obj);
+int is_symbol(Object *obj);
+int is_cell(Object *obj);
+int is_macro(Object *obj);
+int is_primitive(Object *obj);
+int is_proc(Object *obj);
+int is_port(Object *obj);
+int is_channel(Object *obj);
+Object *car(Object *obj);
+Object *cdr(Object *obj);
+void setcar(Object *obj, Object *val);
+void setcdr(Object *obj, Object *val);
+Object *make_string(char *str);
+Object *make_string_n(char *text, size_t len);
+Object *make_channel(Channel *channel);
+Object *make_primitive_argv(char *name, primitive_argv_fn *fn,
+                            int min_args, int max_args);
+Object *intern_symbol(char *name);
+Object *intern_symbol_n(char *name, size_t len);
+Object *assoc(Object *symbol, Object *env);
+Object *extend_top(Object *var, Object *val);
+int list_length(Object *list);
+int proper_params(Object *params);
+Object *eval(Object *obj, Object *env);
+Object *prim_load(int argc, Object **argv);
+Object *call_value(Object *fn, int argc, Object **argv);
+Object *global_macro(Object *symbol);
+Object *macroexpand(Object *macro, Object *form);
+Object *expand_call(Object *obj, Object *macro);
+int guard_holds(Object *guards);
+
+/* Builtins the optimizer can fold. */
+Object *call_primitive(Object *proc, int argc, Object **argv);
+Object *primitive_add(int argc, Object **argv);
+Object *primitive_sub(int argc, Object **argv);
+Object *primitive_mul(int argc, Object **argv);
+Object *primitive_eq(int argc, Object **argv);
+void push_value(Object *obj);
+
+/* What (time) reports the change in (see stats.c). */
+typedef struct Counters {
+  long steps;              /* execute()s entered */
+  long calls;              /* procedures and primitives applied */
+  long collections;
+  long gc_ns;              /* spent collecting */
+  long allocated[CHANNEL + 1]; /* objects, by type */
+} Counters;
+
+/*
+ * Interpreters.
+ *
+ * Everything one interpreter owns -- its heap, symbols, toplevel and
+ * stacks -- is in an Interp, and none of it is shared, so a process
+ * can run several at once, each on its own thread, without locking.
+ * A thread runs the one in `interp`.
+ *
+ * pmap's workers are Interps too, which share the heap of the one that
+ * owns them but have their own stacks and allocate from their own run
+ * of heap slots (see pmap.c).
+ */
+typedef struct Interp {
+  struct Interp *owner;    /* whose heap this is: itself, unless a worker */
+  struct Workers *workers; /* pmap's threads, once started */
+  int parallel;            /* running a pmap alongside other threads */
+
+  Object *pool;            /* the heap: MAX_ALLOC_SIZE objects */
+  void **free_list;
+  void **active_list;
+  int next_free;           /* owner: slots below are handed out to
+                              allocate from until sweep resets it */
+  int tlab_next;           /* this thread's slots to allocate from */
+  int tlab_end;
+  int current_mark;
+  int heap_limit;          /* objects the heap may hold while serving, or 0 */
+  int heap_used;           /* at most, since it was last counted */
+  int alloc_countdown;     /* allocations until one is sampled */
+  struct AllocProfile *allocs; /* owner: allocation profile, if running */
+  Counters counters;
+  struct Perf *perf;       /* hardware counters, once (time) opens them */
+  int pv_count;
+  Object **hashcons;       /* shared literals, by hash */
+  Object **hashcons_live;  /* gc()'s, to rebuild it from */
+
+  int value_sp;
+  int eval_depth;          /* nesting of execute() on the C stack */
+  jmp_buf *error_handler;  /* where error() unwinds to, if anywhere */
+  char *error_message;     /* what it was about */
+  int quiet;               /* error() doesn't print it */
+
+  Object *symbols;         /* owner: simple linked list */
+  Object *top_env;         /* list of lists? */
+  int gensym_count;        /* owner */
+
+  struct OutPort *out;     /* print() writes here */
+  struct OutPort *trace;   /* trace output, once there is any */
+  struct PrintState *print_state;
+  Scheduler *tasks;        /* spawned tasks, once there are any */
+  struct Api *api;         /* an embedder's handles and C primitives */
+
+  Object *s_quote;
+  Object *s_define;
+  Object *s_setq;
+  Object *s_nil;
+  Object *s_if;
+  Object *s_t;
+  Object *s_lambda;
+  Object *s_defmacro;
+  Object *s_guard;
+  Object *s_time;
+  Object *s_eof;           /* read's end of input, named so it can't
+                              be read */
+  Object *s_print_circle;  /* if bound true, print labels all sharing,
+                              not just cycles */
+
+  /* The stacks pins and calls use most, inline to save a load. */
+  void **pins[MAX_PINS];   /* addresses of pinned variables */
+  Object *value_stack[VALUE_STACK_SIZE];
+
+  /* By depth, the procedure each execute() on the C stack has called,
+   * or NULL while it is still in its caller's (see profile.c). */
+  Object *procs[MAX_EVAL_DEPTH];
+} Interp;
+
+/* Initial-exec, so it is at the same offset from %fs in every thread,
+ * which compiled code relies on. */
+extern __thread Interp *interp __attribute__((tls_model("initial-exec")));
 
-Object *s_quote;
-Object *s_define;
-Object *s_setq;
-Object *s_nil;
-Object *s_if;
-Object *s_t;
-Object *s_lambda;
+/* The symbols the runtime compares against, read as constants. */
+#define s_quote        (interp->s_quote)
+#define s_define       (interp->s_define)
+#define s_setq         (interp->s_setq)
+#define s_nil          (interp->s_nil)
+#define s_if           (interp->s_if)
+#define s_t            (interp->s_t)
+#define s_lambda       (interp->s_lambda)
+#define s_defmacro     (interp->s_defmacro)
+#define s_guard        (interp->s_guard)
+#define s_time         (interp->s_time)
+#define s_eof          (interp->s_eof)
+#define s_print_circle (interp->s_print_circle)
 
-Object *symbols;    /* simple linked list */
-Object *top_env;    /* list of lists? */
+Interp *new_Interp();
+void free_Interp(Interp *in);
 
 #define caar(obj)    car(car(obj))
 #define cadr(obj)    car(cdr(obj))
 #define cdar(obj)    cdr(car(obj))
 #define cddr(obj)    cdr(cdr(obj))
 
-Object *read_list(FILE *);
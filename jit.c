@@ -0,0 +1,424 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Baseline JIT.
+ *
+ * A procedure body that has run JIT_THRESHOLD times is compiled to
+ * x86-64 code that stands in for its exec_body handler.  The code is
+ * a template expansion of the body's node tree: constants, variables,
+ * if and quickened fixnum operations are done inline, and anything
+ * else is handed to execute().  A call in tail position is handed
+ * back to execute()'s loop exactly as the interpreter does.
+ *
+ * Compiled code keeps no object in a register across a call that can
+ * allocate.  Operands waiting on another operand go on the value
+ * stack, where the collector finds them, as in the interpreter.
+ * Nil's and t's addresses are built into the code, which is fine since
+ * a node tree only runs on its interpreter's heap.  The value stack's
+ * is not, since pmap's threads share the heap but not the stack: the
+ * code finds the running interpreter through `interp`, at a fixed
+ * offset from %fs.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+int jit_enabled = 1;
+
+#if defined(__x86_64__)
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+#define R8  8
+
+#define MAX_EXITS 256
+
+struct Asm {
+  unsigned char *buf;
+  int len;
+  int cap;
+  int exits[MAX_EXITS];   /* jumps to patch to the epilogue */
+  int nexits;
+  int overflows[MAX_EXITS];  /* jumps to patch to the overflow stub */
+  int noverflows;
+  Object *refs;           /* objects the code compares against */
+  int failed;
+};
+
+static void emit_byte(struct Asm *a, unsigned char byte) {
+  if (a->len == a->cap) {
+    a->cap = a->cap ? a->cap * 2 : 256;
+    a->buf = realloc(a->buf, a->cap);
+    assert(a->buf != NULL);
+  }
+
+  a->buf[a->len++] = byte;
+}
+
+static void emit_bytes(struct Asm *a, const char *bytes, int n) {
+  for (int i = 0; i < n; i++)
+    emit_byte(a, bytes[i]);
+}
+
+static void emit32(struct Asm *a, int32_t value) {
+  for (int i = 0; i < 4; i++)
+    emit_byte(a, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(struct Asm *a, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    emit_byte(a, (value >> (8 * i)) & 0xff);
+}
+
+/* mov reg, imm64 */
+static void emit_mov_imm(struct Asm *a, int reg, void *value) {
+  emit_byte(a, reg >= 8 ? 0x49 : 0x48);
+  emit_byte(a, 0xb8 + (reg & 7));
+  emit64(a, (uint64_t)value);
+}
+
+/* Where `interp` is, relative to the thread pointer; the same in
+ * every thread. */
+static int32_t interp_tls_offset() {
+  char *tp;
+
+  asm("mov %%fs:0, %0" : "=r"(tp));
+  return (char *)&interp - tp;
+}
+
+/* Point reg at the field at OFFSET in the running thread's Interp:
+ * mov reg, fs:[&interp]; add reg, imm32 */
+static void emit_interp_field(struct Asm *a, int reg, size_t offset) {
+  emit_byte(a, 0x64);
+  emit_byte(a, reg >= 8 ? 0x4c : 0x48);
+  emit_byte(a, 0x8b);
+  emit_byte(a, 0x04 | ((reg & 7) << 3));
+  emit_byte(a, 0x25);
+  emit32(a, interp_tls_offset());
+
+  emit_byte(a, reg >= 8 ? 0x49 : 0x48);
+  emit_byte(a, 0x81);
+  emit_byte(a, 0xc0 + (reg & 7));
+  emit32(a, offset);
+}
+
+/* call fn, through rax */
+static void emit_call(struct Asm *a, void *fn) {
+  emit_mov_imm(a, RAX, fn);
+  emit_bytes(a, "\xff\xd0", 2);
+}
+
+/* Emit a jump with condition CC (0 for unconditional),
+ * returning where its offset is to be patched. */
+static int emit_jump(struct Asm *a, int cc) {
+  if (cc == 0) {
+    emit_byte(a, 0xe9);
+  } else {
+    emit_byte(a, 0x0f);
+    emit_byte(a, cc);
+  }
+  emit32(a, 0);
+  return a->len - 4;
+}
+
+#define JE  0x84
+#define JNE 0x85
+#define JAE 0x83
+
+/* Point the jump at AT to the current position. */
+static void patch(struct Asm *a, int at) {
+  int32_t rel = a->len - (at + 4);
+  memcpy(a->buf + at, &rel, 4);
+}
+
+static void emit_exit(struct Asm *a) {
+  if (a->nexits == MAX_EXITS) {
+    a->failed = 1;
+    return;
+  }
+  a->exits[a->nexits++] = emit_jump(a, 0);
+}
+
+/* mov rax, [rbx + frame field] */
+static void emit_load_frame(struct Asm *a, int reg, int offset) {
+  emit_byte(a, 0x48);
+  emit_byte(a, 0x8b);
+  emit_byte(a, 0x43 | (reg << 3));
+  emit_byte(a, offset);
+}
+
+/* Push rax on the value stack. */
+static void emit_push_value(struct Asm *a) {
+  emit_interp_field(a, RCX, offsetof(Interp, value_sp));
+  emit_bytes(a, "\x48\x63\x11", 3);              // movsxd rdx, [rcx]
+  emit_bytes(a, "\x81\xfa", 2);                  // cmp edx, imm32
+  emit32(a, VALUE_STACK_SIZE);
+  if (a->noverflows == MAX_EXITS)
+    a->failed = 1;
+  else
+    a->overflows[a->noverflows++] = emit_jump(a, JAE);
+  emit_interp_field(a, R8, offsetof(Interp, value_stack));
+  emit_bytes(a, "\x49\x89\x04\xd0", 4);          // mov [r8+rdx*8], rax
+  emit_bytes(a, "\xff\x01", 2);                  // inc dword [rcx]
+}
+
+/* execute(node, frame->env), leaving the value in rax. */
+static void emit_execute(struct Asm *a, Node *node) {
+  emit_mov_imm(a, RDI, node);
+  emit_load_frame(a, RSI, offsetof(Frame, env));
+  emit_call(a, execute);
+}
+
+static void compile_value(struct Asm *a, Node *node);
+static void compile_tail(struct Asm *a, Node *node);
+
+static void compile_local(struct Asm *a, Node *node) {
+  emit_load_frame(a, RAX, offsetof(Frame, env));
+  for (int i = 0; i < node->index; i++)
+    emit_bytes(a, "\x48\x8b\x40\x08", 4);        // mov rax, [rax+8]   cdr
+  emit_bytes(a, "\x48\x8b\x00", 3);              // mov rax, [rax]     car
+  emit_bytes(a, "\x48\x8b\x40\x08", 4);          // mov rax, [rax+8]   cdr
+}
+
+static void compile_fixnum_op(struct Asm *a, Node *node, node_fn *fn) {
+  Object *pair = node->op->pair;
+
+  // Keep the operator we compare against alive with the code.
+  a->refs = cons(node->value, a->refs);
+
+  // Guard: the operator is still the builtin.
+  emit_mov_imm(a, RAX, pair);
+  emit_bytes(a, "\x48\x8b\x40\x08", 4);          // mov rax, [rax+8]
+  emit_mov_imm(a, RCX, node->value);
+  emit_bytes(a, "\x48\x39\xc8", 3);              // cmp rax, rcx
+  int slow = emit_jump(a, JNE);
+
+  // Operator and args go on the value stack, as exec_fixnum_op does.
+  emit_bytes(a, "\x48\x89\xc8", 3);              // mov rax, rcx
+  emit_push_value(a);
+  compile_value(a, node->args[0]);
+  emit_push_value(a);
+  compile_value(a, node->args[1]);
+  emit_push_value(a);
+
+  emit_interp_field(a, RCX, offsetof(Interp, value_sp));
+  emit_bytes(a, "\x48\x63\x11", 3);              // movsxd rdx, [rcx]
+  emit_interp_field(a, R8, offsetof(Interp, value_stack));
+  emit_bytes(a, "\x49\x8b\x44\xd0\xf8", 5);      // mov rax, [r8+rdx*8-8]
+  emit_bytes(a, "\x49\x8b\x4c\xd0\xf0", 5);      // mov rcx, [r8+rdx*8-16]
+
+  // Guard: both are fixnums.
+  emit_bytes(a, "\x83\x79", 2);                  // cmp dword [rcx+type], FIXNUM
+  emit_byte(a, offsetof(Object, type));
+  emit_byte(a, FIXNUM);
+  int fallback1 = emit_jump(a, JNE);
+  emit_bytes(a, "\x83\x78", 2);                  // cmp dword [rax+type], FIXNUM
+  emit_byte(a, offsetof(Object, type));
+  emit_byte(a, FIXNUM);
+  int fallback2 = emit_jump(a, JNE);
+
+  // Drop them from the value stack; only their values are needed now.
+  emit_interp_field(a, RSI, offsetof(Interp, value_sp));
+  emit_bytes(a, "\x83\x2e\x03", 3);              // sub dword [rsi], 3
+
+  if (fn == exec_fixnum_eq) {
+    emit_bytes(a, "\x8b\x11", 2);                // mov edx, [rcx]
+    emit_bytes(a, "\x3b\x10", 2);                // cmp edx, [rax]
+    emit_mov_imm(a, RAX, s_t);
+    int same = emit_jump(a, JE);
+    emit_mov_imm(a, RAX, s_nil);
+    patch(a, same);
+  } else {
+    emit_bytes(a, "\x8b\x39", 2);                // mov edi, [rcx]
+    if (fn == exec_fixnum_add)
+      emit_bytes(a, "\x03\x38", 2);              // add edi, [rax]
+    else if (fn == exec_fixnum_sub)
+      emit_bytes(a, "\x2b\x38", 2);              // sub edi, [rax]
+    else
+      emit_bytes(a, "\x0f\xaf\x38", 3);          // imul edi, [rax]
+    emit_call(a, make_fixnum);
+  }
+  int done1 = emit_jump(a, 0);
+
+  // Not fixnums: finish the call generically from the value stack.
+  patch(a, fallback1);
+  patch(a, fallback2);
+  emit_mov_imm(a, RDI, node);
+  emit_bytes(a, "\x48\x89\xde", 3);              // mov rsi, rbx
+  emit_call(a, exec_fixnum_fallback);
+  int done2 = emit_jump(a, 0);
+
+  // Operator rebound: let the interpreter deal with it.
+  patch(a, slow);
+  emit_execute(a, node);
+
+  patch(a, done1);
+  patch(a, done2);
+}
+
+/* Test the guards of an optimizer %guard node, returning the jump
+ * to patch to its slow path. */
+static int emit_guard(struct Asm *a, Node *node) {
+  emit_mov_imm(a, RDI, node->value);
+  emit_call(a, guard_holds);
+  emit_bytes(a, "\x85\xc0", 2);                  // test eax, eax
+  return emit_jump(a, JE);
+}
+
+/* Leave the value of NODE in rax. */
+static void compile_value(struct Asm *a, Node *node) {
+  if (node->fn == exec_constant) {
+    emit_mov_imm(a, RAX, node->value);
+  } else if (node->fn == exec_local) {
+    compile_local(a, node);
+  } else if (node->fn == exec_global && node->pair != NULL) {
+    // Toplevel bindings are never removed, so the pair is for keeps.
+    emit_mov_imm(a, RAX, node->pair);
+    emit_bytes(a, "\x48\x8b\x40\x08", 4);        // mov rax, [rax+8]
+  } else if (node->fn == exec_if) {
+    compile_value(a, node->op);
+    emit_mov_imm(a, RCX, s_nil);
+    emit_bytes(a, "\x48\x39\xc8", 3);            // cmp rax, rcx
+    int other = emit_jump(a, JE);
+    compile_value(a, node->then);
+    int done = emit_jump(a, 0);
+    patch(a, other);
+    compile_value(a, node->other);
+    patch(a, done);
+  } else if (node->fn == exec_guard) {
+    int slow = emit_guard(a, node);
+    compile_value(a, node->then);
+    int done = emit_jump(a, 0);
+    patch(a, slow);
+    compile_value(a, node->other);
+    patch(a, done);
+  } else if (node->fn == exec_fixnum_add ||
+             node->fn == exec_fixnum_sub ||
+             node->fn == exec_fixnum_mul ||
+             node->fn == exec_fixnum_eq) {
+    compile_fixnum_op(a, node, node->fn);
+  } else {
+    emit_execute(a, node);
+  }
+}
+
+/* Return the value of NODE, or hand a call back to execute(). */
+static void compile_tail(struct Asm *a, Node *node) {
+  if (node->fn == exec_if) {
+    compile_value(a, node->op);
+    emit_mov_imm(a, RCX, s_nil);
+    emit_bytes(a, "\x48\x39\xc8", 3);            // cmp rax, rcx
+    int other = emit_jump(a, JE);
+    compile_tail(a, node->then);
+    patch(a, other);
+    compile_tail(a, node->other);
+  } else if (node->fn == exec_guard) {
+    int slow = emit_guard(a, node);
+    compile_tail(a, node->then);
+    patch(a, slow);
+    compile_tail(a, node->other);
+  } else if (node->fn == exec_call) {
+    emit_mov_imm(a, RAX, node);
+    emit_bytes(a, "\x48\x89\x43", 3);            // mov [rbx+node], rax
+    emit_byte(a, offsetof(Frame, node));
+    emit_mov_imm(a, RAX, TAIL_CALL);
+    emit_exit(a);
+  } else {
+    compile_value(a, node);
+    emit_exit(a);
+  }
+}
+
+/* Compile BODY, a body node, to a native stand-in for exec_body. */
+int jit_compile(Node *body) {
+  if (!jit_enabled)
+    return 0;
+
+  struct Asm a;
+  memset(&a, 0, sizeof(a));
+  a.refs = s_nil;
+  pin_variable((void **)&a.refs);
+
+  emit_byte(&a, 0x53);                           // push rbx
+  emit_bytes(&a, "\x48\x89\xf3", 3);             // mov rbx, rsi
+
+  for (int i = 0; i < body->argc - 1; i++)
+    compile_value(&a, body->args[i]);
+  compile_tail(&a, body->args[body->argc - 1]);
+
+  for (int i = 0; i < a.nexits; i++)
+    patch(&a, a.exits[i]);
+  emit_byte(&a, 0x5b);                           // pop rbx
+  emit_byte(&a, 0xc3);                           // ret
+
+  for (int i = 0; i < a.noverflows; i++)
+    patch(&a, a.overflows[i]);
+  emit_mov_imm(&a, RDI, "Value stack overflow");
+  emit_call(&a, error);
+
+  unpin_variable((void **)&a.refs);
+
+  if (a.failed) {
+    free(a.buf);
+    return 0;
+  }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (a.len + page - 1) / page * page;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (mem == MAP_FAILED) {
+    free(a.buf);
+    return 0;
+  }
+
+  memcpy(mem, a.buf, a.len);
+  free(a.buf);
+
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    return 0;
+  }
+
+  body->value = a.refs;
+  body->native = mem;
+  body->native_size = size;
+  // Last, for pmap's other threads running the body meanwhile.
+  __atomic_store_n(&body->fn, (node_fn *)mem, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+void jit_release(Node *node) {
+  if (node->native != NULL) {
+    munmap(node->native, node->native_size);
+    node->native = NULL;
+  }
+}
+
+#else
+
+int jit_compile(Node *body) {
+  return 0;
+}
+
+void jit_release(Node *node) { // void
+}
+
+#endif // __x86_64__
@@ -0,0 +1,14 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Cleared by -J to leave everything to the interpreter. */
+extern int jit_enabled;
+
+int jit_compile(Node *body);
+void jit_release(Node *node);
@@ -0,0 +1,228 @@
+/* Generated by jcm-lisp -C from lib/arith.lsp.  Do not edit. */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "aot.h"
+
+static __thread struct {
+  char nonempty;
+  Object *S[13];
+  Object *K[39];
+} cache;
+
+#define S (cache.S)
+#define G (cache.G)
+#define K (cache.K)
+
+void *aot_cache_arith() {
+  void *copy = malloc(sizeof(cache));
+
+  assert(copy != NULL);
+  return memcpy(copy, &cache, sizeof(cache));
+}
+
+void aot_adopt_arith(void *from) {
+  memcpy(&cache, from, sizeof(cache));
+}
+
+static Object *f_square(int argc, Object **argv);
+static Object *f_fact(int argc, Object **argv);
+static Object *f_fib(int argc, Object **argv);
+static Object *f_expt_2diter(int argc, Object **argv);
+static Object *f_expt(int argc, Object **argv);
+static Object *f_length(int argc, Object **argv);
+
+static Object *f_square(int argc, Object **argv) {
+  Object **v = aot_enter(0);
+  Object *result = s_nil;
+
+  result = make_fixnum((AOT_FIXNUM(argv[0]) * AOT_FIXNUM(argv[0])));
+  goto done;
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+static Object *f_fact(int argc, Object **argv) {
+  Object **v = aot_enter(2);
+  Object *result = s_nil;
+
+  if (is_fixnum(argv[0]) && argv[0]->num.value == 0) {
+    result = K[0];
+    goto done;
+  } else {
+    v[0] = make_fixnum((AOT_FIXNUM(argv[0]) - 1));
+    v[1] = f_fact(1, &v[0]);
+    result = make_fixnum((AOT_FIXNUM(argv[0]) * AOT_FIXNUM(v[1])));
+    goto done;
+  }
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+static Object *f_fib(int argc, Object **argv) {
+  Object **v = aot_enter(4);
+  Object *result = s_nil;
+
+  if (is_fixnum(argv[0]) && argv[0]->num.value == 0) {
+    result = K[1];
+    goto done;
+  } else {
+    if (is_fixnum(argv[0]) && argv[0]->num.value == 1) {
+      result = K[2];
+      goto done;
+    } else {
+      v[0] = make_fixnum((AOT_FIXNUM(argv[0]) - 1));
+      v[1] = f_fib(1, &v[0]);
+      v[2] = make_fixnum((AOT_FIXNUM(argv[0]) - 2));
+      v[3] = f_fib(1, &v[2]);
+      result = make_fixnum((AOT_FIXNUM(v[1]) + AOT_FIXNUM(v[3])));
+      goto done;
+    }
+  }
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+static Object *f_expt_2diter(int argc, Object **argv) {
+  Object **v = aot_enter(3);
+  Object *result = s_nil;
+
+ top:
+  if (is_fixnum(argv[1]) && argv[1]->num.value == 0) {
+    result = argv[2];
+    goto done;
+  } else {
+    v[0] = argv[0];
+    v[1] = make_fixnum((AOT_FIXNUM(argv[1]) - 1));
+    v[2] = make_fixnum((AOT_FIXNUM(argv[2]) * AOT_FIXNUM(argv[0])));
+    argv[0] = v[0];
+    argv[1] = v[1];
+    argv[2] = v[2];
+    goto top;
+  }
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+static Object *f_expt(int argc, Object **argv) {
+  Object **v = aot_enter(4);
+  Object *result = s_nil;
+
+  v[0] = argv[0];
+  v[1] = argv[1];
+  v[2] = K[3];
+  v[3] = f_expt_2diter(3, &v[0]);
+  result = v[3];
+  goto done;
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+static Object *f_length(int argc, Object **argv) {
+  Object **v = aot_enter(2);
+  Object *result = s_nil;
+
+  if (argv[0] != s_nil) {
+    v[0] = cdr(argv[0]);
+    v[1] = f_length(1, &v[0]);
+    result = make_fixnum((1 + AOT_FIXNUM(v[1])));
+    goto done;
+  } else {
+    result = K[4];
+    goto done;
+  }
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+static Object *t_0(int argc, Object **argv) {
+  Object **v = aot_enter(1);
+  Object *result = s_nil;
+
+  v[0] = K[24];
+  aot_define(S[6], v[0]);
+  result = v[0];
+  goto done;
+
+ done:
+  aot_leave(v);
+  return result;
+}
+
+void aot_init_arith() {
+  for (int i = 0; i < 39; i++)
+    pin_variable((void **)&K[i]);
+
+  S[0] = intern_symbol("square");
+  S[1] = intern_symbol("fact");
+  S[2] = intern_symbol("fib");
+  S[3] = intern_symbol("expt-iter");
+  S[4] = intern_symbol("expt");
+  S[5] = intern_symbol("length");
+  S[6] = intern_symbol("digits");
+  S[7] = intern_symbol("define");
+  S[8] = intern_symbol("adder");
+  S[9] = intern_symbol("lambda");
+  S[10] = intern_symbol("n");
+  S[11] = intern_symbol("x");
+  S[12] = intern_symbol("+");
+  K[0] = make_fixnum(1);
+  K[1] = make_fixnum(0);
+  K[2] = make_fixnum(1);
+  K[3] = make_fixnum(1);
+  K[4] = make_fixnum(0);
+  K[5] = make_fixnum(0);
+  K[6] = make_fixnum(1);
+  K[7] = make_fixnum(2);
+  K[8] = make_fixnum(3);
+  K[9] = make_fixnum(4);
+  K[10] = make_fixnum(5);
+  K[11] = make_fixnum(6);
+  K[12] = make_fixnum(7);
+  K[13] = make_fixnum(8);
+  K[14] = make_fixnum(9);
+  K[15] = cons(K[14], s_nil);
+  K[16] = cons(K[13], K[15]);
+  K[17] = cons(K[12], K[16]);
+  K[18] = cons(K[11], K[17]);
+  K[19] = cons(K[10], K[18]);
+  K[20] = cons(K[9], K[19]);
+  K[21] = cons(K[8], K[20]);
+  K[22] = cons(K[7], K[21]);
+  K[23] = cons(K[6], K[22]);
+  K[24] = cons(K[5], K[23]);
+  K[25] = cons(S[10], s_nil);
+  K[26] = cons(S[11], s_nil);
+  K[27] = cons(S[10], s_nil);
+  K[28] = cons(S[11], K[27]);
+  K[29] = cons(S[12], K[28]);
+  K[30] = cons(K[29], s_nil);
+  K[31] = cons(K[26], K[30]);
+  K[32] = cons(S[9], K[31]);
+  K[33] = cons(K[32], s_nil);
+  K[34] = cons(K[25], K[33]);
+  K[35] = cons(S[9], K[34]);
+  K[36] = cons(K[35], s_nil);
+  K[37] = cons(S[8], K[36]);
+  K[38] = cons(S[7], K[37]);
+  aot_define(S[0], make_primitive_argv("square", f_square, 1, 1));
+  aot_define(S[1], make_primitive_argv("fact", f_fact, 1, 1));
+  aot_define(S[2], make_primitive_argv("fib", f_fib, 1, 1));
+  aot_define(S[3], make_primitive_argv("expt-iter", f_expt_2diter, 3, 3));
+  aot_define(S[4], make_primitive_argv("expt", f_expt, 2, 2));
+  aot_define(S[5], make_primitive_argv("length", f_length, 1, 1));
+  t_0(0, NULL);
+  eval(K[38], interp->top_env);
+}
@@ -0,0 +1,36 @@
+; Integer arithmetic, compiled ahead of time by `make aot`.
+
+(define square (lambda (n) (* n n)))
+
+(define fact
+    (lambda (n)
+      (if (eq n 0)
+          1
+          (* n (fact (- n 1))))))
+
+(define fib
+    (lambda (n)
+      (if (eq n 0)
+          0
+          (if (eq n 1)
+              1
+              (+ (fib (- n 1)) (fib (- n 2)))))))
+
+(define expt-iter
+    (lambda (b e acc)
+      (if (eq e 0)
+          acc
+          (expt-iter b (- e 1) (* acc b)))))
+
+(define expt (lambda (b e) (expt-iter b e 1)))
+
+(define length
+    (lambda (l)
+      (if l
+          (+ 1 (length (cdr l)))
+          0)))
+
+(define digits '(0 1 2 3 4 5 6 7 8 9))
+
+; Closures are left to the interpreter.
+(define adder (lambda (n) (lambda (x) (+ x n))))
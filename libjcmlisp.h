@@ -0,0 +1,84 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * The embedding API, built into libjcmlisp.a and libjcmlisp.so.
+ *
+ * A jl_state is an interpreter.  Each call runs it on the calling
+ * thread; a state may move between threads but is used by one at a
+ * time.  Lisp values are held through handles, which keep them from
+ * being collected until released.  Calls that can fail return
+ * JL_NONE, or how far they got, and jl_error says why.
+ */
+
+#include <stdint.h>
+
+typedef struct jl_state jl_state;
+typedef uint32_t jl_handle;
+
+#define JL_NONE 0
+
+/* A C primitive: ARGV's handles last for the call, and the handle it
+ * returns is released for it.  JL_NONE fails the call, with the
+ * message given to jl_set_error, if any. */
+typedef jl_handle jl_primitive(jl_state *jl, int argc, const jl_handle *argv, void *data);
+
+jl_state *jl_new(void);
+void jl_free(jl_state *jl);
+
+/* Why the last call on JL that failed did. */
+const char *jl_error(jl_state *jl);
+void jl_set_error(jl_state *jl, const char *msg);
+
+/* Evaluate the forms in SOURCE; the last one's value. */
+jl_handle jl_eval_string(jl_state *jl, const char *source);
+
+/* The value NAME is bound to at toplevel. */
+jl_handle jl_global(jl_state *jl, const char *name);
+
+jl_handle jl_call(jl_state *jl, jl_handle fn, int argc, const jl_handle *argv);
+
+/* Call FN NCALLS times, the Ith time on the ARGC args from
+ * ARGS[I * ARGC], into RESULTS[I].  Returns how many calls were made
+ * before one failed, which is NCALLS if none did. */
+int jl_call_batch(jl_state *jl, jl_handle fn, int ncalls, int argc,
+                  const jl_handle *args, jl_handle *results);
+
+/* The same with fixnum args and results, so no handles are made. */
+int jl_call_fixnums(jl_state *jl, jl_handle fn, int ncalls, int argc,
+                    const int *args, int *results);
+
+/* Bind NAME at toplevel to FN, which takes MIN_ARGS to MAX_ARGS
+ * args, or any number above MIN_ARGS if MAX_ARGS is -1.  Returns 0
+ * on failure. */
+int jl_define_primitive(jl_state *jl, const char *name, jl_primitive *fn,
+                        int min_args, int max_args, void *data);
+
+jl_handle jl_nil(jl_state *jl);
+jl_handle jl_fixnum(jl_state *jl, int value);
+jl_handle jl_string(jl_state *jl, const char *text);
+jl_handle jl_symbol(jl_state *jl, const char *name);
+jl_handle jl_cons(jl_state *jl, jl_handle car, jl_handle cdr);
+jl_handle jl_car(jl_state *jl, jl_handle cell);
+jl_handle jl_cdr(jl_state *jl, jl_handle cell);
+
+int jl_is_nil(jl_state *jl, jl_handle h);
+int jl_is_fixnum(jl_state *jl, jl_handle h);
+int jl_is_string(jl_state *jl, jl_handle h);
+int jl_is_cell(jl_state *jl, jl_handle h);
+int jl_fixnum_value(jl_state *jl, jl_handle h);
+
+/* The text of a string, valid while H is held. */
+const char *jl_string_value(jl_state *jl, jl_handle h);
+
+/* H's value as print writes it, in a buffer to free. */
+char *jl_print(jl_state *jl, jl_handle h);
+
+jl_handle jl_dup(jl_state *jl, jl_handle h);
+void jl_release(jl_state *jl, jl_handle h);
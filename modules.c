@@ -0,0 +1,13 @@
+/* Generated by jcm-lisp -M.  Do not edit. */
+
+#include "jcm-lisp.h"
+#include "aot.h"
+
+void aot_init_arith();
+void *aot_cache_arith();
+void aot_adopt_arith(void *from);
+
+struct Module preloaded_modules[] = {
+  {"arith", aot_init_arith, aot_cache_arith, aot_adopt_arith},
+  {NULL, NULL, NULL, NULL}
+};
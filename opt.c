@@ -0,0 +1,579 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Source-level optimizer.
+ *
+ * eval() hands each toplevel form here before analyzing it.  The form
+ * is rewritten mostly in place, as macro expansion does: applications
+ * of + - * eq to constants are folded, ifs on constant tests lose
+ * their dead branch, immediately applied lambdas have their constant
+ * args substituted for their params, and calls to small global
+ * procedures are replaced by their bodies.
+ *
+ * Folding and inlining depend on what a global holds now, and any
+ * global can be rebound later, so their results are wrapped in
+ *
+ *   (%guard (((symbol . value) . expected) ...) fast slow)
+ *
+ * which runs FAST while each binding still holds what the optimizer
+ * saw and SLOW, the original form, once one doesn't.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "opt.h"
+
+int optimize_enabled = 1;
+int optimize_dump = 0;
+
+/* Procedures with bigger bodies are called, not inlined. */
+#define INLINE_MAX_SIZE 16
+/* How deep inlining goes into the bodies it inlines. */
+#define INLINE_MAX_DEPTH 4
+
+#define MAX_GUARDS 16
+#define MAX_SUBST  16
+
+/* The variables bound around a form, innermost first. */
+struct Bound {
+  Object *vars;
+  struct Bound *next;
+};
+
+/* Global bindings a rewritten form depends on, and what they held. */
+struct Guards {
+  Object *binding[MAX_GUARDS];
+  Object *expected[MAX_GUARDS];
+  int count;
+};
+
+/* Variables to replace by forms. */
+struct Subst {
+  Object *var[MAX_SUBST];
+  Object *form[MAX_SUBST];
+  int count;
+};
+
+static Object *opt(Object *form, struct Bound *bound, int depth);
+
+static int binds(Object *params, Object *symbol) {
+  for (; is_cell(params); params = cdr(params)) {
+    if (car(params) == symbol)
+      return 1;
+  }
+
+  return params == symbol;
+}
+
+static int is_bound(Object *symbol, struct Bound *bound) {
+  for (; bound != NULL; bound = bound->next) {
+    if (binds(bound->vars, symbol))
+      return 1;
+  }
+
+  return 0;
+}
+
+/* The toplevel binding SYMBOL refers to around a form, if any. */
+static Object *global_binding(Object *symbol, struct Bound *bound) {
+  if (!is_symbol(symbol) || symbol == s_nil || is_bound(symbol, bound))
+    return NULL;
+
+  return assoc(symbol, interp->top_env);
+}
+
+static int add_guard(struct Guards *guards, Object *binding,
+                     Object *expected) {
+  for (int i = 0; i < guards->count; i++) {
+    if (guards->binding[i] == binding)
+      return guards->expected[i] == expected;
+  }
+
+  if (guards->count == MAX_GUARDS)
+    return 0;
+
+  guards->binding[guards->count] = binding;
+  guards->expected[guards->count] = expected;
+  guards->count++;
+  return 1;
+}
+
+/* Is PRIM one of the builtins that can be run at optimize time? */
+static int pure_builtin(Object *prim) {
+  primitive_argv_fn *fn = prim->primitive.argv_fn;
+
+  return (fn == primitive_add || fn == primitive_sub ||
+          fn == primitive_mul || fn == primitive_eq);
+}
+
+/* Is FORM a constant?  Its value goes in *VALUE, and what a folded
+ * constant depends on in GUARDS. */
+static int constant_value(Object *form, Object **value,
+                          struct Guards *guards) {
+  if (form == s_nil || is_fixnum(form) || is_string(form)) {
+    *value = form;
+    return 1;
+  }
+
+  if (!is_cell(form))
+    return 0;
+
+  if (car(form) == s_quote) {
+    *value = cadr(form);
+    return 1;
+  }
+
+  if (car(form) == s_guard &&
+      constant_value(car(cddr(form)), value, guards)) {
+    for (Object *entries = cadr(form); entries != s_nil;
+         entries = cdr(entries)) {
+      if (!add_guard(guards, caar(entries), cdar(entries)))
+        return 0;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Is FORM a constant that depends on nothing? */
+static int plain_constant(Object *form) {
+  struct Guards guards = {.count = 0};
+  Object *value;
+
+  return constant_value(form, &value, &guards) && guards.count == 0;
+}
+
+/* A form that evaluates to VALUE. */
+static Object *quote_value(Object *value) {
+  Object *form = NULL;
+
+  if (value == s_nil || is_fixnum(value) || is_string(value))
+    return value;
+
+  pin_variable((void **)&value);
+  pin_variable((void **)&form);
+
+  form = cons(value, s_nil);
+  form = cons(s_quote, form);
+
+  unpin_variable((void **)&form);
+  unpin_variable((void **)&value);
+
+  return form;
+}
+
+/* FAST, guarded by GUARDS, with SLOW to fall back on. */
+static Object *guarded(struct Guards *guards, Object *fast, Object *slow) {
+  Object *form = NULL;
+  Object *entry = NULL;
+
+  if (guards->count == 0)
+    return fast;
+
+  pin_variable((void **)&fast);
+  pin_variable((void **)&slow);
+  pin_variable((void **)&form);
+  pin_variable((void **)&entry);
+
+  form = cons(slow, s_nil);
+  form = cons(fast, form);
+  form = cons(s_nil, form);
+
+  for (int i = guards->count - 1; i >= 0; i--) {
+    entry = cons(guards->binding[i], guards->expected[i]);
+    setcar(form, cons(entry, car(form)));
+  }
+
+  form = cons(s_guard, form);
+
+  unpin_variable((void **)&entry);
+  unpin_variable((void **)&form);
+  unpin_variable((void **)&slow);
+  unpin_variable((void **)&fast);
+
+  return form;
+}
+
+/* Fold FORM, a call of the primitive in BINDING, if its args are
+ * constants. */
+static Object *fold(Object *form, Object *binding) {
+  Object *prim = cdr(binding);
+  Object *value = NULL;
+  struct Guards guards = {.count = 0};
+  int argc = list_length(cdr(form));
+  int base = interp->value_sp;
+
+  if (!pure_builtin(prim) ||
+      argc < prim->primitive.min_args ||
+      (prim->primitive.max_args >= 0 && argc > prim->primitive.max_args))
+    return form;
+
+  add_guard(&guards, binding, prim);
+
+  for (Object *args = cdr(form); is_cell(args); args = cdr(args)) {
+    if (!constant_value(car(args), &value, &guards) ||
+        (prim->primitive.argv_fn != primitive_eq && !is_fixnum(value))) {
+      interp->value_sp = base;
+      return form;
+    }
+    push_value(value);
+  }
+
+  value = call_primitive(prim, argc, &interp->value_stack[base]);
+  interp->value_sp = base;
+
+  pin_variable((void **)&form);
+  pin_variable((void **)&value);
+
+  value = quote_value(value);
+  value = guarded(&guards, value, form);
+
+  unpin_variable((void **)&value);
+  unpin_variable((void **)&form);
+
+  return value;
+}
+
+/* An if whose test is a constant is just one of its branches. */
+static Object *prune_if(Object *form) {
+  struct Guards guards = {.count = 0};
+  Object *test = NULL;
+
+  if (!constant_value(cadr(form), &test, &guards))
+    return form;
+
+  return guarded(&guards, test != s_nil ? car(cddr(form)) : cadr(cddr(form)),
+                 form);
+}
+
+/* Is SYMBOL assigned anywhere in FORM? */
+static int assigned(Object *form, Object *symbol) {
+  if (!is_cell(form) || car(form) == s_quote)
+    return 0;
+
+  if ((car(form) == s_setq || car(form) == s_define) &&
+      cadr(form) == symbol)
+    return 1;
+
+  if (car(form) == s_guard)
+    form = cddr(form);
+
+  for (; is_cell(form); form = cdr(form)) {
+    if (assigned(car(form), symbol))
+      return 1;
+  }
+
+  return 0;
+}
+
+static Object *substitute(Object *form, struct Subst *subst);
+
+/* Copy of LIST with SUBST applied to each element; the element at
+ * KEEP, if any, is left alone. */
+static Object *substitute_list(Object *list, struct Subst *subst,
+                               int keep) {
+  Object *result = NULL;
+  Object *item = NULL;
+  Object *tail;
+  int i = 0;
+
+  pin_variable((void **)&list);
+  pin_variable((void **)&result);
+  pin_variable((void **)&item);
+
+  result = cons(s_nil, s_nil);
+  tail = result;
+
+  for (; is_cell(list); list = cdr(list), i++) {
+    item = i == keep ? car(list) : substitute(car(list), subst);
+    setcdr(tail, cons(item, s_nil));
+    tail = cdr(tail);
+  }
+  setcdr(tail, list);
+
+  unpin_variable((void **)&item);
+  unpin_variable((void **)&result);
+  unpin_variable((void **)&list);
+
+  return cdr(result);
+}
+
+/* Copy of FORM with the variables in SUBST replaced, minding inner
+ * lambdas that bind the same names. */
+static Object *substitute(Object *form, struct Subst *subst) {
+  struct Subst inner = {.count = 0};
+
+  if (is_symbol(form)) {
+    for (int i = 0; i < subst->count; i++) {
+      if (subst->var[i] == form)
+        return subst->form[i];
+    }
+    return form;
+  }
+
+  if (!is_cell(form) || car(form) == s_quote || subst->count == 0)
+    return form;
+
+  if (car(form) == s_lambda) {
+    for (int i = 0; i < subst->count; i++) {
+      if (!binds(cadr(form), subst->var[i])) {
+        inner.var[inner.count] = subst->var[i];
+        inner.form[inner.count] = subst->form[i];
+        inner.count++;
+      }
+    }
+    return substitute_list(form, &inner, 1);
+  }
+
+  // The guards of a %guard are data.
+  return substitute_list(form, subst, car(form) == s_guard ? 1 : -1);
+}
+
+/* ((lambda (param ...) body ...) arg ...): params that are never
+ * assigned are replaced by their args where those are constants, and
+ * the lambda goes away if nothing is left to bind. */
+static Object *beta_reduce(Object *form, struct Bound *bound, int depth) {
+  Object *lambda = car(form);
+  Object *params = cadr(lambda);
+  Object *args = cdr(form);
+  Object *kept_param[MAX_SUBST];
+  Object *kept_arg[MAX_SUBST];
+  Object *kept_params = s_nil;
+  Object *kept_args = s_nil;
+  Object *result = NULL;
+  struct Subst subst = {.count = 0};
+  int nkept = 0;
+
+  if (!proper_params(params) ||
+      list_length(params) != list_length(args) ||
+      list_length(params) > MAX_SUBST)
+    return form;
+
+  for (; is_cell(params); params = cdr(params), args = cdr(args)) {
+    if (plain_constant(car(args)) && !assigned(cddr(lambda), car(params))) {
+      subst.var[subst.count] = car(params);
+      subst.form[subst.count] = car(args);
+      subst.count++;
+    } else {
+      kept_param[nkept] = car(params);
+      kept_arg[nkept] = car(args);
+      nkept++;
+    }
+  }
+
+  if (subst.count == 0)
+    return form;
+
+  pin_variable((void **)&form);
+  pin_variable((void **)&kept_params);
+  pin_variable((void **)&kept_args);
+  pin_variable((void **)&result);
+
+  result = substitute_list(cddr(lambda), &subst, -1);
+
+  if (nkept == 0 && cdr(result) == s_nil) {
+    result = car(result);
+  } else {
+    for (int i = nkept - 1; i >= 0; i--) {
+      kept_params = cons(kept_param[i], kept_params);
+      kept_args = cons(kept_arg[i], kept_args);
+    }
+    result = cons(kept_params, result);
+    result = cons(s_lambda, result);
+    result = cons(result, kept_args);
+  }
+
+  result = opt(result, bound, depth);
+
+  unpin_variable((void **)&result);
+  unpin_variable((void **)&kept_args);
+  unpin_variable((void **)&kept_params);
+  unpin_variable((void **)&form);
+
+  return result;
+}
+
+/* Size of FORM in cells and atoms, counting no further than is needed
+ * to tell it is too big to inline.  Of a %guard only the fast path
+ * counts. */
+static int form_size(Object *form) {
+  int size = 0;
+
+  if (!is_cell(form))
+    return 1;
+
+  if (car(form) == s_guard)
+    return form_size(car(cddr(form)));
+
+  for (; is_cell(form) && size <= INLINE_MAX_SIZE; form = cdr(form))
+    size += 1 + form_size(car(form));
+
+  return size;
+}
+
+/* Can EXPR, the body of the global procedure named SELF, be copied
+ * to a call site where BOUND is in scope?  It must create no closures,
+ * assign nothing, not be recursive, and have no free variable the site
+ * binds.  *SIMPLE is cleared if it calls anything but pure builtins,
+ * which are added to GUARDS. */
+static int inlinable(Object *expr, Object *self, Object *params,
+                     struct Bound *bound, struct Guards *guards,
+                     int *simple) {
+  Object *binding;
+
+  if (is_symbol(expr)) {
+    if (expr == self)
+      return 0;
+    return expr == s_nil || binds(params, expr) || !is_bound(expr, bound);
+  }
+
+  if (!is_cell(expr) || car(expr) == s_quote)
+    return 1;
+
+  if (car(expr) == s_lambda || car(expr) == s_setq ||
+      car(expr) == s_define || car(expr) == s_defmacro)
+    return 0;
+
+  if (car(expr) == s_guard) {
+    expr = cddr(expr);
+  } else if (car(expr) != s_if) {
+    binding = binds(params, car(expr)) ? NULL : global_binding(car(expr), NULL);
+    // The body was analyzed before this macro was defined.
+    if (binding != NULL && is_macro(cdr(binding)))
+      return 0;
+    if (binding == NULL || !is_primitive(cdr(binding)) ||
+        !pure_builtin(cdr(binding)) ||
+        !add_guard(guards, binding, cdr(binding)))
+      *simple = 0;
+  }
+
+  for (; is_cell(expr); expr = cdr(expr)) {
+    if (!inlinable(car(expr), self, params, bound, guards, simple))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* FORM calls the procedure in BINDING: replace it with the body, if
+ * that is small and captures no variables.  Args are substituted for params, so each
+ * must be a constant, or a variable if the body runs nothing that
+ * could assign it between the call and its use. */
+static Object *inline_call(Object *form, Object *binding,
+                           struct Bound *bound, int depth) {
+  Object *proc = cdr(binding);
+  Object *lambda = proc->proc.lambda->form;
+  Object *params = cadr(lambda);
+  Object *body = cddr(lambda);
+  Object *args = cdr(form);
+  Object *result = NULL;
+  struct Guards guards = {.count = 0};
+  struct Subst subst = {.count = 0};
+  int simple = 1;
+
+  if (depth >= INLINE_MAX_DEPTH || proc->proc.env != s_nil ||
+      !proper_params(params) ||
+      !is_cell(body) || cdr(body) != s_nil ||
+      list_length(params) != list_length(args) ||
+      list_length(params) > MAX_SUBST ||
+      form_size(car(body)) > INLINE_MAX_SIZE)
+    return form;
+
+  add_guard(&guards, binding, proc);
+
+  if (!inlinable(car(body), car(form), params, bound, &guards, &simple))
+    return form;
+
+  for (; is_cell(params); params = cdr(params), args = cdr(args)) {
+    Object *arg = car(args);
+
+    if (!plain_constant(arg) &&
+        !(simple && is_symbol(arg) &&
+          (is_bound(arg, bound) || assoc(arg, interp->top_env) != NULL)))
+      return form;
+
+    subst.var[subst.count] = car(params);
+    subst.form[subst.count] = arg;
+    subst.count++;
+  }
+
+  pin_variable((void **)&form);
+  pin_variable((void **)&result);
+
+  result = substitute(car(body), &subst);
+  result = opt(result, bound, depth + 1);
+  result = guarded(&guards, result, form);
+
+  unpin_variable((void **)&result);
+  unpin_variable((void **)&form);
+
+  return result;
+}
+
+static Object *opt(Object *form, struct Bound *bound, int depth) {
+  Object *head, *binding, *macro;
+  struct Bound inner;
+
+  if (!is_cell(form))
+    return form;
+
+  head = car(form);
+
+  if (head == s_quote || head == s_defmacro)
+    return form;
+
+  // Inlined code may have become foldable; the slow path stays as is.
+  if (head == s_guard) {
+    pin_variable((void **)&form);
+    setcar(cddr(form), opt(car(cddr(form)), bound, depth));
+    unpin_variable((void **)&form);
+    return form;
+  }
+
+  if (is_symbol(head) && !is_bound(head, bound) &&
+      (macro = global_macro(head)) != NULL)
+    return opt(expand_call(form, macro), bound, depth);
+
+  pin_variable((void **)&form);
+
+  if (head == s_lambda) {
+    inner.vars = cadr(form);
+    inner.next = bound;
+    for (Object *cell = cddr(form); is_cell(cell); cell = cdr(cell))
+      setcar(cell, opt(car(cell), &inner, depth));
+  } else if (head == s_define || head == s_setq) {
+    if (is_cell(cddr(form)))
+      setcar(cddr(form), opt(car(cddr(form)), bound, depth));
+  } else {
+    for (Object *cell = form; is_cell(cell); cell = cdr(cell))
+      setcar(cell, opt(car(cell), bound, depth));
+
+    if (head == s_if) {
+      form = prune_if(form);
+    } else if (is_cell(car(form)) && caar(form) == s_lambda) {
+      form = beta_reduce(form, bound, depth);
+    } else if ((binding = global_binding(car(form), bound)) != NULL) {
+      if (is_primitive(cdr(binding)))
+        form = fold(form, binding);
+      else if (is_proc(cdr(binding)))
+        form = inline_call(form, binding, bound, depth);
+    }
+  }
+
+  unpin_variable((void **)&form);
+
+  return form;
+}
+
+/* FORM, optimized.  Its structure may be reused. */
+Object *optimize(Object *form) {
+  return opt(form, NULL, 0);
+}
@@ -0,0 +1,15 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Cleared by -N to evaluate forms as written; -D prints each
+ * optimized form. */
+extern int optimize_enabled;
+extern int optimize_dump;
+
+Object *optimize(Object *form);
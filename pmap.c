@@ -0,0 +1,458 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Parallel map.
+ *
+ * (pmap f list) calls F on each element of LIST across a pool of
+ * threads, started the first time it is used, and returns the list of
+ * results in order.  (pfor-each f list) does the same for effect.
+ * The caller's thread works through the list too, taking a few
+ * elements at a time alongside the workers.
+ *
+ * Each worker is an Interp of its own that shares its owner's heap:
+ * the same objects, symbols and toplevel, but its own pins and value
+ * stack.  To allocate, a thread takes a run of TLAB_SIZE heap slots
+ * at a time, under the heap lock, and allocates from it alone.  When
+ * the heap runs out, the thread that noticed stops the others at
+ * their next allocation, a safepoint, and collects with every
+ * thread's stacks as roots.  A thread that isn't running Lisp, such
+ * as one waiting for work, doesn't count.
+ *
+ * F may do anything but load code or start another pmap.  Call sites
+ * and bodies are specialized as F runs, which any thread may do;
+ * the specializations check themselves, so a race only costs a
+ * fallback.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "aot.h"
+#include "printer.h"
+#include "trace.h"
+#include "pmap.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Each worker gets as much stack as the main thread. */
+#define WORKER_STACK_SIZE (8 << 20)
+
+int pmap_workers = -1;
+
+struct Job {
+  Object *fn;
+  Object **items;      /* on the caller's value stack */
+  Object **results;    /* likewise, or NULL to drop them */
+  int count;
+  int chunk;           /* items taken at a time */
+  int next;            /* first item not yet taken */
+  int failed;          /* an item raised an error */
+};
+
+struct Workers {
+  pthread_mutex_t lock;
+  pthread_cond_t work;     /* a job was posted, or the pool is closing */
+  pthread_cond_t parked;   /* a thread stopped or left */
+  pthread_cond_t resume;   /* a collection is done */
+  pthread_cond_t done;     /* a worker finished its part of the job */
+
+  int count;
+  pthread_t *threads;
+  Interp **interps;
+  void **module_caches;
+
+  struct Job *job;
+  long posted;             /* jobs posted so far */
+  int busy;                /* workers still on the job */
+  int running;             /* threads running Lisp on the heap */
+  int stopped;             /* of those, waiting out a collection */
+  int stopping;            /* a collection is waiting for them */
+  int closing;
+};
+
+/* Wait out a collection, with the lock held. */
+static void park(struct Workers *w) {
+  w->stopped++;
+  pthread_cond_signal(&w->parked);
+
+  while (w->stopping)
+    pthread_cond_wait(&w->resume, &w->lock);
+
+  w->stopped--;
+}
+
+void safepoint() {
+  struct Workers *w = interp->owner->workers;
+
+  if (!__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->stopping)
+    park(w);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* Stop every other thread running on the heap, for the caller to
+ * collect, and keep the lock until start_world().  Returns 0 instead
+ * if another thread collected while this one waited. */
+int stop_world() {
+  struct Workers *w = interp->owner->workers;
+
+  pthread_mutex_lock(&w->lock);
+
+  if (w->stopping) {
+    park(w);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+  }
+
+  __atomic_store_n(&w->stopping, 1, __ATOMIC_RELEASE);
+  while (w->stopped < w->running - 1)
+    pthread_cond_wait(&w->parked, &w->lock);
+
+  return 1;
+}
+
+void start_world() {
+  struct Workers *w = interp->owner->workers;
+
+  __atomic_store_n(&w->stopping, 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&w->resume);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* Guard the owner's shared lists, if other threads are running.
+ * Nothing may be allocated while it is held. */
+void lock_heap() {
+  struct Workers *w = interp->owner->workers;
+
+  if (!interp->parallel)
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->stopping)
+    park(w);
+}
+
+void unlock_heap() {
+  if (interp->parallel)
+    pthread_mutex_unlock(&interp->owner->workers->lock);
+}
+
+void for_each_worker(void (*fn)(Interp *)) {
+  struct Workers *w = interp->owner->workers;
+
+  for (int i = 0; w != NULL && i < w->count; i++)
+    fn(w->interps[i]);
+}
+
+/* Give back what is left of this thread's slots, if no one has taken
+ * any since; otherwise they wait for the next sweep. */
+static void release_tlab() {
+  if (interp->tlab_end == interp->owner->next_free)
+    interp->owner->next_free = interp->tlab_next;
+
+  interp->tlab_next = interp->tlab_end = 0;
+}
+
+/* Start running Lisp alongside the others, with the lock held. */
+static void enter(struct Workers *w) {
+  while (w->stopping)
+    pthread_cond_wait(&w->resume, &w->lock);
+
+  release_tlab();
+  interp->parallel = 1;
+  w->running++;
+}
+
+/* Stop, with the lock held. */
+static void leave(struct Workers *w) {
+  release_tlab();
+  interp->parallel = 0;
+  w->running--;
+  pthread_cond_signal(&w->parked);
+}
+
+/* Call the job's function on items until there are none left. */
+static void work_on(struct Job *job) {
+  jmp_buf *outer = interp->error_handler;
+  jmp_buf handler;
+  int pins = save_pins();
+  int base = interp->value_sp;
+
+  interp->error_handler = &handler;
+
+  if (setjmp(handler)) {
+    restore_pins(pins);
+    interp->value_sp = base;
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    interp->error_handler = outer;
+    return;
+  }
+
+  for (;;) {
+    int i = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+    int end = i + job->chunk < job->count ? i + job->chunk : job->count;
+
+    if (i >= job->count || __atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+      break;
+
+    for (; i < end; i++) {
+      Object *result = call_value(job->fn, 1, &job->items[i]);
+
+      if (job->results != NULL)
+        job->results[i] = result;
+    }
+  }
+
+  interp->error_handler = outer;
+}
+
+static void *run_worker(void *arg) {
+  Interp *self = arg;
+  struct Workers *w = self->owner->workers;
+  long seen = 0;
+
+  interp = self;
+  adopt_modules(w->module_caches);
+
+  pthread_mutex_lock(&w->lock);
+
+  for (;;) {
+    while (!w->closing && w->posted == seen)
+      pthread_cond_wait(&w->work, &w->lock);
+
+    if (w->closing)
+      break;
+
+    seen = w->posted;
+    struct Job *job = w->job;
+
+    enter(w);
+    pthread_mutex_unlock(&w->lock);
+
+    work_on(job);
+    port_flush(interp->out);
+    fflush(stdout);
+    trace_flush();
+
+    pthread_mutex_lock(&w->lock);
+    leave(w);
+    if (--w->busy == 0)
+      pthread_cond_signal(&w->done);
+  }
+
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* A worker for OWNER: its heap, symbols and toplevel, with stacks
+ * of its own. */
+static Interp *new_worker(Interp *owner) {
+  Interp *in = malloc(sizeof(Interp));
+  assert(in != NULL);
+
+  // Everything up to the stacks, then make the rest its own.
+  memcpy(in, owner, offsetof(Interp, pins));
+  in->owner = owner;
+  in->workers = NULL;
+  in->parallel = 0;
+  in->tlab_next = in->tlab_end = 0;
+  in->pv_count = 0;
+  in->value_sp = 0;
+  in->eval_depth = 0;
+  in->error_handler = NULL;
+  in->symbols = NULL;
+  in->trace = NULL;
+  in->print_state = NULL;
+  in->tasks = NULL;
+  in->api = NULL;
+  in->allocs = NULL;
+  in->perf = NULL;
+  memset(&in->counters, 0, sizeof(Counters));
+
+  // Output of its own, flushed as each job ends.
+  in->out = calloc(1, sizeof(OutPort));
+  assert(in->out != NULL);
+
+  return in;
+}
+
+static struct Workers *start_workers() {
+  struct Workers *w = calloc(1, sizeof(struct Workers));
+  pthread_attr_t attr;
+  int count = pmap_workers;
+
+  assert(w != NULL);
+
+  if (count < 0) {
+    count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    // Even on one core, so pmap is always exercised.
+    if (count < 1)
+      count = 1;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->parked, NULL);
+  pthread_cond_init(&w->resume, NULL);
+  pthread_cond_init(&w->done, NULL);
+
+  w->threads = calloc(count > 0 ? count : 1, sizeof(pthread_t));
+  w->interps = calloc(count > 0 ? count : 1, sizeof(Interp *));
+  assert(w->threads != NULL && w->interps != NULL);
+  w->module_caches = module_caches();
+  interp->workers = w;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+  for (int i = 0; i < count; i++) {
+    w->interps[i] = new_worker(interp);
+    if (pthread_create(&w->threads[i], &attr, run_worker, w->interps[i]) != 0) {
+      free(w->interps[i]);
+      break;
+    }
+    w->count++;
+  }
+
+  pthread_attr_destroy(&attr);
+  return w;
+}
+
+void stop_workers(Interp *in) {
+  struct Workers *w = in->workers;
+
+  if (w == NULL)
+    return;
+
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+
+  for (int i = 0; i < w->count; i++) {
+    pthread_join(w->threads[i], NULL);
+    if (w->interps[i]->trace != NULL)
+      port_flush(w->interps[i]->trace);
+    free(w->interps[i]->out);
+    free(w->interps[i]->trace);
+    free(w->interps[i]->print_state);
+    free_perf(w->interps[i]);
+    free(w->interps[i]);
+  }
+
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->work);
+  pthread_cond_destroy(&w->parked);
+  pthread_cond_destroy(&w->resume);
+  pthread_cond_destroy(&w->done);
+  free(w->threads);
+  free(w->interps);
+  for (void **cache = w->module_caches; cache != NULL && *cache != NULL; cache++)
+    free(*cache);
+  free(w->module_caches);
+  free(w);
+  in->workers = NULL;
+}
+
+/* Run FN on each item of LIST, on the pool, and return the list of
+ * results if COLLECT is set. */
+static Object *parallel_map(Object *fn, Object *list, int collect) {
+  struct Workers *w = interp->workers;
+  struct Job job;
+  int base = interp->value_sp;
+  int count = 0;
+  Object *result = s_nil;
+
+  if (interp->parallel || interp->owner != interp)
+    error("pmap can't run inside pmap");
+
+  for (Object *cell = list; is_cell(cell); cell = cdr(cell))
+    count++;
+
+  if (base + 2 * count > VALUE_STACK_SIZE)
+    error("Value stack overflow");
+
+  // Items and results stay on the value stack, where every thread's
+  // collections see them.
+  for (Object *cell = list; is_cell(cell); cell = cdr(cell))
+    push_value(car(cell));
+  for (int i = 0; collect && i < count; i++)
+    push_value(s_nil);
+
+  job.fn = fn;
+  job.items = &interp->value_stack[base];
+  job.results = collect ? &interp->value_stack[base + count] : NULL;
+  job.count = count;
+  job.next = 0;
+  job.failed = 0;
+
+  if (w == NULL && count > 1)
+    w = start_workers();
+
+  if (w == NULL || w->count == 0 || count <= 1) {
+    job.chunk = count;
+    work_on(&job);
+  } else {
+    job.chunk = count / (4 * (w->count + 1));
+    if (job.chunk < 1)
+      job.chunk = 1;
+
+    // What was printed before comes first.
+    port_flush(interp->out);
+    fflush(stdout);
+
+    pthread_mutex_lock(&w->lock);
+    w->job = &job;
+    w->posted++;
+    w->busy = w->count;
+    enter(w);
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    work_on(&job);
+
+    pthread_mutex_lock(&w->lock);
+    leave(w);
+    while (w->busy > 0)
+      pthread_cond_wait(&w->done, &w->lock);
+    w->job = NULL;
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  if (job.failed) {
+    // The error has been reported; pass it on.
+    interp->value_sp = base;
+    if (interp->error_handler != NULL)
+      longjmp(*interp->error_handler, 1);
+    exit(0);
+  }
+
+  if (collect) {
+    pin_variable((void **)&result);
+    for (int i = count - 1; i >= 0; i--)
+      result = cons(job.results[i], result);
+    unpin_variable((void **)&result);
+  }
+
+  interp->value_sp = base;
+  return result;
+}
+
+Object *prim_pmap(int argc, Object **argv) {
+  return parallel_map(argv[0], argv[1], 1);
+}
+
+Object *prim_pfor_each(int argc, Object **argv) {
+  return parallel_map(argv[0], argv[1], 0);
+}
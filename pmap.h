@@ -0,0 +1,30 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Heap slots each of pmap's threads takes to allocate from at a time. */
+#define TLAB_SIZE 64
+
+/* Collections a thread under pmap tries before it is out of memory. */
+#define PARALLEL_GC_TRIES 8
+
+/* Threads pmap runs on besides its caller's; -1 for one per core
+ * less the caller's.  Set by -P. */
+extern int pmap_workers;
+
+Object *prim_pmap(int argc, Object **argv);
+Object *prim_pfor_each(int argc, Object **argv);
+void stop_workers(Interp *in);
+
+/* What the collector needs while workers share the heap. */
+void safepoint();
+int stop_world();
+void start_world();
+void lock_heap();
+void unlock_heap();
+void for_each_worker(void (*fn)(Interp *));
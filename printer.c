@@ -0,0 +1,319 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Printer.
+ *
+ * Objects are formatted into an output port's buffer, which goes to
+ * stdio whole when it fills or is flushed, rather than through a
+ * printf per atom.  Lists are walked with an explicit stack, so deep
+ * nesting can't overflow the C stack.
+ *
+ * Before writing, a depth-first pass over the cells finds those that
+ * are reached again while still being walked (cycles), and, if asked,
+ * those reached again at all (sharing).  They get #n= the first time
+ * they are written and #n# after that.  Every object comes from the
+ * fixed pool, so the pass keeps its state in tables indexed by id.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "printer.h"
+
+enum { UNSEEN, ON_PATH, DONE };
+
+/* Each interpreter has its own, since ids are only unique within one. */
+struct PrintState {
+  unsigned char state[MAX_ALLOC_SIZE + 1];
+  int label[MAX_ALLOC_SIZE + 1];     /* -1: wants one; n: #n */
+  int touched[MAX_ALLOC_SIZE];
+  int ntouched;
+
+  /* The walk: each cell entered pushes at most three. */
+  struct {
+    Object *obj;
+    int leave;
+  } walk[3 * MAX_ALLOC_SIZE + 1];
+
+  /* Tails of the lists being written, innermost last.  Each is the tail
+   * of a different cell, so there can't be more than the pool holds.
+   * any_shared uses it first, for the cars still to look at. */
+  Object *tails[MAX_ALLOC_SIZE + 1];
+};
+
+static struct PrintState *print_state() {
+  if (interp->print_state == NULL) {
+    interp->print_state = calloc(1, sizeof(struct PrintState));
+    assert(interp->print_state != NULL);
+  }
+
+  return interp->print_state;
+}
+
+void port_flush(OutPort *p) {
+  if (p->out == NULL)
+    p->out = stdout;
+
+  if (p->len > 0)
+    fwrite(p->buf, 1, p->len, p->out);
+  p->len = 0;
+}
+
+void port_write(OutPort *p, const char *s, size_t n) {
+  if (n > OUT_BUFFER_SIZE - p->len) {
+    port_flush(p);
+
+    // Too big to be worth copying.
+    if (n >= OUT_BUFFER_SIZE) {
+      fwrite(s, 1, n, p->out);
+      return;
+    }
+  }
+
+  memcpy(p->buf + p->len, s, n);
+  p->len += n;
+}
+
+void port_puts(OutPort *p, const char *s) {
+  port_write(p, s, strlen(s));
+}
+
+static inline void put(OutPort *p, char c) {
+  if (p->len == OUT_BUFFER_SIZE)
+    port_flush(p);
+
+  p->buf[p->len++] = c;
+}
+
+/* Append N bytes, which fit in any buffer. */
+static inline void put_small(OutPort *p, const char *s, size_t n) {
+  if (n > OUT_BUFFER_SIZE - p->len)
+    port_flush(p);
+
+  memcpy(p->buf + p->len, s, n);
+  p->len += n;
+}
+
+static const char digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+/* Format N two digits at a time. */
+static inline void put_int(OutPort *p, long n) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *s = end;
+  unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+
+  while (u >= 100) {
+    s -= 2;
+    memcpy(s, digit_pairs + (u % 100) * 2, 2);
+    u /= 100;
+  }
+
+  if (u >= 10) {
+    s -= 2;
+    memcpy(s, digit_pairs + u * 2, 2);
+  } else {
+    *--s = '0' + u;
+  }
+
+  if (n < 0)
+    *--s = '-';
+
+  put_small(p, s, end - s);
+}
+
+static int tracked(Object *obj) {
+  return obj != NULL && obj->type == CELL &&
+         obj->id > 0 && obj->id <= MAX_ALLOC_SIZE;
+}
+
+static void forget_cells(struct PrintState *ps) {
+  for (int i = 0; i < ps->ntouched; i++) {
+    ps->state[ps->touched[i]] = UNSEEN;
+    ps->label[ps->touched[i]] = 0;
+  }
+  ps->ntouched = 0;
+}
+
+/* Is any cell under ROOT reached twice?  Most printed data is a tree,
+ * which this shows more cheaply than find_labels: each list is
+ * followed down its cdrs, and only cars that are lists are saved. */
+static int any_shared(struct PrintState *ps, Object *root) {
+  int top = 0;
+
+  ps->tails[top++] = root;
+
+  while (top > 0) {
+    for (Object *obj = ps->tails[--top]; tracked(obj); obj = obj->cell.cdr) {
+      if (ps->state[obj->id] != UNSEEN)
+        return 1;
+
+      ps->state[obj->id] = DONE;
+      ps->touched[ps->ntouched++] = obj->id;
+
+      if (tracked(obj->cell.car))
+        ps->tails[top++] = obj->cell.car;
+    }
+  }
+
+  return 0;
+}
+
+/* Mark the cells under ROOT that need a label. */
+static void find_labels(struct PrintState *ps, Object *root, int shared) {
+  int top = 0;
+
+  if (!any_shared(ps, root))
+    return;
+  forget_cells(ps);
+
+  ps->walk[top].obj = root;
+  ps->walk[top++].leave = 0;
+
+  while (top > 0) {
+    Object *obj = ps->walk[--top].obj;
+
+    if (ps->walk[top].leave) {
+      ps->state[obj->id] = DONE;
+      continue;
+    }
+
+    if (!tracked(obj))
+      continue;
+
+    if (ps->state[obj->id] == ON_PATH || (ps->state[obj->id] == DONE && shared)) {
+      ps->label[obj->id] = -1;
+      continue;
+    }
+
+    if (ps->state[obj->id] == DONE)
+      continue;
+
+    ps->state[obj->id] = ON_PATH;
+    ps->touched[ps->ntouched++] = obj->id;
+
+    ps->walk[top].obj = obj;
+    ps->walk[top++].leave = 1;
+    ps->walk[top].obj = obj->cell.cdr;
+    ps->walk[top++].leave = 0;
+    ps->walk[top].obj = obj->cell.car;
+    ps->walk[top++].leave = 0;
+  }
+}
+
+static void write_atom(OutPort *p, Object *obj) {
+  if (obj == NULL) {
+    port_puts(p, "NULL OBJECT\n");
+    return;
+  }
+
+  switch (obj->type) {
+    case FIXNUM:
+      put_int(p, obj->num.value);
+      break;
+    case STRING:
+      put(p, '"');
+      port_puts(p, obj->str.text);
+      put(p, '"');
+      break;
+    case SYMBOL:
+      port_puts(p, obj->symbol.name);
+      break;
+    case PRIMITIVE:
+      port_puts(p, "<PRIM>");
+      break;
+    case PROC:
+      port_puts(p, "<PROC>");
+      break;
+    case CODE:
+      port_puts(p, "<CODE>");
+      break;
+    case MACRO:
+      port_puts(p, "<MACRO>");
+      break;
+    case PORT:
+      port_puts(p, "<PORT>");
+      break;
+    case CHANNEL:
+      port_puts(p, "<CHANNEL>");
+      break;
+    default:
+      port_puts(p, "\nPrint Unknown Object - type? ");
+      put_int(p, obj->type);
+      put(p, '\n');
+      break;
+  }
+}
+
+/* Is the tail REST written as ". rest" rather than spliced in? */
+static int dotted(struct PrintState *ps, Object *rest) {
+  return !is_cell(rest) || (tracked(rest) && ps->label[rest->id] != 0);
+}
+
+void write_object(OutPort *p, Object *obj, int shared) {
+  struct PrintState *ps = print_state();
+  int depth = 0;
+  int labels = 0;
+
+  find_labels(ps, obj, shared);
+
+  for (;;) {
+    if (tracked(obj) && ps->label[obj->id] > 0) {
+      put(p, '#');
+      put_int(p, ps->label[obj->id]);
+      put(p, '#');
+    } else if (is_cell(obj)) {
+      if (tracked(obj) && ps->label[obj->id] < 0) {
+        ps->label[obj->id] = ++labels;
+        put(p, '#');
+        put_int(p, labels);
+        put(p, '=');
+      }
+
+      put(p, '(');
+      ps->tails[depth++] = obj->cell.cdr;
+      obj = obj->cell.car;
+      continue;
+    } else {
+      write_atom(p, obj);
+    }
+
+    // OBJ is written: carry on with the innermost unfinished list.
+    for (;;) {
+      if (depth == 0)
+        goto done;
+
+      Object *rest = ps->tails[depth - 1];
+
+      if (rest == s_nil || rest == NULL) {
+        put(p, ')');
+        depth--;
+        continue;
+      }
+
+      put(p, ' ');
+      if (dotted(ps, rest)) {
+        put_small(p, ". ", 2);
+        ps->tails[depth - 1] = s_nil;
+        obj = rest;
+      } else {
+        ps->tails[depth - 1] = rest->cell.cdr;
+        obj = rest->cell.car;
+      }
+      break;
+    }
+  }
+
+done:
+  forget_cells(ps);
+}
@@ -0,0 +1,25 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+#define OUT_BUFFER_SIZE 65536
+
+/* Output collected in BUF and handed to OUT a buffer at a time. */
+typedef struct OutPort {
+  FILE *out;
+  size_t len;
+  char buf[OUT_BUFFER_SIZE];
+} OutPort;
+
+void port_write(OutPort *p, const char *s, size_t n);
+void port_puts(OutPort *p, const char *s);
+void port_flush(OutPort *p);
+
+/* Write OBJ to P.  Cycles are always written with #n= and #n# labels;
+ * other structure reached more than once is too if SHARED is set. */
+void write_object(OutPort *p, Object *obj, int shared);
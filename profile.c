@@ -0,0 +1,631 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Sampling profiler.
+ *
+ * Each execute() on the C stack has a slot in Interp.procs, by depth,
+ * naming the procedure it has called into, or NULL while it is still
+ * running its caller's code.  A call only stores the callee's name in
+ * its frame's slot, so keeping this up costs next to nothing whether
+ * or not anything is profiling.
+ *
+ * While a profile runs, SIGPROF arrives every so often of CPU time and
+ * the handler copies the names of whatever thread it interrupts into
+ * a buffer, innermost first.  Names are symbols, which are never
+ * collected, so the buffer can be read long after the code that made
+ * it is gone.  Time in builtins, the collector and compiled modules
+ * counts towards the Lisp procedure that called them.
+ *
+ * profile_stop folds the samples into one line per distinct stack, the
+ * format flamegraph.pl reads, and prints each procedure's self time,
+ * when it was innermost, and total time, when it was anywhere on the
+ * stack.
+ *
+ * An allocation profile instead samples one in so many of the objects
+ * a heap's threads allocate, noting the procedure that allocated each
+ * in a table by heap slot.  What it holds, a string's text say, is
+ * only filled in once new_Object has returned, so each collection
+ * first settles the samples since the last into sites, by procedure
+ * and type.  Marking credits a sampled object to the root it was
+ * first reached from, a global by name or one of the stacks, and
+ * sweeping counts it as surviving or gone.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "profile.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+Object profile_task_root;
+char *profile_path = NULL;
+int alloc_profile_every = 0;
+
+/* A sample is a header word, then its names.  Zero ends the buffer. */
+#define SAMPLE(count, flags) (1 | (uintptr_t)(count) << 3 | (flags))
+#define SAMPLE_IN_TASK  2
+#define SAMPLE_CUT      4
+#define SAMPLE_COUNT(header) ((header) >> 3)
+
+static uintptr_t *samples;
+static int used;
+static int dropped;
+static int interval;
+static struct sigaction old_action;
+
+static void take_sample(int sig) {
+  Interp *in = interp;
+  Object *names[PROFILE_DEPTH];
+  uintptr_t flags = 0;
+  int n = 0;
+  int at;
+
+  if (in == NULL || samples == NULL)
+    return;
+
+  for (int i = in->eval_depth - 1; i >= 0; i--) {
+    Object *name = in->procs[i];
+
+    if (name == NULL)
+      continue;
+    if (name == PROFILE_TASK) {
+      flags |= SAMPLE_IN_TASK;
+      break;
+    }
+    if (n == PROFILE_DEPTH) {
+      flags |= SAMPLE_CUT;
+      break;
+    }
+    names[n++] = name;
+  }
+
+  // Threads under pmap may take samples at once.
+  at = __atomic_fetch_add(&used, n + 1, __ATOMIC_RELAXED);
+  if (at + n + 1 > PROFILE_BUFFER) {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  for (int i = 0; i < n; i++)
+    samples[at + 1 + i] = (uintptr_t)names[i];
+  samples[at] = SAMPLE(n, flags);
+}
+
+int profile_start(int interval_us) {
+  struct sigaction action;
+  struct itimerval timer;
+
+  if (samples != NULL)
+    return 0;
+
+  samples = calloc(PROFILE_BUFFER, sizeof(uintptr_t));
+  assert(samples != NULL);
+  used = 0;
+  dropped = 0;
+  interval = interval_us;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = take_sample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &old_action);
+
+  timer.it_interval.tv_sec = interval_us / 1000000;
+  timer.it_interval.tv_usec = interval_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  return 1;
+}
+
+struct Total {
+  char *name;
+  int self;
+  int total;
+  int seen;              /* the last sample it was counted in */
+};
+
+/* Totals by name, open addressed on the name's address. */
+struct Totals {
+  struct Total *slots;
+  int size;
+  int count;
+};
+
+static struct Total *total_of(struct Totals *t, char *name) {
+  if (2 * (t->count + 1) > t->size) {
+    struct Totals bigger = { NULL, t->size > 0 ? 2 * t->size : 256, 0 };
+
+    bigger.slots = calloc(bigger.size, sizeof(struct Total));
+    assert(bigger.slots != NULL);
+    for (int i = 0; i < t->size; i++) {
+      if (t->slots[i].name != NULL)
+        *total_of(&bigger, t->slots[i].name) = t->slots[i];
+    }
+    free(t->slots);
+    *t = bigger;
+  }
+
+  unsigned int i = ((uintptr_t)name >> 3) * 2654435761u & (t->size - 1);
+  while (t->slots[i].name != NULL && t->slots[i].name != name)
+    i = (i + 1) & (t->size - 1);
+
+  if (t->slots[i].name == NULL) {
+    t->slots[i].name = name;
+    t->slots[i].seen = -1;
+    t->count++;
+  }
+  return &t->slots[i];
+}
+
+static int by_self(const void *a, const void *b) {
+  const struct Total *x = a, *y = b;
+
+  if (x->self != y->self)
+    return y->self - x->self;
+  return y->total - x->total;
+}
+
+static int by_text(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/* Sample S's stack, outermost first, separated by semicolons. */
+static char *fold(uintptr_t *s) {
+  int n = SAMPLE_COUNT(*s);
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&text, &len);
+
+  assert(out != NULL);
+  fputs(*s & SAMPLE_IN_TASK ? "task" : "toplevel", out);
+  if (*s & SAMPLE_CUT)
+    fputs(";...", out);
+  for (int i = n; i > 0; i--)
+    fprintf(out, ";%s", ((Object *)s[i])->symbol.name);
+  fclose(out);
+
+  return text;
+}
+
+/* Print the table, and fold the stacks into FOLDED if it is given.
+ * Returns the samples there were. */
+static int report(FILE *folded) {
+  struct Totals totals = { NULL, 0, 0 };
+  char **stacks;
+  int nsamples = 0;
+  int end = used < PROFILE_BUFFER ? used : PROFILE_BUFFER;
+
+  for (int at = 0; at < end && samples[at] != 0; at += SAMPLE_COUNT(samples[at]) + 1)
+    nsamples++;
+
+  stacks = calloc(nsamples > 0 ? nsamples : 1, sizeof(char *));
+  assert(stacks != NULL);
+
+  for (int at = 0, k = 0; k < nsamples; at += SAMPLE_COUNT(samples[at]) + 1, k++) {
+    uintptr_t *s = &samples[at];
+    int n = SAMPLE_COUNT(*s);
+    struct Total *t;
+
+    if (n == 0) {
+      t = total_of(&totals, *s & SAMPLE_IN_TASK ? "task" : "toplevel");
+      t->self++;
+      t->total++;
+    }
+
+    for (int i = 1; i <= n; i++) {
+      t = total_of(&totals, ((Object *)s[i])->symbol.name);
+      if (i == 1)
+        t->self++;
+      // Recursion counts once towards the total.
+      if (t->seen != k) {
+        t->seen = k;
+        t->total++;
+      }
+    }
+
+    if (folded != NULL)
+      stacks[k] = fold(s);
+  }
+
+  if (folded != NULL) {
+    qsort(stacks, nsamples, sizeof(char *), by_text);
+    for (int i = 0; i < nsamples; ) {
+      int j = i + 1;
+
+      while (j < nsamples && strcmp(stacks[i], stacks[j]) == 0)
+        j++;
+      fprintf(folded, "%s %d\n", stacks[i], j - i);
+      i = j;
+    }
+    for (int i = 0; i < nsamples; i++)
+      free(stacks[i]);
+  }
+  free(stacks);
+
+  // Gather the names at the front to sort them.
+  int count = 0;
+  for (int i = 0; i < totals.size; i++) {
+    if (totals.slots[i].name != NULL)
+      totals.slots[count++] = totals.slots[i];
+  }
+  if (count > 0)
+    qsort(totals.slots, count, sizeof(struct Total), by_self);
+
+  printf("\nProfile: %d samples, %d us apart", nsamples, interval);
+  if (dropped > 0)
+    printf(", %d dropped", dropped);
+  printf("\n%7s %7s  %s\n", "self", "total", "procedure");
+  for (int i = 0; i < count && i < PROFILE_TOP; i++)
+    printf("%6.1f%% %6.1f%%  %s\n",
+           100.0 * totals.slots[i].self / nsamples,
+           100.0 * totals.slots[i].total / nsamples,
+           totals.slots[i].name);
+
+  free(totals.slots);
+  return nsamples;
+}
+
+int profile_stop(FILE *folded) {
+  struct itimerval timer;
+  int nsamples;
+
+  if (samples == NULL)
+    return -1;
+
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  sigaction(SIGPROF, &old_action, NULL);
+
+  nsamples = report(folded);
+
+  free(samples);
+  samples = NULL;
+  return nsamples;
+}
+
+Object *prim_profile_start(int argc, Object **argv) {
+  int interval_us = PROFILE_INTERVAL_US;
+
+  if (argc > 0) {
+    if (!is_fixnum(argv[0]) || argv[0]->num.value <= 0)
+      error("profile-start needs an interval in microseconds");
+    interval_us = argv[0]->num.value;
+  }
+
+  if (!profile_start(interval_us))
+    error("A profile is already running");
+
+  return s_nil;
+}
+
+Object *prim_profile_stop(int argc, Object **argv) {
+  FILE *folded = NULL;
+  int nsamples;
+
+  if (samples == NULL)
+    error("No profile is running");
+
+  if (argc > 0) {
+    if (!is_string(argv[0]))
+      error("profile-stop needs a file name");
+    folded = fopen(argv[0]->str.text, "w");
+    if (folded == NULL) {
+      char *buff = NULL;
+      asprintf(&buff, "Can't write %s", argv[0]->str.text);
+      error(buff);
+    }
+  }
+
+  nsamples = profile_stop(folded);
+  if (folded != NULL)
+    fclose(folded);
+
+  return make_fixnum(nsamples);
+}
+
+/* The procedure running on this thread, innermost first. */
+static char *current_procedure() {
+  for (int i = interp->eval_depth - 1; i >= 0; i--) {
+    Object *name = interp->procs[i];
+
+    if (name == PROFILE_TASK)
+      return "task";
+    if (name != NULL)
+      return name->symbol.name;
+  }
+
+  return "toplevel";
+}
+
+struct Site {
+  char *procedure;
+  char *type;            /* as get_type names it */
+  long objects;          /* sampled */
+  long bytes;
+  long survived;         /* lived through a collection */
+  long live;
+};
+
+struct Tracked {
+  char *procedure;       /* NULL if the slot isn't sampled */
+  int site;              /* index in sites, or -1 until settled */
+  int survived;
+};
+
+struct AllocProfile {
+  int every;
+  long samples;
+  int collections;
+  struct Tracked tracked[MAX_ALLOC_SIZE];
+  struct Site *sites;
+  int nsites;
+  struct Totals retainers;   /* survivals of samples, by root */
+};
+
+void sample_allocation(Object *obj) {
+  Interp *owner = interp->owner;
+  struct AllocProfile *p = owner->allocs;
+  struct Tracked *t;
+
+  if (p == NULL) {
+    interp->alloc_countdown = ALLOC_PROFILE_RECHECK;
+    return;
+  }
+
+  interp->alloc_countdown = p->every;
+
+  // The slot is this thread's, and nothing collects until it next
+  // allocates, so only the count is shared.
+  t = &p->tracked[obj - owner->pool];
+  t->procedure = current_procedure();
+  t->site = -1;
+  t->survived = 0;
+  __atomic_fetch_add(&p->samples, 1, __ATOMIC_RELAXED);
+}
+
+static long object_bytes(Object *obj) {
+  long bytes = sizeof(Object);
+
+  if (obj->type == STRING)
+    bytes += strlen(obj->str.text) + 1;
+  else if (obj->type == SYMBOL)
+    bytes += strlen(obj->symbol.name) + 1;
+
+  return bytes;
+}
+
+static int site_of(struct AllocProfile *p, char *procedure, char *type) {
+  for (int i = 0; i < p->nsites; i++) {
+    if (p->sites[i].procedure == procedure && p->sites[i].type == type)
+      return i;
+  }
+
+  p->sites = realloc(p->sites, (p->nsites + 1) * sizeof(struct Site));
+  assert(p->sites != NULL);
+  memset(&p->sites[p->nsites], 0, sizeof(struct Site));
+  p->sites[p->nsites].procedure = procedure;
+  p->sites[p->nsites].type = type;
+  return p->nsites++;
+}
+
+/* Count the samples taken since the last collection towards their
+ * sites, now that their types are set. */
+static void settle(struct AllocProfile *p, Interp *owner) {
+  for (int i = 0; i < MAX_ALLOC_SIZE; i++) {
+    struct Tracked *t = &p->tracked[i];
+    Object *obj = &owner->pool[i];
+    struct Site *site;
+
+    if (t->procedure == NULL || t->site >= 0)
+      continue;
+
+    t->site = site_of(p, t->procedure, get_type(obj));
+    site = &p->sites[t->site];
+    site->objects++;
+    site->bytes += object_bytes(obj);
+    site->live++;
+  }
+}
+
+void alloc_profile_gc() {
+  Interp *owner = interp->owner;
+
+  settle(owner->allocs, owner);
+  owner->allocs->collections++;
+}
+
+void alloc_profile_marked(Object *obj, char *root) {
+  Interp *owner = interp->owner;
+  struct AllocProfile *p = owner->allocs;
+
+  if (p->tracked[obj - owner->pool].procedure != NULL)
+    total_of(&p->retainers, root)->total++;
+}
+
+void alloc_profile_swept(int slot, int kept) {
+  struct AllocProfile *p = interp->owner->allocs;
+  struct Tracked *t = &p->tracked[slot];
+
+  if (t->procedure == NULL)
+    return;
+
+  if (!kept) {
+    p->sites[t->site].live--;
+    t->procedure = NULL;
+  } else if (!t->survived) {
+    t->survived = 1;
+    p->sites[t->site].survived++;
+  }
+}
+
+int alloc_profile_start(int every) {
+  Interp *owner = interp->owner;
+
+  if (owner->allocs != NULL)
+    return 0;
+
+  owner->allocs = calloc(1, sizeof(struct AllocProfile));
+  assert(owner->allocs != NULL);
+  owner->allocs->every = every;
+  interp->alloc_countdown = every;
+
+  return 1;
+}
+
+static int by_bytes(const void *a, const void *b) {
+  const struct Site *x = a, *y = b;
+  int c;
+
+  if (x->bytes != y->bytes)
+    return x->bytes < y->bytes ? 1 : -1;
+  if ((c = strcmp(x->procedure, y->procedure)) != 0)
+    return c;
+  return strcmp(x->type, y->type);
+}
+
+static int by_total(const void *a, const void *b) {
+  const struct Total *x = a, *y = b;
+
+  if (x->total != y->total)
+    return y->total - x->total;
+  return strcmp(x->name, y->name);
+}
+
+/* The sites, busiest first, as a list of
+ * (procedure type objects bytes survived live), scaled up by how
+ * sparsely they were sampled. */
+static Object *sites_list(struct AllocProfile *p) {
+  Object *list = s_nil;
+  Object *entry = NULL;
+  Object *type = NULL;
+
+  pin_variable((void **)&list);
+  pin_variable((void **)&entry);
+  pin_variable((void **)&type);
+
+  for (int i = p->nsites - 1; i >= 0; i--) {
+    struct Site *site = &p->sites[i];
+
+    entry = s_nil;
+    entry = cons(make_fixnum(site->live * p->every), entry);
+    entry = cons(make_fixnum(site->survived * p->every), entry);
+    entry = cons(make_fixnum(site->bytes * p->every), entry);
+    entry = cons(make_fixnum(site->objects * p->every), entry);
+    type = intern_symbol(site->type);
+    entry = cons(type, entry);
+    type = intern_symbol(site->procedure);
+    entry = cons(type, entry);
+    list = cons(entry, list);
+  }
+
+  unpin_variable((void **)&type);
+  unpin_variable((void **)&entry);
+  unpin_variable((void **)&list);
+
+  return list;
+}
+
+static void alloc_report(struct AllocProfile *p) {
+  struct Totals *r = &p->retainers;
+  int count = 0;
+
+  printf("\nAllocations: 1 in %d sampled, %ld samples, %d collections\n",
+         p->every, p->samples, p->collections);
+  printf("%9s %10s %9s %7s  %-7s  %s\n",
+         "objects", "bytes", "survived", "live", "type", "procedure");
+  for (int i = 0; i < p->nsites && i < PROFILE_TOP; i++) {
+    struct Site *site = &p->sites[i];
+
+    printf("%9ld %10ld %8.1f%% %7ld  %-7s  %s\n",
+           site->objects * p->every, site->bytes * p->every,
+           100.0 * site->survived / site->objects, site->live * p->every,
+           site->type, site->procedure);
+  }
+
+  for (int i = 0; i < r->size; i++) {
+    if (r->slots[i].name != NULL)
+      r->slots[count++] = r->slots[i];
+  }
+  if (count == 0)
+    return;
+
+  qsort(r->slots, count, sizeof(struct Total), by_total);
+  printf("\nRoots keeping samples alive, by collections survived:\n");
+  for (int i = 0; i < count && i < PROFILE_TOP; i++)
+    printf("%9ld  %s\n", (long)r->slots[i].total * p->every, r->slots[i].name);
+}
+
+Object *alloc_profile_stop(int report) {
+  Interp *owner = interp->owner;
+  struct AllocProfile *p = owner->allocs;
+  Object *sites;
+
+  if (p == NULL)
+    return NULL;
+
+  settle(p, owner);
+  if (p->nsites > 0)
+    qsort(p->sites, p->nsites, sizeof(struct Site), by_bytes);
+
+  // The profile is off while the result is made.
+  owner->allocs = NULL;
+  sites = sites_list(p);
+  if (report)
+    alloc_report(p);
+
+  free(p->sites);
+  free(p->retainers.slots);
+  free(p);
+  return sites;
+}
+
+void free_alloc_profile(Interp *in) {
+  if (in->allocs == NULL)
+    return;
+
+  free(in->allocs->sites);
+  free(in->allocs->retainers.slots);
+  free(in->allocs);
+  in->allocs = NULL;
+}
+
+Object *prim_alloc_profile_start(int argc, Object **argv) {
+  int every = ALLOC_PROFILE_EVERY;
+
+  if (argc > 0) {
+    if (!is_fixnum(argv[0]) || argv[0]->num.value <= 0)
+      error("alloc-profile-start needs how many allocations to sample one of");
+    every = argv[0]->num.value;
+  }
+
+  if (interp->parallel || interp->owner != interp)
+    error("alloc-profile-start can't run inside pmap");
+
+  if (!alloc_profile_start(every))
+    error("An allocation profile is already running");
+
+  return s_nil;
+}
+
+Object *prim_alloc_profile_stop(int argc, Object **argv) {
+  Object *sites;
+
+  if (interp->parallel || interp->owner != interp)
+    error("alloc-profile-stop can't run inside pmap");
+
+  sites = alloc_profile_stop(0);
+  if (sites == NULL)
+    error("No allocation profile is running");
+
+  return sites;
+}
@@ -0,0 +1,67 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* CPU time between samples, by default. */
+#define PROFILE_INTERVAL_US 1000
+
+/* Innermost procedures a sample keeps. */
+#define PROFILE_DEPTH 64
+
+/* Words of samples a profile holds; those past it are dropped. */
+#define PROFILE_BUFFER (1 << 22)
+
+/* Procedures in the table a profile ends with. */
+#define PROFILE_TOP 20
+
+/* In Interp.procs just below a task's frames, where a sample of the
+ * task stops. */
+extern Object profile_task_root;
+#define PROFILE_TASK (&profile_task_root)
+
+/* Set by -F: profile the files run, folding stacks into it. */
+extern char *profile_path;
+
+/* Sample every INTERVAL_US of CPU time until profile_stop, which
+ * prints the busiest procedures and, given FOLDED, writes the stacks
+ * to it for flamegraph.pl.  profile_start returns 0 if a profile is
+ * already running, and profile_stop the samples taken, or -1 if none
+ * is. */
+int profile_start(int interval_us);
+int profile_stop(FILE *folded);
+
+Object *prim_profile_start(int argc, Object **argv);
+Object *prim_profile_stop(int argc, Object **argv);
+
+/* One in how many allocations an allocation profile samples, by
+ * default, and how often a thread looks for one while none runs. */
+#define ALLOC_PROFILE_EVERY 64
+#define ALLOC_PROFILE_RECHECK 4096
+
+/* Set by -A: profile allocations, reporting at exit. */
+extern int alloc_profile_every;
+
+/* Sample one in EVERY of the objects this heap allocates, until
+ * alloc_profile_stop, which returns the sites as a list, printing
+ * them and the roots that kept samples alive if REPORT.  They return
+ * 0 and NULL if one is or isn't running. */
+int alloc_profile_start(int every);
+Object *alloc_profile_stop(int report);
+void free_alloc_profile(Interp *in);
+
+/* new_Object's, once alloc_countdown runs out. */
+void sample_allocation(Object *obj);
+
+/* The collector's: as it starts, as it marks an object from ROOT
+ * and as it sweeps SLOT, under an allocation profile. */
+void alloc_profile_gc();
+void alloc_profile_marked(Object *obj, char *root);
+void alloc_profile_swept(int slot, int kept);
+
+Object *prim_alloc_profile_start(int argc, Object **argv);
+Object *prim_alloc_profile_stop(int argc, Object **argv);
@@ -0,0 +1,393 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Reader.
+ *
+ * Source is parsed from a byte buffer rather than a char at a time
+ * through stdio.  A regular file is mapped whole, so reading it copies
+ * nothing; anything else is read in large blocks.  Symbols, strings
+ * and numbers are scanned in place as slices of the buffer and copied
+ * out once, so they have no length limit.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "scan.h"
+#include "reader.h"
+#include "trace.h"
+#include "task.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define READ_BUFFER_SIZE 65536
+
+/* Bytes of a mapped file read before they are given back. */
+#define RELEASE_SIZE (16 << 20)
+
+Reader *fd_reader(int fd) {
+  init_scan();
+
+  Reader *r = calloc(1, sizeof(Reader));
+  assert(r != NULL);
+
+  r->cap = READ_BUFFER_SIZE;
+  r->buf = malloc(r->cap);
+  assert(r->buf != NULL);
+  r->fd = fd;
+  return r;
+}
+
+/* A reader for the LEN bytes at TEXT, a malloc'd buffer it takes. */
+Reader *buffer_reader(char *text, size_t len) {
+  init_scan();
+
+  Reader *r = calloc(1, sizeof(Reader));
+  assert(r != NULL);
+
+  r->buf = text;
+  r->len = r->cap = len;
+  r->fd = -1;
+  r->eof = 1;
+  return r;
+}
+
+/* A reader for the file at PATH, or NULL with errno set. */
+Reader *open_reader(char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      init_scan();
+
+      Reader *r = calloc(1, sizeof(Reader));
+      assert(r != NULL);
+
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      r->buf = map;
+      r->len = st.st_size;
+      r->fd = -1;
+      r->eof = 1;
+      r->mapped = 1;
+      TRACE(TRACE_READER, TRACE_INFO, "reader: mapped %s, %lld bytes\n",
+            path, (long long)st.st_size);
+      return r;
+    }
+  }
+
+  Reader *r = fd_reader(fd);
+  r->owns_fd = 1;
+  TRACE(TRACE_READER, TRACE_INFO, "reader: buffered %s\n", path);
+  return r;
+}
+
+void close_reader(Reader *r) {
+  if (r->mapped)
+    munmap(r->buf, r->len);
+  else
+    free(r->buf);
+
+  if (r->owns_fd)
+    close(r->fd);
+
+  free(r);
+}
+
+/* Read more into the buffer, keeping the token being scanned.
+ * Returns 0 at the end of input. */
+static int fill(Reader *r) {
+  if (r->eof)
+    return 0;
+
+  if (r->token > 0) {
+    memmove(r->buf, r->buf + r->token, r->len - r->token);
+    r->len -= r->token;
+    r->pos -= r->token;
+    r->offset += r->token;
+    r->token = 0;
+  }
+
+  r->classified = 0;
+
+  if (r->len == r->cap) {
+    r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+    assert(r->buf != NULL);
+  }
+
+  ssize_t n;
+  for (;;) {
+    n = read(r->fd, r->buf + r->len, r->cap - r->len);
+    if (n >= 0 || (errno != EINTR && errno != EAGAIN))
+      break;
+
+    // A non-blocking fd with nothing in it yet.
+    if (errno == EAGAIN)
+      task_wait_fd(r->fd, 0);
+  }
+
+  if (n <= 0) {
+    r->eof = 1;
+    return 0;
+  }
+
+  r->len += n;
+  TRACE(TRACE_READER, TRACE_DEBUG, "reader: read %zd bytes at offset %zu\n",
+        n, r->offset + r->len - n);
+  return 1;
+}
+
+/* Step past the run of CLASS bytes at the cursor, refilling as it
+ * goes, and return the byte after it or EOF. */
+static inline int skip_run(Reader *r, int class) {
+  for (;;) {
+    if (r->pos >= r->len && !fill(r))
+      return EOF;
+
+    if (!r->classified || r->pos - r->block >= SCAN_BLOCK) {
+      r->block = r->pos;
+      r->classified = 1;
+      scan_classify(r->buf + r->pos, r->len - r->pos, r->masks);
+    }
+
+    uint64_t rest = ~r->masks[class] >> (r->pos - r->block);
+
+    if (rest == 0) {
+      r->pos = r->block + SCAN_BLOCK;
+      continue;
+    }
+
+    r->pos += __builtin_ctzll(rest);
+    if (r->pos < r->len)
+      return (unsigned char)r->buf[r->pos];
+  }
+}
+
+/* Step past everything up to the next C, returning C or EOF. */
+static int skip_to(Reader *r, int c) {
+  for (;;) {
+    char *end = memchr(r->buf + r->pos, c, r->len - r->pos);
+
+    if (end != NULL) {
+      r->pos = end - r->buf;
+      return c;
+    }
+
+    r->pos = r->len;
+    if (!fill(r))
+      return EOF;
+  }
+}
+
+/* Skip whitespace and comments, returning the next byte. */
+static int skip_space(Reader *r) {
+  for (;;) {
+    int c;
+
+    r->token = r->pos;
+    c = skip_run(r, SCAN_SPACE);
+
+    if (c != ';')
+      return c;
+
+    r->token = r->pos;
+    skip_to(r, '\n');
+  }
+}
+
+static Object *read_datum(Reader *r);
+
+static Object *read_string(Reader *r) {
+  int c;
+
+  r->token = r->pos;
+  c = skip_to(r, '"');
+
+  if (c == EOF)
+    error("Unterminated string");
+
+  Object *obj = make_string_n(r->buf + r->token, r->pos - r->token);
+  r->pos++;
+  return obj;
+}
+
+static Object *read_symbol(Reader *r) {
+  r->token = r->pos;
+  skip_run(r, SCAN_SYMBOL);
+
+  return intern_symbol_n(r->buf + r->token, r->pos - r->token);
+}
+
+static Object *read_number(Reader *r) {
+  int number = 0;
+
+  r->token = r->pos;
+  skip_run(r, SCAN_DIGIT);
+
+  for (size_t i = r->token; i < r->pos; i++)
+    number = number * 10 + (r->buf[i] - '0');
+
+  return make_fixnum(number);
+}
+
+static Object *read_list(Reader *r) {
+  Object *list = NULL;
+  Object *item = NULL;
+  Object *tail;
+
+  pin_variable((void **)&list);
+  pin_variable((void **)&item);
+
+  // The head cell is a placeholder to append to.
+  list = tail = cons(s_nil, s_nil);
+
+  for (;;) {
+    int c = skip_space(r);
+
+    if (c == EOF)
+      error("End of input inside a list");
+
+    if (c == ')') {
+      r->pos++;
+      break;
+    }
+
+    if (c == '.') {
+      r->pos++;
+      setcdr(tail, read_datum(r));
+      if (skip_space(r) != ')')
+        error("Expected ')' after the cdr of a dotted list");
+      r->pos++;
+      break;
+    }
+
+    item = read_datum(r);
+    setcdr(tail, cons(item, s_nil));
+    tail = cdr(tail);
+  }
+
+  unpin_variable((void **)&item);
+  unpin_variable((void **)&list);
+
+  return cdr(list);
+}
+
+static Object *read_datum(Reader *r) {
+  Object *obj = NULL;
+  int c = skip_space(r);
+
+  if (c == EOF)
+    error("Unexpected end of input");
+
+  if (isdigit(c))
+    return read_number(r);
+
+  if (isalpha(c) || c == '+' || c == '-' || c == '*' || c == '/')
+    return read_symbol(r);
+
+  r->pos++;
+
+  switch (c) {
+    case '(':
+      return read_list(r);
+    case '"':
+      return read_string(r);
+    case '\'':
+      pin_variable((void **)&obj);
+      obj = read_datum(r);
+      obj = cons(obj, s_nil);
+      obj = cons(s_quote, obj);
+      unpin_variable((void **)&obj);
+      return obj;
+    case ')':
+      error("Unexpected ')'");
+  }
+
+  // Anything else has always read as nil.
+  return s_nil;
+}
+
+/* Let the kernel drop mapped pages already read past, so a long file
+ * read a datum at a time doesn't stay resident. */
+static void release(Reader *r) {
+  size_t done;
+
+  if (!r->mapped || r->pos - r->released < RELEASE_SIZE)
+    return;
+
+  done = r->pos & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+  madvise(r->buf + r->released, done - r->released, MADV_DONTNEED);
+  TRACE(TRACE_READER, TRACE_DEBUG, "reader: released %zu bytes\n",
+        done - r->released);
+  r->released = done;
+}
+
+/* The next datum, or NULL at the end of input. */
+Object *read_form(Reader *r) {
+  release(r);
+
+  if (skip_space(r) == EOF)
+    return NULL;
+
+  TRACE(TRACE_READER, TRACE_DEBUG, "reader: form at offset %zu\n",
+        r->offset + r->pos);
+  return read_datum(r);
+}
+
+/* The rest of the current line, without its newline, or NULL at the
+ * end of input. */
+Object *read_line(Reader *r) {
+  int c;
+
+  release(r);
+  r->token = r->pos;
+  c = skip_to(r, '\n');
+
+  if (c == EOF && r->pos == r->token)
+    return NULL;
+
+  Object *obj = make_string_n(r->buf + r->token, r->pos - r->token);
+  if (c != EOF)
+    r->pos++;
+  return obj;
+}
+
+/* The next byte, or EOF. */
+int read_char(Reader *r) {
+  release(r);
+
+  if (r->pos >= r->len && !fill(r))
+    return EOF;
+
+  return (unsigned char)r->buf[r->pos++];
+}
+
+/* Read the next toplevel form, or NULL at the end of input. */
+Object *read_lisp(Reader *r) {
+  Object *obj = read_form(r);
+
+  if (obj == NULL) {
+#ifdef REPL
+    exit(0);
+#else
+    printf("EOL\n");
+#endif
+  }
+
+  return obj;
+}
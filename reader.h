@@ -0,0 +1,36 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* Source text being read.  A file is mapped whole; a pipe or terminal
+ * is read into BUF, which grows if one token needs it to. */
+struct Reader {
+  char *buf;
+  size_t len;        /* bytes in buf */
+  size_t pos;        /* next byte to read */
+  size_t token;      /* start of the token being scanned */
+  size_t offset;     /* bytes dropped from the front of buf so far */
+  size_t cap;
+  int fd;            /* refilled from, if not mapped */
+  int eof;
+  int mapped;
+  int owns_fd;
+  size_t released;   /* mapped bytes before this are no longer needed */
+  size_t block;      /* where MASKS were classified from */
+  int classified;
+  uint64_t masks[SCAN_CLASSES];
+};
+
+Reader *open_reader(char *path);
+Reader *fd_reader(int fd);
+Reader *buffer_reader(char *text, size_t len);
+void close_reader(Reader *r);
+Object *read_lisp(Reader *r);
+Object *read_form(Reader *r);
+Object *read_line(Reader *r);
+int read_char(Reader *r);
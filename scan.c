@@ -0,0 +1,141 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Byte classification for the reader.
+ *
+ * A block of 64 bytes is classified at once into a bitmask per class,
+ * and the reader finds the end of a run of whitespace, a symbol or a
+ * number from those masks with a shift and a count of trailing zeros
+ * instead of testing a byte at a time.  The SSE2 and AVX2 versions are
+ * picked at startup by CPUID; anything else, a short block at the end
+ * of the buffer, or a build with NO_SIMD, uses the scalar loop.
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) && !defined(NO_SIMD)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+void (*scan_classify)(const char *p, size_t n, uint64_t *masks);
+char *scan_isa;
+
+static void classify_scalar(const char *p, size_t n, uint64_t *masks) {
+  masks[SCAN_SPACE] = masks[SCAN_SYMBOL] = masks[SCAN_DIGIT] = 0;
+
+  for (size_t i = 0; i < n && i < SCAN_BLOCK; i++) {
+    unsigned char c = p[i];
+    uint64_t bit = (uint64_t)1 << i;
+    int digit = (unsigned char)(c - '0') <= 9;
+
+    if (c == ' ' || (c >= '\t' && c <= '\r'))
+      masks[SCAN_SPACE] |= bit;
+    if (digit || (unsigned char)((c | 0x20) - 'a') <= 25 ||
+        c == '+' || c == '-' || c == '*' || c == '/')
+      masks[SCAN_SYMBOL] |= bit;
+    if (digit)
+      masks[SCAN_DIGIT] |= bit;
+  }
+}
+
+#ifdef SCAN_X86
+
+/* Bytewise unsigned x <= hi. */
+#define LE_U8_128(x, hi) _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi)), x)
+#define LE_U8_256(x, hi) _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(hi)), x)
+
+static void classify_sse2(const char *p, size_t n, uint64_t *masks) {
+  if (n < SCAN_BLOCK) {
+    classify_scalar(p, n, masks);
+    return;
+  }
+
+  masks[SCAN_SPACE] = masks[SCAN_SYMBOL] = masks[SCAN_DIGIT] = 0;
+
+  for (int i = 0; i < SCAN_BLOCK; i += 16) {
+    __m128i x = _mm_loadu_si128((__m128i *)(p + i));
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                                 LE_U8_128(_mm_sub_epi8(x, _mm_set1_epi8('\t')), 4));
+    __m128i digit = LE_U8_128(_mm_sub_epi8(x, _mm_set1_epi8('0')), 9);
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    __m128i symbol = _mm_or_si128(digit,
+                                  LE_U8_128(_mm_sub_epi8(lower, _mm_set1_epi8('a')), 25));
+
+    symbol = _mm_or_si128(symbol, _mm_cmpeq_epi8(x, _mm_set1_epi8('+')));
+    symbol = _mm_or_si128(symbol, _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+    symbol = _mm_or_si128(symbol, _mm_cmpeq_epi8(x, _mm_set1_epi8('*')));
+    symbol = _mm_or_si128(symbol, _mm_cmpeq_epi8(x, _mm_set1_epi8('/')));
+
+    masks[SCAN_SPACE] |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << i;
+    masks[SCAN_SYMBOL] |= (uint64_t)(uint16_t)_mm_movemask_epi8(symbol) << i;
+    masks[SCAN_DIGIT] |= (uint64_t)(uint16_t)_mm_movemask_epi8(digit) << i;
+  }
+}
+
+static __attribute__((target("avx2")))
+void classify_avx2(const char *p, size_t n, uint64_t *masks) {
+  if (n < SCAN_BLOCK) {
+    classify_scalar(p, n, masks);
+    return;
+  }
+
+  masks[SCAN_SPACE] = masks[SCAN_SYMBOL] = masks[SCAN_DIGIT] = 0;
+
+  for (int i = 0; i < SCAN_BLOCK; i += 32) {
+    __m256i x = _mm256_loadu_si256((__m256i *)(p + i));
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                                    LE_U8_256(_mm256_sub_epi8(x, _mm256_set1_epi8('\t')), 4));
+    __m256i digit = LE_U8_256(_mm256_sub_epi8(x, _mm256_set1_epi8('0')), 9);
+    __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+    __m256i symbol = _mm256_or_si256(digit,
+                                     LE_U8_256(_mm256_sub_epi8(lower, _mm256_set1_epi8('a')), 25));
+
+    symbol = _mm256_or_si256(symbol, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('+')));
+    symbol = _mm256_or_si256(symbol, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')));
+    symbol = _mm256_or_si256(symbol, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('*')));
+    symbol = _mm256_or_si256(symbol, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')));
+
+    masks[SCAN_SPACE] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << i;
+    masks[SCAN_SYMBOL] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(symbol) << i;
+    masks[SCAN_DIGIT] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(digit) << i;
+  }
+}
+
+#endif
+
+static void choose_classifier(void) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    scan_classify = classify_avx2;
+    scan_isa = "avx2";
+    return;
+  }
+
+  // Every x86-64 has SSE2.
+  scan_classify = classify_sse2;
+  scan_isa = "sse2";
+#else
+  scan_classify = classify_scalar;
+  scan_isa = "scalar";
+#endif
+}
+
+/* Readers may be opened on several threads at once. */
+void init_scan(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, choose_classifier);
+}
@@ -0,0 +1,30 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_BLOCK 64
+
+/* Byte classes the reader skips runs of. */
+enum {
+  SCAN_SPACE,       /* whitespace */
+  SCAN_SYMBOL,      /* letters, digits and + - * / */
+  SCAN_DIGIT,
+  SCAN_CLASSES
+};
+
+/* Set bit i of MASKS[class] for each byte P[i] in that class, for the
+ * first N (at most SCAN_BLOCK) bytes of P.  Bits past N are clear. */
+extern void (*scan_classify)(const char *p, size_t n, uint64_t *masks);
+
+/* The instruction set scan_classify was picked for. */
+extern char *scan_isa;
+
+void init_scan(void);
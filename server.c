@@ -0,0 +1,720 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Eval server.
+ *
+ * Starting an interpreter per job pays for the heap, the symbols, the
+ * builtins and the prelude every time.  With -E, the server pays once:
+ * it loads the prelude, then forks a pool of workers, each with a
+ * copy-on-write copy of that warm interpreter.  Each accepts
+ * connections on a Unix socket and, with epoll, serves a request
+ * from whichever of its connections has one, so a few workers can
+ * keep up with many clients.
+ *
+ * A worker runs each request in a child forked from it, so every
+ * request starts from the prelude alone: what one defines or
+ * collects is gone with its child, and no client sees another's.
+ * A fork of a warm worker costs far less than loading the prelude.
+ *
+ * A request is Lisp source, sent as a 4-byte big-endian length and
+ * that many bytes.  The worker evaluates its forms and replies the
+ * same way with "+" and the last value printed, or "-" and what went
+ * wrong.  A connection may carry any number of requests in turn.
+ * Connections don't block: each keeps what has arrived of its next
+ * request, and it is only evaluated once it is all in, so a client
+ * that sends half a request holds up no one else.  One that hasn't
+ * sent the rest within the request timeout is dropped.
+ *
+ * Each request runs under a timer.  Evaluation can't be stopped
+ * safely from a signal handler, so a request that runs out of time
+ * replies that it did and its child exits.  A client that won't take
+ * its reply within the same time is dropped.  Under a heap limit, a
+ * request that keeps more objects than that beyond the prelude's fails
+ * like any other error, once collecting doesn't free enough.
+ *
+ * -G is the other end: clients on threads of their own send requests
+ * one after another and time each, and the percentiles are reported.
+ * -Q sends its requests once, in turn on one connection, and prints
+ * each reply, which is what test/server.sh checks.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "scan.h"
+#include "reader.h"
+#include "printer.h"
+#include "pmap.h"
+#include "server.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+int server_workers = 0;
+int server_timeout_ms = SERVER_TIMEOUT_MS;
+int server_heap_limit = 0;
+
+static volatile sig_atomic_t stopping;
+
+/* The connection being served, for the timer to reply on. */
+static volatile sig_atomic_t client_fd = -1;
+static char timeout_reply[32];
+static size_t timeout_reply_len;
+
+/* Where a worker prints each value it replies with. */
+static OutPort *reply;
+static char *reply_buf;
+static size_t reply_len;
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/* On a connection that doesn't block, waits as long as a request
+ * may run for it to take more. */
+static int write_full(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+
+      if (poll(&pfd, 1, server_timeout_ms) <= 0)
+        return 0;
+      continue;
+    }
+    if (n <= 0)
+      return 0;
+    p += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static void put_length(unsigned char *p, uint32_t len) {
+  p[0] = len >> 24;
+  p[1] = len >> 16;
+  p[2] = len >> 8;
+  p[3] = len;
+}
+
+static uint32_t get_length(unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Send LEN bytes at TEXT after STATUS as one frame. */
+static int send_frame(int fd, char status, const char *text, size_t len) {
+  unsigned char head[5];
+
+  put_length(head, len + 1);
+  head[4] = status;
+
+  // One write, if it's small, so the reply goes in one segment.
+  if (len <= 4096) {
+    char frame[5 + 4096];
+
+    memcpy(frame, head, 5);
+    memcpy(frame + 5, text, len);
+    return write_full(fd, frame, 5 + len);
+  }
+
+  return write_full(fd, head, 5) && write_full(fd, text, len);
+}
+
+/* A frame's body in a buffer of its own, or NULL at the end of the
+ * connection or if it is too long. */
+static char *receive_frame(int fd, size_t *len) {
+  unsigned char head[4];
+  char *body;
+
+  if (!read_full(fd, head, 4))
+    return NULL;
+
+  *len = get_length(head);
+  if (*len > SERVER_MAX_REQUEST)
+    return NULL;
+
+  body = malloc(*len + 1);
+  assert(body != NULL);
+
+  if (!read_full(fd, body, *len)) {
+    free(body);
+    return NULL;
+  }
+
+  body[*len] = '\0';
+  return body;
+}
+
+/* A worker's connection, with what has come of its next request. */
+struct Conn {
+  int fd;
+  unsigned char head[4];
+  char *body;           /* once the length is in */
+  uint32_t len;
+  size_t got;           /* of the head, then of the body */
+  size_t cap;           /* of the body so far */
+  long deadline;        /* for the rest of a request begun */
+  struct Conn *prev, *next;
+};
+
+/* The connections part way through a request, soonest deadline
+ * first, since they all get the same time. */
+static struct Conn *partial, *partial_last;
+
+static long now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void begin_request(struct Conn *c) {
+  c->deadline = now_ms() + server_timeout_ms;
+  c->next = NULL;
+  c->prev = partial_last;
+  if (partial_last != NULL)
+    partial_last->next = c;
+  else
+    partial = c;
+  partial_last = c;
+}
+
+static void end_request(struct Conn *c) {
+  if (c->deadline == 0)
+    return;
+
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    partial = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+  else
+    partial_last = c->prev;
+  c->deadline = 0;
+}
+
+/* Read what has arrived on C, up to the end of its request.  Returns
+ * 1 once all of it is in, 0 if more is to come, and -1 at the end of
+ * the connection or if the request is too long.  The body grows as
+ * it arrives, not to the length it claims. */
+static int receive_some(struct Conn *c) {
+  while (c->body == NULL || c->got < c->len) {
+    ssize_t n;
+
+    if (c->body == NULL) {
+      n = read(c->fd, c->head + c->got, 4 - c->got);
+    } else {
+      if (c->got == c->cap) {
+        c->cap = c->cap * 2 < c->len ? c->cap * 2 : c->len;
+        c->body = realloc(c->body, c->cap + 1);
+        assert(c->body != NULL);
+      }
+      n = read(c->fd, c->body + c->got, c->cap - c->got);
+    }
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      return 0;
+    if (n <= 0)
+      return -1;
+    if (c->deadline == 0)
+      begin_request(c);
+    c->got += n;
+
+    if (c->body == NULL && c->got == 4) {
+      c->len = get_length(c->head);
+      if (c->len > SERVER_MAX_REQUEST)
+        return -1;
+      c->cap = c->len < SERVER_READ_SIZE ? c->len : SERVER_READ_SIZE;
+      c->body = malloc(c->cap + 1);
+      assert(c->body != NULL);
+      c->got = 0;
+    }
+  }
+
+  end_request(c);
+  c->body[c->len] = '\0';
+  return 1;
+}
+
+static void close_conn(struct Conn *c) {
+  end_request(c);
+  close(c->fd);
+  free(c->body);
+  free(c);
+}
+
+/* How long the worker may wait for events before a deadline passes,
+ * having dropped the clients whose requests are past theirs. */
+static int expire_requests() {
+  long now = now_ms();
+
+  while (partial != NULL && partial->deadline <= now)
+    close_conn(partial);
+
+  return partial != NULL ? partial->deadline - now : -1;
+}
+
+static void timed_out(int sig) {
+  if (client_fd >= 0)
+    write(client_fd, timeout_reply, timeout_reply_len);
+  _exit(2);
+}
+
+static void set_timer(int ms) {
+  struct itimerval timer = { { 0, 0 }, { ms / 1000, ms % 1000 * 1000 } };
+
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/* Evaluate the forms in TEXT, which the reader takes, and reply to
+ * FD with the last one's value.  Returns 0 if the reply couldn't be
+ * sent. */
+static int serve_request(int fd, char *text, size_t len) {
+  Reader *volatile r = buffer_reader(text, len);
+  Object *form = NULL;
+  Object *result = s_nil;
+  jmp_buf handler;
+  int pins = save_pins();
+  int sent;
+
+  interp->error_handler = &handler;
+
+  if (setjmp(handler)) {
+    restore_pins(pins);
+    interp->eval_depth = 0;
+    interp->value_sp = 0;
+    interp->error_handler = NULL;
+    set_timer(0);
+    close_reader(r);
+
+    return send_frame(fd, '-', interp->error_message, strlen(interp->error_message));
+  }
+
+  pin_variable((void **)&form);
+  pin_variable((void **)&result);
+
+  set_timer(server_timeout_ms);
+  while ((form = read_form(r)) != NULL)
+    result = eval(form, interp->top_env);
+  set_timer(0);
+
+  write_object(reply, result, 0);
+  port_flush(reply);
+  fflush(reply->out);
+
+  unpin_variable((void **)&result);
+  unpin_variable((void **)&form);
+  interp->error_handler = NULL;
+  close_reader(r);
+
+  sent = send_frame(fd, '+', reply_buf, reply_len);
+  fseeko(reply->out, 0, SEEK_SET);
+  return sent;
+}
+
+/* Serve C's request in a child of this worker, which takes its body.
+ * Returns 0 if the connection is to be closed. */
+static int fork_request(struct Conn *c) {
+  pid_t pid = fork();
+  int status;
+
+  if (pid == 0) {
+    int sent;
+
+    client_fd = c->fd;
+    sent = serve_request(c->fd, c->body, c->len);
+    port_flush(interp->out);
+    fflush(stdout);
+    _exit(sent ? 0 : 1);
+  }
+
+  free(c->body);
+  c->body = NULL;
+  c->got = c->cap = 0;
+
+  if (pid < 0) {
+    const char *msg = "Can't start the request";
+
+    return send_frame(c->fd, '-', msg, strlen(msg));
+  }
+
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 2)
+    fprintf(stderr, "worker %d: request timed out\n", getpid());
+  else if (WIFSIGNALED(status))
+    fprintf(stderr, "worker %d: request killed by signal %d\n", getpid(), WTERMSIG(status));
+
+  // One that timed out replied as it exited.  One that crashed may
+  // have sent part of a reply, so its client is dropped.
+  return WIFEXITED(status) && (WEXITSTATUS(status) == 0 || WEXITSTATUS(status) == 2);
+}
+
+static void run_worker(int listener) {
+  const char *msg = "Request timed out";
+
+  reply = calloc(1, sizeof(OutPort));
+  assert(reply != NULL);
+  reply->out = open_memstream(&reply_buf, &reply_len);
+  assert(reply->out != NULL);
+
+  put_length((unsigned char *)timeout_reply, strlen(msg) + 1);
+  timeout_reply[4] = '-';
+  memcpy(timeout_reply + 5, msg, strlen(msg));
+  timeout_reply_len = 5 + strlen(msg);
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGALRM, timed_out);
+
+  // On top of the prelude, which each request's child starts with.
+  interp->heap_used = check_active();
+  if (server_heap_limit > 0)
+    interp->heap_limit = interp->heap_used + server_heap_limit;
+
+  // Only one worker is woken for each new connection.
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = { EPOLLIN | EPOLLEXCLUSIVE, { .ptr = NULL } };
+
+  assert(epfd >= 0);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+  for (;;) {
+    struct epoll_event events[SERVER_EVENTS];
+    int n = epoll_wait(epfd, events, SERVER_EVENTS, expire_requests());
+
+    for (int i = 0; i < n; i++) {
+      struct Conn *c = events[i].data.ptr;
+      int status;
+
+      // The listener's is the one event without a connection.
+      if (c == NULL) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd >= 0) {
+          c = calloc(1, sizeof(struct Conn));
+          assert(c != NULL);
+          c->fd = fd;
+          ev.events = EPOLLIN;
+          ev.data.ptr = c;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        continue;
+      }
+
+      // One request at a time, so a busy connection can't starve the
+      // rest; epoll reports it again if more has arrived.
+      status = receive_some(c);
+      if (status == 0)
+        continue;
+      if (status < 0) {
+        close_conn(c);
+        continue;
+      }
+
+      if (!fork_request(c))
+        close_conn(c);
+    }
+  }
+}
+
+static pid_t start_worker(int listener) {
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    run_worker(listener);
+    _exit(0);
+  }
+
+  return pid;
+}
+
+static void stop(int sig) {
+  stopping = 1;
+}
+
+/* Without SA_RESTART, so the wait for workers sees it. */
+static void on_signal(int sig, void (*handler)(int)) {
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(sig, &sa, NULL);
+}
+
+int serve(char *path, int nprelude, char **prelude) {
+  struct sockaddr_un addr;
+  int count = server_workers > 0 ? server_workers : sysconf(_SC_NPROCESSORS_ONLN);
+  pid_t *workers;
+  int listener;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return 1;
+  }
+
+  for (int i = 0; i < nprelude; i++) {
+    Object *file = make_string(prelude[i]);
+
+    pin_variable((void **)&file);
+    prim_load(1, &file);
+    unpin_variable((void **)&file);
+  }
+
+  // The workers' heaps start out as clean as they can.
+  stop_workers(interp);
+  gc();
+
+  // Non-blocking, for the workers that lose the race to accept.
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  on_signal(SIGINT, stop);
+  on_signal(SIGTERM, stop);
+
+  fprintf(stderr, "serving on %s with %d workers\n", path, count);
+  port_flush(interp->out);
+  fflush(stdout);
+
+  workers = calloc(count, sizeof(pid_t));
+  assert(workers != NULL);
+  for (int i = 0; i < count; i++)
+    workers[i] = start_worker(listener);
+
+  // Replace any worker that exits.
+  while (!stopping) {
+    int status;
+    pid_t pid = wait(&status);
+
+    if (pid < 0)
+      continue;
+
+    for (int i = 0; i < count; i++) {
+      if (workers[i] == pid && !stopping) {
+        fprintf(stderr, "worker %d exited\n", pid);
+        workers[i] = start_worker(listener);
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++)
+    kill(workers[i], SIGTERM);
+  while (wait(NULL) > 0)
+    ;
+
+  unlink(path);
+  free(workers);
+  return 0;
+}
+
+struct Client {
+  pthread_t thread;
+  char *path;
+  char **requests;
+  int nrequests;
+  long *latencies;      /* ns */
+  int errors;
+  int failed;
+};
+
+static int connect_server(char *path) {
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  // Give a server that is just starting a second to listen.
+  for (int tries = 0; tries < 100; tries++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+
+    close(fd);
+    usleep(10000);
+  }
+
+  return -1;
+}
+
+static int send_request(int fd, char *request) {
+  unsigned char head[4];
+
+  put_length(head, strlen(request));
+  return write_full(fd, head, 4) && write_full(fd, request, strlen(request));
+}
+
+static void *run_client(void *arg) {
+  struct Client *c = arg;
+  int fd = connect_server(c->path);
+
+  if (fd < 0) {
+    c->failed = 1;
+    return NULL;
+  }
+
+  for (int i = 0; i < LOAD_REQUESTS; i++) {
+    struct timespec start, end;
+    size_t len;
+    char *reply;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!send_request(fd, c->requests[i % c->nrequests]) ||
+        (reply = receive_frame(fd, &len)) == NULL) {
+      c->failed = 1;
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    c->latencies[i] = (end.tv_sec - start.tv_sec) * 1000000000L +
+                      (end.tv_nsec - start.tv_nsec);
+    if (len == 0 || reply[0] != '+')
+      c->errors++;
+    free(reply);
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static int compare_longs(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+int load_server(char *path, int clients, int nrequests, char **requests) {
+  struct Client *c = calloc(clients, sizeof(struct Client));
+  long *all = malloc(clients * LOAD_REQUESTS * sizeof(long));
+  static char *default_request = "(+ 1 2)";
+  struct timespec start, end;
+  int total = clients * LOAD_REQUESTS;
+  int started, errors = 0, failed = 0;
+  double secs;
+
+  assert(c != NULL && all != NULL);
+
+  if (nrequests == 0) {
+    requests = &default_request;
+    nrequests = 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (started = 0; started < clients; started++) {
+    c[started].path = path;
+    c[started].requests = requests;
+    c[started].nrequests = nrequests;
+    c[started].latencies = &all[started * LOAD_REQUESTS];
+    if (pthread_create(&c[started].thread, NULL, run_client, &c[started]) != 0) {
+      fprintf(stderr, "Can't start client %d\n", started);
+      failed = 1;
+      break;
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(c[i].thread, NULL);
+    if (c[i].failed) {
+      fprintf(stderr, "Client %d lost the server at %s\n", i, path);
+      failed = 1;
+    }
+    errors += c[i].errors;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (failed) {
+    free(all);
+    free(c);
+    return 1;
+  }
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  qsort(all, total, sizeof(long), compare_longs);
+
+  fprintf(stderr, "requests  clients  errors      req/s   p50 us   p90 us   p99 us p99.9 us   max us\n");
+  fprintf(stderr, "%8d %8d %7d %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+          total, clients, errors, total / secs,
+          all[total / 2] / 1e3, all[total * 90 / 100] / 1e3,
+          all[total * 99 / 100] / 1e3, all[total * 999 / 1000] / 1e3,
+          all[total - 1] / 1e3);
+
+  free(all);
+  free(c);
+  return 0;
+}
+
+int query_server(char *path, int nrequests, char **requests) {
+  int fd = connect_server(path);
+  size_t len;
+  char *reply;
+
+  if (fd < 0) {
+    fprintf(stderr, "Can't reach the server at %s\n", path);
+    return 1;
+  }
+
+  for (int i = 0; i < nrequests; i++) {
+    if (!send_request(fd, requests[i]) ||
+        (reply = receive_frame(fd, &len)) == NULL) {
+      fprintf(stderr, "Lost the server at %s\n", path);
+      close(fd);
+      return 1;
+    }
+    printf("%s\n", reply);
+    free(reply);
+  }
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,40 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* How long a request may run before its worker gives up on it. */
+#define SERVER_TIMEOUT_MS 5000
+
+/* Longest request a worker reads; a longer one ends the connection. */
+#define SERVER_MAX_REQUEST (1 << 20)
+
+/* Room a request's body starts with, growing as more of it arrives. */
+#define SERVER_READ_SIZE 4096
+
+/* Ready connections a worker takes from epoll at a time. */
+#define SERVER_EVENTS 64
+
+/* Requests each of the load generator's clients sends. */
+#define LOAD_REQUESTS 5000
+
+/* Set by -W, -O and -L; workers of 0 means one per core. */
+extern int server_workers;
+extern int server_timeout_ms;
+extern int server_heap_limit;
+
+/* Load the PRELUDE files, then serve requests on the Unix socket at
+ * PATH with a pool of forked workers until killed. */
+int serve(char *path, int nprelude, char **prelude);
+
+/* Send the REQUESTS in turn from CLIENTS connections at once to the
+ * server at PATH, and report the latencies. */
+int load_server(char *path, int clients, int nrequests, char **requests);
+
+/* Send the REQUESTS in turn on one connection to the server at PATH
+ * and print each reply. */
+int query_server(char *path, int nrequests, char **requests);
@@ -0,0 +1,200 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * What (time) reports.
+ *
+ * Every Interp keeps running totals in its counters: execute() counts
+ * the steps it enters, calls count the procedures and primitives they
+ * apply, new_Object counts objects by type and the collector counts
+ * its collections and the time it spent in them.  Each thread only
+ * adds to its own, so they cost an increment apiece.  (time) takes the
+ * totals of the heap's threads, its own and pmap's workers, before and
+ * after the body and prints the difference, along with the wall clock
+ * and the CPU time of the whole process.
+ *
+ * Where the kernel lets it, the first (time) a thread runs also opens
+ * hardware counters for it with perf_event_open: cycles, instructions,
+ * cache misses and branch misses.  They count the calling thread only,
+ * not pmap's workers, and are left running, so each later (time) only
+ * reads them.  A counter the kernel had to share with others is scaled
+ * up by the time it actually ran.  If none can be opened, the report
+ * says why and (time) gets by without them.
+ */
+
+#include "jcm-lisp.h"
+#include "pmap.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, PERF_COUNTERS };
+
+static struct {
+  char *name;
+  unsigned long config;
+} perf_events[PERF_COUNTERS] = {
+  {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+  {"cache misses", PERF_COUNT_HW_CACHE_MISSES},
+  {"branch misses", PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+struct Perf {
+  int fds[PERF_COUNTERS];  /* -1 where the kernel refused */
+  int error;               /* errno, if it refused them all */
+};
+
+struct Snapshot {
+  struct timespec wall, cpu;
+  Counters counters;
+  double perf[PERF_COUNTERS]; /* negative where not counted */
+};
+
+static struct Perf *open_perf() {
+  struct Perf *perf = calloc(1, sizeof(struct Perf));
+  struct perf_event_attr attr;
+  int opened = 0;
+
+  assert(perf != NULL);
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = perf_events[i].config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf->fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf->fds[i] >= 0)
+      opened++;
+    else if (perf->error == 0)
+      perf->error = errno;
+  }
+
+  if (opened > 0)
+    perf->error = 0;
+  return perf;
+}
+
+void free_perf(Interp *in) {
+  if (in->perf == NULL)
+    return;
+
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (in->perf->fds[i] >= 0)
+      close(in->perf->fds[i]);
+  }
+  free(in->perf);
+  in->perf = NULL;
+}
+
+static __thread Counters *total;
+
+static void add_counters(Interp *in) {
+  total->steps += in->counters.steps;
+  total->calls += in->counters.calls;
+  total->collections += in->counters.collections;
+  total->gc_ns += in->counters.gc_ns;
+  for (int i = 0; i <= CHANNEL; i++)
+    total->allocated[i] += in->counters.allocated[i];
+}
+
+static void snapshot(struct Snapshot *s) {
+  uint64_t values[3];
+
+  memset(&s->counters, 0, sizeof(Counters));
+  total = &s->counters;
+  add_counters(interp->owner);
+  for_each_worker(add_counters);
+
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    s->perf[i] = -1;
+    if (interp->perf->fds[i] < 0 ||
+        read(interp->perf->fds[i], values, sizeof(values)) != sizeof(values) ||
+        values[2] == 0)
+      continue;
+    s->perf[i] = (double)values[0] * values[1] / values[2];
+  }
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s->cpu);
+  clock_gettime(CLOCK_MONOTONIC, &s->wall);
+}
+
+static double ms_between(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void report(struct Snapshot *before, struct Snapshot *after) {
+  Counters *a = &after->counters, *b = &before->counters;
+  double counted[PERF_COUNTERS];
+  Object probe;
+  long allocated = 0;
+  char *sep = " (";
+
+  printf("\nTime: %.3f ms, %.3f ms CPU, %ld steps, %ld calls\n",
+         ms_between(&before->wall, &after->wall),
+         ms_between(&before->cpu, &after->cpu),
+         a->steps - b->steps, a->calls - b->calls);
+
+  for (int i = 0; i <= CHANNEL; i++)
+    allocated += a->allocated[i] - b->allocated[i];
+  printf("Allocated: %ld objects", allocated);
+  for (int i = 0; i <= CHANNEL; i++) {
+    if (a->allocated[i] == b->allocated[i])
+      continue;
+    probe.type = i;
+    printf("%s%ld %s", sep, a->allocated[i] - b->allocated[i], get_type(&probe));
+    sep = ", ";
+  }
+  printf("%s\n", allocated > 0 ? ")" : "");
+
+  printf("Collections: %ld, %.3f ms paused\n",
+         a->collections - b->collections, (a->gc_ns - b->gc_ns) / 1e6);
+
+  if (interp->perf->error != 0) {
+    printf("Counters: not available (%s)\n", strerror(interp->perf->error));
+    return;
+  }
+
+  printf("Counters:");
+  sep = " ";
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    counted[i] = before->perf[i] < 0 || after->perf[i] < 0 ? -1 :
+      after->perf[i] - before->perf[i];
+    if (counted[i] < 0)
+      continue;
+    printf("%s%.0f %s", sep, counted[i], perf_events[i].name);
+    sep = ", ";
+  }
+  if (counted[CYCLES] > 0 && counted[INSTRUCTIONS] >= 0)
+    printf(", %.2f instructions per cycle", counted[INSTRUCTIONS] / counted[CYCLES]);
+  printf("\n");
+}
+
+Object *exec_time(Node *node, Frame *frame) {
+  struct Snapshot before, after;
+  Object *result;
+
+  if (interp->perf == NULL)
+    interp->perf = open_perf();
+
+  snapshot(&before);
+  result = execute(node->then, frame->env);
+  snapshot(&after);
+  report(&before, &after);
+
+  return result;
+}
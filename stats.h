@@ -0,0 +1,14 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* (time body...): run the body, print what it cost and return its
+ * value. */
+Object *exec_time(Node *node, Frame *frame);
+
+void free_perf(Interp *in);
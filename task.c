@@ -0,0 +1,458 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Tasks.
+ *
+ * (spawn thunk) makes a task that calls THUNK once (run-tasks) gets
+ * to it.  Tasks take turns on the thread that spawned them, each
+ * running until it yields, sleeps, waits for a channel or waits for
+ * a port's fd, so an interpreter can have thousands of them in
+ * flight where it could only have a few threads.
+ *
+ * The evaluator recurses on the C stack, so each task gets a C stack
+ * of its own and is switched to with swapcontext.  Its stack is only
+ * mapped once it first runs, and only touched pages are committed.
+ * The value stack and pin stack are the Interp's, which compiled code
+ * reaches at fixed offsets: the scheduler's run-tasks frame has the
+ * bottom of them, and a task switched out takes what it pushed above
+ * that with it, putting it back when it is switched in.
+ *
+ * Tasks nest execute() from a depth of their own, so samples of one
+ * stop at the marker below it, and its slots in Interp.procs go and
+ * come back with it the same way.
+ *
+ * The scheduler runs the ready tasks in turn, in rounds.  Between
+ * rounds it wakes the sleepers that are due and asks epoll which of
+ * the fds tasks are waiting on are ready, or, with nothing else to
+ * run, waits in epoll until one is or the next sleeper is due.
+ */
+
+#include "jcm-lisp.h"
+#include "gc.h"
+#include "task.h"
+#include "profile.h"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+
+typedef struct Task {
+  int id;
+  Object *thunk;
+  ucontext_t context;
+  char *stack;           /* mapped when it first runs */
+  int started;
+  int done;
+
+  /* What it had above the scheduler's part of the stacks. */
+  Object **values;
+  int nvalues;
+  void ***pins;
+  int npins;
+  int saved;             /* room in each */
+  Object **procs;        /* its slots in Interp.procs */
+  int nprocs;            /* room in them */
+  int eval_depth;
+  jmp_buf *error_handler;
+
+  long wake;             /* sleeping until, in ms */
+  struct Task *next;     /* in the run queue or among the sleepers */
+  struct Task *prev_all; /* every task not done */
+  struct Task *next_all;
+} Task;
+
+struct Scheduler {
+  ucontext_t main;       /* run-tasks */
+  Task *current;
+  Task *all;
+  Task *ready;
+  Task *ready_tail;
+  int nready;
+  Task *sleepers;        /* soonest first */
+  int waiting;           /* on fds */
+  int count;             /* not done */
+  int next_id;
+  int running;
+  int epfd;
+
+  int base_sp;           /* the stacks below the tasks' */
+  int base_pins;
+  int base_depth;
+  jmp_buf *base_handler;
+};
+
+static long now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static Scheduler *scheduler() {
+  if (interp->tasks == NULL) {
+    interp->tasks = calloc(1, sizeof(Scheduler));
+    assert(interp->tasks != NULL);
+    interp->tasks->epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(interp->tasks->epfd >= 0);
+  }
+
+  return interp->tasks;
+}
+
+/* The running task, unless there is none or under pmap, where the
+ * thread can't leave what it is doing to the workers. */
+static Task *current_task() {
+  if (interp->tasks == NULL || interp->parallel)
+    return NULL;
+
+  return interp->tasks->current;
+}
+
+static void make_ready(Scheduler *s, Task *t) {
+  t->next = NULL;
+  if (s->ready_tail != NULL)
+    s->ready_tail->next = t;
+  else
+    s->ready = t;
+  s->ready_tail = t;
+  s->nready++;
+}
+
+static Task *next_ready(Scheduler *s) {
+  Task *t = s->ready;
+
+  s->ready = t->next;
+  if (s->ready == NULL)
+    s->ready_tail = NULL;
+  s->nready--;
+  return t;
+}
+
+/* Move what T has above the scheduler's part of the stacks aside. */
+static void save_stacks(Scheduler *s, Task *t) {
+  t->nvalues = interp->value_sp - s->base_sp;
+  t->npins = interp->pv_count - s->base_pins;
+
+  if (t->nvalues > t->saved || t->npins > t->saved) {
+    t->saved = t->nvalues > t->npins ? t->nvalues : t->npins;
+    t->values = realloc(t->values, t->saved * sizeof(Object *));
+    t->pins = realloc(t->pins, t->saved * sizeof(void **));
+    assert(t->values != NULL && t->pins != NULL);
+  }
+
+  if (t->saved > 0) {
+    memcpy(t->values, &interp->value_stack[s->base_sp], t->nvalues * sizeof(Object *));
+    memcpy(t->pins, &interp->pins[s->base_pins], t->npins * sizeof(void **));
+  }
+  t->eval_depth = interp->eval_depth;
+  t->error_handler = interp->error_handler;
+
+  if (t->eval_depth - TASK_FIRST_DEPTH > t->nprocs) {
+    t->nprocs = t->eval_depth - TASK_FIRST_DEPTH;
+    t->procs = realloc(t->procs, t->nprocs * sizeof(Object *));
+    assert(t->procs != NULL);
+  }
+  if (t->eval_depth > TASK_FIRST_DEPTH)
+    memcpy(t->procs, &interp->procs[TASK_FIRST_DEPTH],
+           (t->eval_depth - TASK_FIRST_DEPTH) * sizeof(Object *));
+
+  interp->value_sp = s->base_sp;
+  interp->pv_count = s->base_pins;
+  interp->eval_depth = s->base_depth;
+  interp->error_handler = s->base_handler;
+}
+
+/* T was switched out over the same base, so its part fits back. */
+static void restore_stacks(Scheduler *s, Task *t) {
+  if (t->saved > 0) {
+    memcpy(&interp->value_stack[s->base_sp], t->values, t->nvalues * sizeof(Object *));
+    memcpy(&interp->pins[s->base_pins], t->pins, t->npins * sizeof(void **));
+  }
+  interp->value_sp = s->base_sp + t->nvalues;
+  interp->pv_count = s->base_pins + t->npins;
+  interp->eval_depth = t->eval_depth;
+  interp->error_handler = t->error_handler;
+
+  interp->procs[TASK_FIRST_DEPTH - 1] = PROFILE_TASK;
+  if (t->eval_depth > TASK_FIRST_DEPTH)
+    memcpy(&interp->procs[TASK_FIRST_DEPTH], t->procs,
+           (t->eval_depth - TASK_FIRST_DEPTH) * sizeof(Object *));
+}
+
+/* Back to the scheduler, until it runs T again. */
+static void switch_out(Scheduler *s, Task *t) {
+  save_stacks(s, t);
+  swapcontext(&t->context, &s->main);
+}
+
+static void task_main() {
+  Scheduler *s = interp->tasks;
+  Task *t = s->current;
+  jmp_buf handler;
+
+  // An error ends the task, not the others.
+  interp->error_handler = &handler;
+  if (!setjmp(handler))
+    call_value(t->thunk, 0, NULL);
+
+  // Whatever an error left on the stacks goes with it.
+  t->done = 1;
+  save_stacks(s, t);
+  setcontext(&s->main);
+}
+
+static void start_task(Task *t) {
+  long page = sysconf(_SC_PAGESIZE);
+
+  t->stack = mmap(NULL, TASK_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(t->stack != MAP_FAILED);
+
+  // Overflow faults rather than running into something else.
+  mprotect(t->stack, page, PROT_NONE);
+
+  getcontext(&t->context);
+  t->context.uc_stack.ss_sp = t->stack + page;
+  t->context.uc_stack.ss_size = TASK_STACK_SIZE;
+  t->context.uc_link = NULL;
+  makecontext(&t->context, task_main, 0);
+  t->started = 1;
+}
+
+static void free_task(Scheduler *s, Task *t) {
+  if (t->prev_all != NULL)
+    t->prev_all->next_all = t->next_all;
+  else
+    s->all = t->next_all;
+  if (t->next_all != NULL)
+    t->next_all->prev_all = t->prev_all;
+
+  if (t->stack != NULL)
+    munmap(t->stack, TASK_STACK_SIZE + sysconf(_SC_PAGESIZE));
+  free(t->values);
+  free(t->pins);
+  free(t->procs);
+  free(t);
+}
+
+static void run(Scheduler *s, Task *t) {
+  if (!t->started)
+    start_task(t);
+
+  s->current = t;
+  restore_stacks(s, t);
+  swapcontext(&s->main, &t->context);
+  s->current = NULL;
+
+  if (t->done) {
+    s->count--;
+    free_task(s, t);
+  }
+}
+
+static void wake_sleepers(Scheduler *s, long now) {
+  while (s->sleepers != NULL && s->sleepers->wake <= now) {
+    Task *t = s->sleepers;
+
+    s->sleepers = t->next;
+    make_ready(s, t);
+  }
+}
+
+/* Make the tasks whose fds are ready ready, waiting up to TIMEOUT ms
+ * for one to be. */
+static void poll_fds(Scheduler *s, int timeout) {
+  struct epoll_event events[TASK_EVENTS];
+  int n;
+
+  do {
+    n = epoll_wait(s->epfd, events, TASK_EVENTS, timeout);
+  } while (n < 0 && errno == EINTR);
+
+  for (int i = 0; i < n; i++) {
+    s->waiting--;
+    make_ready(s, events[i].data.ptr);
+  }
+}
+
+Object *prim_spawn(int argc, Object **argv) {
+  Scheduler *s;
+  Task *t;
+
+  if (!is_proc(argv[0]) && !is_primitive(argv[0]))
+    error("spawn needs a procedure");
+
+  if (interp->owner != interp)
+    error("spawn can't run inside pmap");
+
+  s = scheduler();
+  t = calloc(1, sizeof(Task));
+  assert(t != NULL);
+
+  t->id = ++s->next_id;
+  t->thunk = argv[0];
+  t->eval_depth = TASK_FIRST_DEPTH;
+
+  t->next_all = s->all;
+  if (s->all != NULL)
+    s->all->prev_all = t;
+  s->all = t;
+  s->count++;
+  make_ready(s, t);
+
+  return make_fixnum(t->id);
+}
+
+int task_yield() {
+  Task *t = current_task();
+
+  if (t == NULL)
+    return 0;
+
+  make_ready(interp->tasks, t);
+  switch_out(interp->tasks, t);
+  return 1;
+}
+
+Object *prim_yield(int argc, Object **argv) {
+  task_yield();
+  return s_nil;
+}
+
+/* (sleep ms) */
+Object *prim_sleep(int argc, Object **argv) {
+  Task *t = current_task();
+  long ms;
+
+  if (!is_fixnum(argv[0]) || argv[0]->num.value < 0)
+    error("sleep needs a number of milliseconds");
+  ms = argv[0]->num.value;
+
+  if (t == NULL) {
+    struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+    return s_nil;
+  }
+
+  Scheduler *s = interp->tasks;
+  Task **p = &s->sleepers;
+
+  t->wake = now_ms() + ms;
+  while (*p != NULL && (*p)->wake <= t->wake)
+    p = &(*p)->next;
+  t->next = *p;
+  *p = t;
+
+  switch_out(s, t);
+  return s_nil;
+}
+
+void task_wait_fd(int fd, int writing) {
+  Task *t = current_task();
+  struct epoll_event ev;
+
+  if (t == NULL) {
+    struct pollfd pfd = { fd, writing ? POLLOUT : POLLIN, 0 };
+
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+      ;
+    return;
+  }
+
+  // Once, so it can't be made ready again before it has run.
+  ev.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  ev.data.ptr = t;
+  if (epoll_ctl(interp->tasks->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    error(errno == EEXIST ? "Another task is waiting on the port" :
+                            "Can't wait on the port");
+
+  interp->tasks->waiting++;
+  switch_out(interp->tasks, t);
+  epoll_ctl(interp->tasks->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Run the spawned tasks, and any they spawn, until all are done. */
+Object *prim_run_tasks(int argc, Object **argv) {
+  Scheduler *s = scheduler();
+
+  if (s->running)
+    error("run-tasks can't run inside a task");
+  // Tasks' frames go in the slots of Interp.procs above it.
+  if (interp->eval_depth >= TASK_FIRST_DEPTH - 1)
+    error("run-tasks is nested too deeply");
+
+  s->running = 1;
+  s->base_sp = interp->value_sp;
+  s->base_pins = interp->pv_count;
+  s->base_depth = interp->eval_depth;
+  s->base_handler = interp->error_handler;
+
+  while (s->count > 0) {
+    long now = now_ms();
+    int timeout = 0;
+
+    wake_sleepers(s, now);
+
+    if (s->ready == NULL) {
+      if (s->sleepers != NULL)
+        timeout = s->sleepers->wake - now;
+      else if (s->waiting > 0)
+        timeout = -1;
+      else
+        break;
+    }
+
+    if (s->waiting > 0 || s->ready == NULL)
+      poll_fds(s, timeout);
+
+    // Those ready now, not those they make ready.
+    for (int n = s->nready; n > 0; n--)
+      run(s, next_ready(s));
+  }
+
+  s->running = 0;
+  return s_nil;
+}
+
+void mark_tasks(Interp *in) {
+  if (in->tasks == NULL)
+    return;
+
+  for (Task *t = in->tasks->all; t != NULL; t = t->next_all) {
+    mark(t->thunk);
+
+    // The running task's are still on the stacks.
+    if (t == in->tasks->current)
+      continue;
+
+    for (int i = 0; i < t->nvalues; i++)
+      mark(t->values[i]);
+    for (int i = 0; i < t->npins; i++)
+      mark(*(Object **)t->pins[i]);
+  }
+}
+
+void free_tasks(Interp *in) {
+  Scheduler *s = in->tasks;
+
+  if (s == NULL)
+    return;
+
+  while (s->all != NULL)
+    free_task(s, s->all);
+
+  close(s->epfd);
+  free(s);
+  in->tasks = NULL;
+}
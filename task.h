@@ -0,0 +1,33 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/* C stack each task runs on, committed only as it is used. */
+#define TASK_STACK_SIZE (1 << 20)
+
+/* Levels of execute() a task may nest, which its stack has room for. */
+#define TASK_EVAL_DEPTH 1000
+#define TASK_FIRST_DEPTH (MAX_EVAL_DEPTH - TASK_EVAL_DEPTH)
+
+/* Ready fds taken from epoll at a time. */
+#define TASK_EVENTS 64
+
+Object *prim_spawn(int argc, Object **argv);
+Object *prim_yield(int argc, Object **argv);
+Object *prim_sleep(int argc, Object **argv);
+Object *prim_run_tasks(int argc, Object **argv);
+
+/* Let the other tasks run, if in one; returns whether it did. */
+int task_yield();
+
+/* Wait until FD can be read, or written if WRITING: in a task, while
+ * the others run; otherwise, blocking the thread. */
+void task_wait_fd(int fd, int writing);
+
+void mark_tasks(Interp *in);
+void free_tasks(Interp *in);
@@ -0,0 +1,11 @@
+; Loaded by test19.lsp, from source the first time and after that
+; from lib19.fasl.
+(define square (lambda (x) (* x x)))
+(defmacro twice (form) (list 'begin form form))
+(define greeting "hello from lib19")
+(define table '((one . 1) (two . 2) (three 3 "three")))
+(define count-up
+  (lambda (n acc)
+    (if (eq n 0)
+        acc
+        (count-up (- n 1) (cons n acc)))))
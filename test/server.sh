@@ -0,0 +1,31 @@
+#!/bin/sh
+# Round trips to an eval server with one worker, a short timeout and
+# a small heap limit, compared with test/server.out.  Run from the top
+# of the tree, as `make test-server` does.
+
+sock=/tmp/jcm-lisp-test.$$.sock
+build='(define build (lambda (n acc) (if (eq n 0) acc (build (- n 1) (cons n acc)))))'
+
+./jcm-lisp -E $sock -W 1 -O 300 -L 4000 lib/arith.lsp > /dev/null 2>&1 &
+server=$!
+
+./jcm-lisp -Q $sock \
+  '(+ 1 2)' \
+  '' \
+  '(define x 6) (define y 7) (* x y)' \
+  'x' \
+  '(fact 10)' \
+  '(car' \
+  '(define fact (lambda (n) 0)) (fact 10)' \
+  '(fact 10)' \
+  '(define loop (lambda () (loop))) (loop)' \
+  '(+ 2 2)' \
+  "$build (define keep (build 1000 nil)) (car keep)" \
+  "$build (define keep (build 9000 nil)) (car keep)" \
+  '(+ 3 3)' \
+  | diff test/server.out -
+status=$?
+
+kill $server
+rm -f $sock
+exit $status
@@ -0,0 +1,22 @@
+(define add (lambda (a b) (+ a b)))
+(define count-down
+    (lambda (n)
+      (if (eq n 0)
+          (add n n)
+          (count-down (- n (add 0 1))))))
+(count-down 100)
+(add 2 3)
+(define saved +)
+(define + (lambda (a b) 42))
+(add 2 3)
+(define + saved)
+(add 2 3)
+(define same (lambda (a b) (eq a b)))
+(define warm
+    (lambda (n)
+      (if (same n n)
+          (if (eq n 0) 'warm (warm (- n 1)))
+          'cold)))
+(warm 20)
+(same 'a 'a)
+(same 3 3)
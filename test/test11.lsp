@@ -0,0 +1,36 @@
+(define sum-to
+    (lambda (n acc)
+      (if (eq n 0)
+          acc
+          (sum-to (- n 1) (+ acc n)))))
+(sum-to 300 0)
+(define make-adder (lambda (x) (lambda (y) (+ x y))))
+(define add5 (make-adder 5))
+(define loop
+    (lambda (n)
+      (if (eq n 0)
+          (add5 n)
+          (loop (- n (- (add5 0) 4))))))
+(loop 200)
+(define pick (lambda (n) (if (eq n 0) 'zero (if (eq n 1) 'one 'many))))
+(define spin
+    (lambda (n)
+      (pick n)
+      (if (eq n 0) (pick 1) (spin (- n 1)))))
+(spin 150)
+(pick 0)
+(pick 7)
+(define saved +)
+(define + (lambda (a b) 42))
+(sum-to 3 0)
+(define + saved)
+(sum-to 3 0)
+(define twice (lambda (a) (* a 2)))
+(define warm (lambda (n) (if (eq n 0) (twice 4) (warm (- n (twice 1))))))
+(warm 300)
+(define same (lambda (a b) (eq a b)))
+(define hot (lambda (n) (if (same n n) (if (eq n 0) 'hot (hot (- n 1))) 'cold)))
+(hot 200)
+(same 'a 'a)
+(same 'a 'b)
+(twice 21)
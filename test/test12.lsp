@@ -0,0 +1,12 @@
+; Uses lib/arith.lsp: run it first, or under a `make aot` build.
+(square 7)
+(fact 10)
+(fib 20)
+(expt 2 10)
+(expt-iter 3 3 1)
+(length digits)
+(length '(a b c))
+(define add5 (adder 5))
+(add5 1)
+(define twice (lambda (f x) (f (f x))))
+(twice square 3)
@@ -0,0 +1,30 @@
+(defmacro unless (c a b) (list 'if c b a))
+(unless nil 1 2)
+(unless 3 1 2)
+(defmacro or2 (a b)
+    ((lambda (g) (list (list 'lambda (list g) (list 'if g g b)) a))
+     (gensym)))
+(or2 nil 5)
+(or2 3 5)
+(define g 7)
+(or2 nil g)
+(define expansions 0)
+(defmacro twice (x)
+    (setq expansions (+ expansions 1))
+    (list '+ x x))
+(define run
+    (lambda (n acc)
+      (if (eq n 0)
+          acc
+          (run (- n 1) (+ acc (twice n))))))
+(run 100 0)
+expansions
+(run 100 0)
+expansions
+((lambda (twice) (twice 3)) (lambda (x) (* x 10)))
+(defmacro answer () 42)
+(answer)
+(define early (lambda () (later 1)))
+(defmacro later (x) x)
+(early)
+(later 2)
@@ -0,0 +1,32 @@
+(+ 1 (* 2 3))
+(if (eq 1 1) 'yes 'no)
+(if nil 'yes 'no)
+(if 'a 'yes)
+((lambda (total) (+ total 1)) 41)
+(define count
+    ((lambda (total)
+       (lambda (increment) (setq total (+ total increment)) total))
+     1))
+(count 2)
+(count 3)
+(define square (lambda (n) (* n n)))
+(square 7)
+(define sum-squares
+    (lambda (a b) (+ (square a) (square b))))
+(sum-squares 3 4)
+(define fact
+    (lambda (n) (if (eq n 0) 1 (* n (fact (- n 1))))))
+(fact 5)
+(define square (lambda (n) (+ n n)))
+(square 7)
+(sum-squares 3 4)
+(define sq (lambda (n) (* n n)))
+(define sum-sq
+    (lambda (n acc)
+      (if (eq n 0) acc (sum-sq (- n 1) (+ acc (sq n))))))
+(sum-sq 200 0)
+(define sq (lambda (n) n))
+(sum-sq 200 0)
+(define + (lambda (a b) (- a (- 0 b))))
+(+ 1 (* 2 3))
+(sum-squares 3 4)
@@ -0,0 +1,28 @@
+(define make-counter
+    (lambda (start)
+      (lambda () (setq start (+ start 1)) start)))
+(define c1 (make-counter 10))
+(define c2 (make-counter 20))
+(c1)
+(c1)
+(c2)
+(define make-cell
+    (lambda (n)
+      (cons (lambda () n) (lambda (v) (setq n v)))))
+(define box (make-cell 1))
+((cdr box) 5)
+((car box))
+(define nest
+    (lambda (a b)
+      (lambda (c)
+        (lambda (d) (+ a (+ c d))))))
+(((nest 1 2) 3) 4)
+(define shadow
+    (lambda (x)
+      ((lambda (x) (lambda () x)) (+ x 1))))
+((shadow 1))
+(define outer
+    (lambda (x)
+      ((lambda (bump) (bump) (bump) x)
+       (lambda () (setq x (+ x 10))))))
+(outer 1)
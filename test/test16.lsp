@@ -0,0 +1,16 @@
+(equal '(1 2 (3 "x")) '(1 2 (3 "x")))
+(equal '(1 2) '(1 3))
+(equal "abc" "abc")
+(equal 5 5)
+(equal 'a 'b)
+(equal (cons 1 (list 2 3)) '(1 2 3))
+(equal '(a . b) '(a . b))
+(define data '((1 2 3) (4 5 6)))
+(define more '((1 2 3) (4 5 6)))
+(equal data more)
+(equal (car data) (car (cdr more)))
+(define template '(+ 1 (* 2 3)))
+(defmacro seven () template)
+(seven)
+template
+'(+ 1 (* 2 3))
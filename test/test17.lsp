@@ -0,0 +1,11 @@
+"abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghij"
+(define a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-end 42)
+a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-a-very-long-name-end
+(list 1 ; two is missing
+      3)
+'(a . (b . (c . nil)))
+'(1 . 2)
+''quoted
+(car '((nested (lists)) here))
+)
+(+ 1 2)
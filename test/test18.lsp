@@ -0,0 +1,22 @@
+(define p (open-input-file "./test/test18.dat"))
+p
+(read p)
+(read-line p)
+(read-char p)
+(read-line p)
+(read p)
+(read p)
+(read p)
+(equal (read p) eof)
+(read-line p)
+(close-port p)
+(read p)
+(define count
+  (lambda (port n)
+    (if (equal (read port) eof)
+        n
+        (count port (+ n 1)))))
+(define q (open-input-file "./test/test18.dat"))
+(count q 0)
+(close-port q)
+(open-input-file "./test/no-such-file")
@@ -0,0 +1,10 @@
+(load "./test/lib19.lsp")
+(square 7)
+greeting
+table
+(count-up 5 nil)
+(load "./test/lib19.lsp")
+(square 8)
+(equal table '((one . 1) (two . 2) (three 3 "three")))
+(load "./test/no-such-file.lsp")
+(load 5)
@@ -0,0 +1,17 @@
+(define nest
+  (lambda (n acc)
+    (if (eq n 0)
+        acc
+        (nest (- n 1) (list acc)))))
+(nest 5 (quote x))
+(nest 100 nil)
+(define x (list 1 2))
+(list x x)
+(cons x x)
+(define *print-circle* (quote t))
+(list x x)
+(cons x x)
+(list x (list x (cons 3 x)))
+(list 1 "two" (quote (3 . 4)) (- 0 5))
+(define *print-circle* nil)
+(list x x)
@@ -0,0 +1,16 @@
+(define square (lambda (n) (* n n)))
+(pmap square (quote (1 2 3 4 5)))
+(define pfib
+  (lambda (n)
+    (if (eq n 0)
+        0
+        (if (eq n 1)
+            1
+            (+ (pfib (- n 1)) (pfib (- n 2)))))))
+(pmap pfib (list 10 11 12 13))
+(pmap (lambda (n) (cons n n)) (list 1 2 3))
+(pfor-each square (list 1 2 3))
+(pmap car (quote ((a b) (c d))))
+(pmap square nil)
+(pmap undefined-fn (list 1 2))
+(pmap (lambda (n) (if (eq n 1) (pmap square (list n)) n)) (list 1 2))
@@ -0,0 +1,20 @@
+(define ch (make-channel "test22" 8))
+(send ch 42)
+(receive ch)
+(send ch (quote (a "b" (1 . 2) t nil)))
+(receive ch)
+(define x (list 1 2))
+(send ch x)
+(eq x (receive ch))
+(send ch (quote t))
+(receive ch)
+(try-receive ch)
+(send-all ch (list 1 2 3 4 5 6))
+(receive-all ch 4)
+(receive-all ch 10)
+(try-receive ch)
+(send (make-channel "test22") 7)
+(try-receive ch)
+(send ch car)
+(send 1 2)
+(make-channel "test22-bad" 0)
@@ -0,0 +1,38 @@
+(define log nil)
+(define note (lambda (x) (setq log (cons x log))))
+(spawn (lambda () (note 1) (yield) (note 3)))
+(spawn (lambda () (note 2) (yield) (note 4)))
+(run-tasks)
+log
+(spawn (lambda () (sleep 20) (note (quote late))))
+(spawn (lambda () (sleep 5) (note (quote early))))
+(run-tasks)
+log
+(define p (make-pipe))
+(spawn (lambda () (note (read-line (car p)))))
+(spawn (lambda () (sleep 5) (write-line (cdr p) "hello") (close-port (cdr p))))
+(run-tasks)
+(car log)
+(read-line (car p))
+(define ch (make-channel "test23"))
+(spawn (lambda () (note (receive ch))))
+(spawn (lambda () (send ch 99)))
+(run-tasks)
+(car log)
+(spawn (lambda () (no-such-thing) (note (quote never))))
+(spawn (lambda () (note (quote after))))
+(run-tasks)
+(car log)
+(define count 0)
+(define bump (lambda () (yield) (setq count (+ count 1))))
+(define spawn-n (lambda (n) (if (eq n 0) n (spawn-more n))))
+(define spawn-more (lambda (n) (spawn bump) (spawn-n (- n 1))))
+(spawn-n 2000)
+(run-tasks)
+count
+(spawn (lambda () (run-tasks)))
+(run-tasks)
+(yield)
+(spawn 1)
+(write-line (car p) "x")
+(read-line (cdr p))
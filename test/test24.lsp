@@ -0,0 +1,17 @@
+(define fib (lambda (n) (if (eq n 0) 0 (if (eq n 1) 1 (+ (fib (- n 1)) (fib (- n 2)))))))
+(define spin (lambda (n) (if (eq n 0) n (spin (- n 1)))))
+(define done (lambda (x) (quote done)))
+(profile-start 100)
+(profile-start)
+(fib 20)
+(spawn (lambda () (spin 20000) (yield) (spin 20000)))
+(spawn (lambda () (spin 20000)))
+(run-tasks)
+(no-such-thing)
+(fib 15)
+(done (profile-stop "/tmp/jcm-lisp-test24.folded"))
+(profile-start 0)
+(profile-start)
+(profile-stop 1)
+(done (profile-stop))
+(profile-stop)
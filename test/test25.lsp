@@ -0,0 +1,12 @@
+(define build (lambda (n acc) (if (eq n 0) acc (build (- n 1) (cons n acc)))))
+(define top (lambda (sites) (list (car (car sites)) (car (cdr (car sites))))))
+(define kept nil)
+(alloc-profile-start 0)
+(alloc-profile-start 1)
+(alloc-profile-start)
+(car (setq kept (build 2000 nil)))
+(top (alloc-profile-stop))
+(alloc-profile-stop)
+(alloc-profile-start 16)
+(car (car (pmap (lambda (x) (build x nil)) (list 100 200 300))))
+(top (alloc-profile-stop))
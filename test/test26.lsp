@@ -0,0 +1,8 @@
+(define fib (lambda (n) (if (eq n 0) 0 (if (eq n 1) 1 (+ (fib (- n 1)) (fib (- n 2)))))))
+(time (fib 15))
+(time)
+(time 1 (quote (a b)) "last")
+(time (time (cons 1 2)))
+(define count (lambda (n) (time n) (if (eq n 0) 0 (count (- n 1)))))
+(count 3)
+(time (car (pmap fib (list 10 11 12))))
@@ -0,0 +1,6 @@
+(define loop
+    (lambda (n)
+      (if (eq n 0)
+          'done
+          (loop (- n 1)))))
+(loop 20000)
@@ -0,0 +1,6 @@
+(define deep
+    (lambda ()
+      (if (deep) 1 0)))
+(deep)
+(define after 8)
+after
@@ -0,0 +1,7 @@
+(+ 1 2 3)
+(- 10 1 2)
+(* 2 3 4)
+(/ 9 2)
+(cons 1 '(2))
+(car '(1 2) '(3))
+(cdr '(1 2))
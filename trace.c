@@ -0,0 +1,122 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+/*
+ * Tracing.
+ *
+ * Diagnostics are grouped into categories, each with its own level,
+ * set at startup with -T or JCM_LISP_TRACE.  Everything is off unless
+ * asked for, and a trace point that is off costs one test of a byte.
+ * Trace output has its own buffered port on stderr, one for each
+ * interpreter, so it never mixes with what the program prints.
+ */
+
+#include "jcm-lisp.h"
+#include "printer.h"
+#include "trace.h"
+
+#include <stdarg.h>
+
+unsigned char trace_levels[TRACE_CATEGORIES];
+
+static char *category_names[TRACE_CATEGORIES] = {
+  "eval", "gc", "pin", "reader"
+};
+
+static void flush_at_exit(void) {
+  trace_flush();
+}
+
+static OutPort *sink(void) {
+  static int flushing;
+
+  if (interp->trace == NULL) {
+    interp->trace = calloc(1, sizeof(OutPort));
+    assert(interp->trace != NULL);
+    interp->trace->out = stderr;
+
+    // For the interpreter the process ends in; free_Interp does the rest.
+    if (!__atomic_exchange_n(&flushing, 1, __ATOMIC_RELAXED))
+      atexit(flush_at_exit);
+  }
+
+  return interp->trace;
+}
+
+void trace_flush(void) {
+  if (interp != NULL && interp->trace != NULL) {
+    port_flush(interp->trace);
+    fflush(interp->trace->out);
+  }
+}
+
+void trace_printf(const char *fmt, ...) {
+  char line[256];
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  if (n < 0)
+    return;
+
+  if ((size_t)n < sizeof(line)) {
+    port_write(sink(), line, n);
+  } else {
+    char *big;
+
+    va_start(ap, fmt);
+    n = vasprintf(&big, fmt, ap);
+    va_end(ap);
+
+    if (n >= 0) {
+      port_write(sink(), big, n);
+      free(big);
+    }
+  }
+}
+
+void trace_object(Object *obj) {
+  write_object(sink(), obj, 0);
+}
+
+int trace_configure(const char *spec) {
+  char *copy = strdup(spec);
+  char *rest = copy;
+  char *item;
+  int ok = 1;
+
+  while (ok && (item = strsep(&rest, ",")) != NULL) {
+    char *value = strchr(item, '=');
+    int level = TRACE_INFO;
+    int found = 0;
+
+    if (value != NULL) {
+      *value++ = '\0';
+      level = atoi(value);
+      if (level < 0 || level > TRACE_VERBOSE)
+        ok = 0;
+    }
+
+    for (int i = 0; i < TRACE_CATEGORIES; i++) {
+      if (strcmp(item, "all") == 0 || strcmp(item, category_names[i]) == 0) {
+        trace_levels[i] = level;
+        found = 1;
+      }
+    }
+
+    if (!found)
+      ok = 0;
+  }
+
+  free(copy);
+  return ok;
+}
@@ -0,0 +1,46 @@
+/* -*- c-basic-offset: 2 ; -*- */
+/*
+ * JCM-LISP
+ *
+ * Based on http://web.sonoma.edu/users/l/luvisi/sl3.c
+ * and http://peter.michaux.ca/archives
+ *
+ */
+
+enum {
+  TRACE_EVAL,
+  TRACE_GC,
+  TRACE_PIN,
+  TRACE_READER,
+  TRACE_CATEGORIES
+};
+
+/* How much to say: 1 for each event, 2 for the steps of one,
+ * 3 for every object touched. */
+enum {
+  TRACE_INFO = 1,
+  TRACE_DEBUG = 2,
+  TRACE_VERBOSE = 3
+};
+
+extern unsigned char trace_levels[TRACE_CATEGORIES];
+
+/* A byte load and a branch the compiler lays out as not taken. */
+#define tracing(category, level) \
+  __builtin_expect(trace_levels[category] >= (level), 0)
+
+#define TRACE(category, level, ...)             \
+  do {                                          \
+    if (tracing(category, level))               \
+      trace_printf(__VA_ARGS__);                \
+  } while (0)
+
+void trace_printf(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2)));
+void trace_object(Object *obj);
+void trace_flush(void);
+
+/* Turn on what SPEC names: a comma-separated list of categories
+ * (eval, gc, pin, reader or all), each optionally =LEVEL.
+ * Returns 0 if SPEC makes no sense. */
+int trace_configure(const char *spec);